@@ -0,0 +1,344 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// Huge pages size used to align the buffers
+#define LZLIB4_BENCH_HUGE_PAGE (2 << 20)
+
+
+/**
+ * @brief Current time in seconds
+ *
+ * @return double
+ */
+double lzlib4_bench_now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ * @brief Allocate a buffer for the benchmark data. With huge_pages the buffer is aligned to the huge page size and
+ *        the kernel is asked to use transparent huge pages, to check the effect of the TLB misses.
+ *
+ * @param size : Buffer size
+ * @param huge_pages : Use huge pages if available
+ * @return uint8_t* : The buffer, or NULL if there is no memory
+ */
+uint8_t * lzlib4_bench_alloc(size_t size, bool huge_pages) {
+#ifdef __linux__
+    if (huge_pages) {
+        void * buffer = NULL;
+        size_t aligned = (size + LZLIB4_BENCH_HUGE_PAGE - 1) / LZLIB4_BENCH_HUGE_PAGE * LZLIB4_BENCH_HUGE_PAGE;
+        if (posix_memalign(&buffer, LZLIB4_BENCH_HUGE_PAGE, aligned)) {
+            return NULL;
+        }
+        madvise(buffer, aligned, MADV_HUGEPAGE);
+        return (uint8_t *) buffer;
+    }
+#endif
+
+    return (uint8_t *) malloc(size);
+}
+
+
+void lzlib4_bench_free(uint8_t * buffer) {
+    free(buffer);
+}
+
+
+/**
+ * @brief Load the input file, or generate the synthetic image if there is no file
+ *
+ * @param options : Benchmark options
+ * @param size : Data size
+ * @return uint8_t* : Data buffer, or NULL if the file can't be readed
+ */
+uint8_t * lzlib4_bench_load(const lzlib4_bench_options &options, size_t * size) {
+    uint8_t * data = NULL;
+
+    if (options.path) {
+        FILE * file = fopen(options.path, "rb");
+        if (!file) {
+            return NULL;
+        }
+
+        fseek(file, 0, SEEK_END);
+        long file_size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        data = file_size > 0 ? lzlib4_bench_alloc(file_size, options.huge_pages) : NULL;
+        if (data && fread(data, 1, file_size, file) != (size_t) file_size) {
+            lzlib4_bench_free(data);
+            data = NULL;
+        }
+        fclose(file);
+
+        *size = data ? file_size : 0;
+        return data;
+    }
+
+    data = lzlib4_bench_alloc(options.synthetic_size, options.huge_pages);
+    if (!data) {
+        return NULL;
+    }
+
+    // Sectors of 2048 bytes of different kinds, like a disc image with text, tables, padding and compressed files
+    static const char * words[] = { "lzlib4 ", "block ", "sector ", "stream ", "image ", "data ", "the ", "of " };
+    uint32_t seed = 0x12345678;
+    for (size_t pos = 0; pos < options.synthetic_size; pos += 2048) {
+        size_t sector = std::min((size_t) 2048, options.synthetic_size - pos);
+        seed = seed * 1103515245 + 12345;
+        uint8_t kind = (seed >> 16) % 4;
+
+        for (size_t i = 0; i < sector; ) {
+            seed = seed * 1103515245 + 12345;
+            if (kind == 0) {
+                // Text
+                const char * word = words[(seed >> 16) % 8];
+                size_t length = std::min(strlen(word), sector - i);
+                memcpy(data + pos + i, word, length);
+                i += length;
+            }
+            else if (kind == 1) {
+                // Table of records with small numbers
+                data[pos + i] = (i % 16) < 4 ? (uint8_t) ((seed >> 16) & 0x0F) : (uint8_t) (i % 16);
+                i++;
+            }
+            else if (kind == 2) {
+                // Padding
+                data[pos + i] = 0;
+                i++;
+            }
+            else {
+                // Already compressed data
+                data[pos + i] = (uint8_t) (seed >> 16);
+                i++;
+            }
+        }
+    }
+
+    *size = options.synthetic_size;
+    return data;
+}
+
+
+/**
+ * @brief Parse a comma separated list of numbers
+ *
+ * @param text : List
+ * @param list : Parsed numbers
+ * @return bool : true if the list is right
+ */
+bool lzlib4_bench_parse_list(const char * text, std::vector<size_t> &list) {
+    list.clear();
+
+    while (*text) {
+        char * end = NULL;
+        unsigned long long value = strtoull(text, &end, 10);
+        if (end == text) {
+            return false;
+        }
+
+        list.push_back((size_t) value);
+        text = *end == ',' ? end + 1 : end;
+    }
+
+    return !list.empty();
+}
+
+
+/**
+ * @brief Parse an option shared by all the benchmarks
+ *
+ * @param argc : Arguments count
+ * @param argv : Arguments
+ * @param i : Index of the current argument. Is moved to the last argument used by the option.
+ * @param options : Options to fill
+ * @return int : 1 if the option was parsed, 0 if is not a common option, -1 if the option value is wrong
+ */
+int lzlib4_bench_parse_option(int argc, char ** argv, int * i, lzlib4_bench_options &options) {
+    const char * option = argv[*i];
+    const char * value = *i + 1 < argc ? argv[*i + 1] : NULL;
+
+    if (!strcmp(option, "--huge-pages")) {
+        options.huge_pages = true;
+        return 1;
+    }
+    if (option[0] != '-') {
+        options.path = option;
+        return 1;
+    }
+
+    if (!value) {
+        return 0;
+    }
+
+    bool right = true;
+    if (!strcmp(option, "-b")) {
+        right = lzlib4_bench_parse_list(value, options.block_sizes);
+    }
+    else if (!strcmp(option, "-l")) {
+        right = lzlib4_bench_parse_list(value, options.levels);
+    }
+    else if (!strcmp(option, "-c")) {
+        options.chunk_size = strtoull(value, NULL, 10);
+        right = options.chunk_size > 0;
+    }
+    else if (!strcmp(option, "-n")) {
+        options.iterations = strtoul(value, NULL, 10);
+        right = options.iterations > 0;
+    }
+    else if (!strcmp(option, "-s")) {
+        options.synthetic_size = strtoull(value, NULL, 10) << 20;
+        right = options.synthetic_size > 0;
+    }
+    else {
+        return 0;
+    }
+
+    (*i)++;
+    return right ? 1 : -1;
+}
+
+
+/**
+ * @brief Compress the data calling compress for every chunk, and finish the stream
+ *
+ * @param compressor : Compressor
+ * @param in : Input data
+ * @param in_size : Input size
+ * @param out : Output buffer
+ * @param out_size : Output buffer size
+ * @param chunk_size : Size of every compress call
+ * @return size_t : Compressed size, 0 if there was an error
+ */
+size_t lzlib4_bench_compress(lzlib4 &compressor, const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size, size_t chunk_size) {
+    compressor.strm.next_out = out;
+    compressor.strm.avail_out = out_size;
+
+    for (size_t pos = 0; pos < in_size; pos += chunk_size) {
+        compressor.strm.next_in = (uint8_t *) in + pos;
+        compressor.strm.avail_in = std::min(chunk_size, in_size - pos);
+        if (compressor.compress(LZLIB4_NO_FLUSH) != LZLIB4_RC_OK) {
+            return 0;
+        }
+    }
+
+    if (compressor.compress(LZLIB4_FINISH) != LZLIB4_RC_OK) {
+        return 0;
+    }
+
+    return out_size - compressor.strm.avail_out;
+}
+
+
+/**
+ * @brief Decompress a whole stream
+ *
+ * @param in : Compressed stream
+ * @param in_size : Compressed size
+ * @param out : Output buffer
+ * @param out_size : Output buffer size, must be the uncompressed size
+ * @return bool : true if the whole stream was decompressed
+ */
+bool lzlib4_bench_decompress(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size) {
+    lzlib4 decompressor;
+    decompressor.strm.next_in = (uint8_t *) in;
+    decompressor.strm.avail_in = in_size;
+    decompressor.strm.next_out = out;
+    decompressor.strm.avail_out = out_size;
+
+    return decompressor.decompress(false) == LZLIB4_RC_OK && !decompressor.strm.avail_out;
+}
+
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: lzlib4_bench [command] [options] [file]\n"
+        "\n"
+        "Commands:\n"
+        "  throughput       compress, decompress and crc32 speed with hardware counters (default)\n"
+        "  latency          latency percentiles of the sector reads of a trace\n"
+        "  threads          aggregate speed and scaling of 1..N threads with a stream per unit\n"
+        "\n"
+        "Common options:\n"
+        "  -b sizes         block sizes, comma separated (default 16384,65280)\n"
+        "  -l levels        compression levels, comma separated (default 1,9)\n"
+        "  -c size          size of every compress call (default 2048)\n"
+        "  -n iterations    iterations of every measure (default 3)\n"
+        "  -s megabytes     synthetic image size when there is no file (default 64)\n"
+        "  --huge-pages     use transparent huge pages for the data buffers\n"
+        "\n"
+        "Latency options:\n"
+        "  --trace kind     uniform, zipf, seqjump or a trace file with \"<sector> [sectors]\" lines (default zipf)\n"
+        "  -r reads         reads of the synthetic traces (default 100000)\n"
+        "  -S size          sector size (default 2048)\n"
+        "  -t threads       reader threads, comma separated (default 1,4)\n"
+        "  -C blocks        cache sizes in blocks, comma separated (default 0,64)\n"
+        "  --mode mode      linked, independent or both (default both)\n"
+        "  --crc            check the blocks crc\n"
+        "\n"
+        "Threads options (the last block size and the first level are used):\n"
+        "  -t threads       thread counts, comma separated (default 1, 2, 4... up to the hardware threads)\n"
+        "  -u kilobytes     unit size, every unit is a new stream (default 1024)\n"
+        "  -R rounds        times that all the units are processed (default 2)\n"
+        "  --mode mode      threads, pool or both (default both)\n"
+    );
+}
+
+
+int main(int argc, char ** argv) {
+    const char * command = argc > 1 ? argv[1] : "";
+
+    if (!strcmp(command, "-h") || !strcmp(command, "--help")) {
+        usage();
+        return 0;
+    }
+
+    int return_code = -1;
+    if (!strcmp(command, "throughput")) {
+        return_code = lzlib4_bench_throughput(argc - 1, argv + 1);
+    }
+    else if (!strcmp(command, "latency")) {
+        return_code = lzlib4_bench_latency(argc - 1, argv + 1);
+    }
+    else if (!strcmp(command, "threads")) {
+        return_code = lzlib4_bench_threads(argc - 1, argv + 1);
+    }
+    else {
+        return_code = lzlib4_bench_throughput(argc, argv);
+    }
+
+    if (return_code < 0) {
+        usage();
+        return 1;
+    }
+
+    return return_code;
+}
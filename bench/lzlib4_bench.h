@@ -0,0 +1,67 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Benchmark harness. Every benchmark is a command of the lzlib4_bench executable:
+ *
+ *   lzlib4_bench [throughput] [options] [file]   compress, decompress and crc32 speed, with hardware counters
+ *   lzlib4_bench latency [options] [file]        latency of the sector reads of a trace (lzlib4_reader)
+ *   lzlib4_bench threads [options] [file]        multi-stream scaling from 1 to N threads
+ *
+ * When no file is given, a synthetic image (a mix of text, repeated structures, zeroes and random data) is used,
+ * so the results can be compared between machines. The helpers of this header are shared by all the commands.
+ *
+ * Build example:
+ *   g++ -O2 -pthread bench/lzlib4_bench*.cpp bench/lzlib4_perf.cpp lzlib4*.cpp -llz4 -o lzlib4_bench
+ **/
+
+#ifndef LZLIB4_BENCH_H
+#define LZLIB4_BENCH_H
+
+#include "../lzlib4.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Common options of all the benchmarks
+struct lzlib4_bench_options {
+    const char * path = NULL;
+    size_t synthetic_size = 64 << 20;
+    std::vector<size_t> block_sizes = { 16384, LZLIB4_BLOCK_SIZE };
+    std::vector<size_t> levels = { 1, LZ4HC_CLEVEL_DEFAULT };
+    // Size of every compress call, like the sectors written by an image converter
+    size_t chunk_size = 2048;
+    uint32_t iterations = 3;
+    bool huge_pages = false;
+};
+
+double lzlib4_bench_now();
+uint8_t * lzlib4_bench_alloc(size_t size, bool huge_pages);
+void lzlib4_bench_free(uint8_t * buffer);
+uint8_t * lzlib4_bench_load(const lzlib4_bench_options &options, size_t * size);
+bool lzlib4_bench_parse_list(const char * text, std::vector<size_t> &list);
+int lzlib4_bench_parse_option(int argc, char ** argv, int * i, lzlib4_bench_options &options);
+size_t lzlib4_bench_compress(lzlib4 &compressor, const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size, size_t chunk_size);
+bool lzlib4_bench_decompress(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size);
+
+int lzlib4_bench_throughput(int argc, char ** argv);
+int lzlib4_bench_latency(int argc, char ** argv);
+int lzlib4_bench_threads(int argc, char ** argv);
+
+#endif
@@ -0,0 +1,435 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Random access latency benchmark. A trace of sector reads is replayed against a compressed image using
+ * lzlib4_reader, and the latency of every read is measured, so the tail latency (p99, p999) can be compared
+ * between configurations and not only the average speed.
+ *
+ * The traces can be synthetic:
+ *   uniform    every sector has the same probability
+ *   zipf       a few sectors (spread over the image) are readed much more than the others, like the game data
+ *   seqjump    sequential reads with random jumps, like the streaming of videos and music
+ *
+ * or a file recorded from an emulator, with a read per line: "<sector> [sectors]".
+ *
+ * Every configuration is a combination of block size, block mode (linked or independent), cache size and threads.
+ * The cache keeps the last decompressed blocks (LRU), shared by all the threads.
+ **/
+
+#include "lzlib4_bench.h"
+#include "../lzlib4_reader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// A read of the trace
+struct lzlib4_bench_read {
+    uint64_t sector = 0;
+    uint32_t sectors = 1;
+};
+
+// Latency benchmark options
+struct lzlib4_bench_latency_options {
+    const char * trace = "zipf";
+    size_t requests = 100000;
+    size_t sector_size = 2048;
+    std::vector<size_t> threads = { 1, 4 };
+    std::vector<size_t> cache_sizes = { 0, 64 };
+    bool linked = true;
+    bool independent = true;
+    bool check_crc = false;
+};
+
+
+/**
+ * Shared LRU cache of decompressed blocks. The blocks are decompressed out of the lock, so two threads can decompress
+ * the same block at the same time, but the lock is never kept while decompressing.
+ */
+class lzlib4_bench_cache {
+    public:
+        lzlib4_bench_cache(size_t blocks) : capacity(blocks) {}
+
+        bool get(uint64_t block, size_t offset, uint8_t * out, size_t size) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = entries.find(block);
+            if (found == entries.end()) {
+                return false;
+            }
+
+            lru.splice(lru.begin(), lru, found->second);
+            const std::vector<uint8_t> &data = found->second->second;
+            if (offset + size > data.size()) {
+                return false;
+            }
+            memcpy(out, data.data() + offset, size);
+            return true;
+        }
+
+        void put(uint64_t block, std::vector<uint8_t> &data) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!capacity || entries.count(block)) {
+                return;
+            }
+
+            if (entries.size() >= capacity) {
+                entries.erase(lru.back().first);
+                lru.pop_back();
+            }
+
+            lru.emplace_front(block, std::vector<uint8_t>());
+            lru.front().second.swap(data);
+            entries[block] = lru.begin();
+        }
+
+    private:
+        size_t capacity;
+        std::mutex mutex;
+        std::list<std::pair<uint64_t, std::vector<uint8_t>>> lru;
+        std::unordered_map<uint64_t, std::list<std::pair<uint64_t, std::vector<uint8_t>>>::iterator> entries;
+};
+
+
+/**
+ * @brief Create the synthetic trace, or load the trace file
+ *
+ * @param options : Latency options
+ * @param sectors : Sectors of the image
+ * @param trace : Trace reads
+ * @return bool : true if the trace was created
+ */
+static bool load_trace(const lzlib4_bench_latency_options &options, uint64_t sectors, std::vector<lzlib4_bench_read> &trace) {
+    trace.clear();
+    if (!sectors) {
+        return false;
+    }
+
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    auto next_random = [&seed]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
+    };
+
+    if (!strcmp(options.trace, "uniform")) {
+        for (size_t i = 0; i < options.requests; i++) {
+            lzlib4_bench_read read;
+            read.sector = next_random() % sectors;
+            trace.push_back(read);
+        }
+    }
+    else if (!strcmp(options.trace, "zipf")) {
+        // Zipf distribution with s = 1 over the ranks, using the cumulative weights. The ranks are spread over the
+        // image with a multiplicative hash, so the popular sectors are not all together.
+        std::vector<double> cumulative(sectors);
+        double total = 0;
+        for (uint64_t rank = 0; rank < sectors; rank++) {
+            total += 1.0 / (rank + 1);
+            cumulative[rank] = total;
+        }
+
+        for (size_t i = 0; i < options.requests; i++) {
+            double value = (next_random() >> 11) * (1.0 / 9007199254740992.0) * total;
+            uint64_t rank = std::lower_bound(cumulative.begin(), cumulative.end(), value) - cumulative.begin();
+            lzlib4_bench_read read;
+            read.sector = (std::min(rank, sectors - 1) * 0x9E3779B1ULL) % sectors;
+            trace.push_back(read);
+        }
+    }
+    else if (!strcmp(options.trace, "seqjump")) {
+        // Sequential reads of 1-16 sectors with a jump every 1% of the reads
+        uint64_t sector = 0;
+        for (size_t i = 0; i < options.requests; i++) {
+            uint64_t random = next_random();
+            if (random % 100 == 0) {
+                sector = (random >> 8) % sectors;
+            }
+
+            lzlib4_bench_read read;
+            read.sector = sector;
+            read.sectors = (uint32_t) std::min((uint64_t) ((random >> 32) % 16 + 1), sectors - sector);
+            trace.push_back(read);
+            sector = (sector + read.sectors) % sectors;
+        }
+    }
+    else {
+        FILE * file = fopen(options.trace, "r");
+        if (!file) {
+            return false;
+        }
+
+        char line[256];
+        while (fgets(line, sizeof(line), file)) {
+            char * end = NULL;
+            unsigned long long sector = strtoull(line, &end, 10);
+            if (end == line) {
+                continue;
+            }
+
+            unsigned long count = strtoul(end, NULL, 10);
+            lzlib4_bench_read read;
+            read.sector = sector % sectors;
+            read.sectors = (uint32_t) std::min((uint64_t) std::max(count, 1UL), sectors - read.sector);
+            trace.push_back(read);
+        }
+        fclose(file);
+    }
+
+    return !trace.empty();
+}
+
+
+/**
+ * @brief Read a range using the cache. Every block touched by the range is taken from the cache or decompressed
+ *        and stored into the cache.
+ *
+ * @return int : LZLIB4_RC_OK if the range was readed, negative number otherwise.
+ */
+static int cached_read(const lzlib4_reader &reader, lzlib4_bench_cache * cache, size_t block_size, uint64_t offset, uint8_t * out, size_t size, bool check_crc) {
+    if (!cache) {
+        return reader.read(offset, out, size, check_crc);
+    }
+
+    while (size) {
+        uint64_t block = offset / block_size;
+        size_t block_offset = offset % block_size;
+        size_t to_copy = std::min(size, block_size - block_offset);
+
+        if (!cache->get(block, block_offset, out, to_copy)) {
+            size_t block_length = std::min((uint64_t) block_size, reader.size() - block * block_size);
+            std::vector<uint8_t> data(block_length);
+            int return_code = reader.read(block * block_size, data.data(), block_length, check_crc);
+            if (return_code != LZLIB4_RC_OK) {
+                return return_code;
+            }
+
+            memcpy(out, data.data() + block_offset, to_copy);
+            cache->put(block, data);
+        }
+
+        out += to_copy;
+        offset += to_copy;
+        size -= to_copy;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Run the latency benchmark
+ *
+ * @param argc : Arguments count, the first one is the command name
+ * @param argv : Arguments
+ * @return int : 0 if everything was right, 1 if there was an error, -1 if the options are wrong
+ */
+int lzlib4_bench_latency(int argc, char ** argv) {
+    lzlib4_bench_options options;
+    lzlib4_bench_latency_options latency;
+
+    for (int i = 1; i < argc; i++) {
+        int parsed = lzlib4_bench_parse_option(argc, argv, &i, options);
+        if (parsed < 0) {
+            return -1;
+        }
+        if (parsed) {
+            continue;
+        }
+
+        const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            return -1;
+        }
+
+        bool right = true;
+        if (!strcmp(argv[i], "-t")) {
+            right = lzlib4_bench_parse_list(value, latency.threads);
+        }
+        else if (!strcmp(argv[i], "-C")) {
+            right = lzlib4_bench_parse_list(value, latency.cache_sizes);
+        }
+        else if (!strcmp(argv[i], "-r")) {
+            latency.requests = strtoull(value, NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-S")) {
+            latency.sector_size = strtoull(value, NULL, 10);
+            right = latency.sector_size > 0;
+        }
+        else if (!strcmp(argv[i], "--trace")) {
+            latency.trace = value;
+        }
+        else if (!strcmp(argv[i], "--mode")) {
+            latency.linked = !strcmp(value, "linked") || !strcmp(value, "both");
+            latency.independent = !strcmp(value, "independent") || !strcmp(value, "both");
+            right = latency.linked || latency.independent;
+        }
+        else if (!strcmp(argv[i], "--crc")) {
+            latency.check_crc = true;
+            continue;
+        }
+        else {
+            return -1;
+        }
+
+        if (!right) {
+            return -1;
+        }
+        i++;
+    }
+
+    size_t in_size = 0;
+    uint8_t * in = lzlib4_bench_load(options, &in_size);
+    if (!in) {
+        fprintf(stderr, "Error loading the input data\n");
+        return 1;
+    }
+
+    std::vector<lzlib4_bench_read> trace;
+    if (!load_trace(latency, in_size / latency.sector_size, trace)) {
+        fprintf(stderr, "Error loading the trace\n");
+        lzlib4_bench_free(in);
+        return 1;
+    }
+
+    printf("Input: %zu bytes, trace %s with %zu reads of %zu bytes sectors\n\n", in_size, latency.trace, trace.size(), latency.sector_size);
+    printf("%8s %-11s %6s %7s %10s %9s %9s %9s %9s %9s\n", "block", "mode", "cache", "threads", "reads/s", "MB/s", "avg us", "p50 us", "p99 us", "p999 us");
+
+    int return_code = 0;
+    for (size_t b = 0; b < options.block_sizes.size() && !return_code; b++) {
+        for (uint8_t mode = 0; mode < 2 && !return_code; mode++) {
+            if ((mode == 0 && !latency.linked) || (mode == 1 && !latency.independent)) {
+                continue;
+            }
+
+            // Create the image with index, so the reader doesn't have to read all the headers
+            lzlib4 compressor(options.block_sizes[b], LZLIB4_INPUT_SPLIT, (int8_t) options.levels[0]);
+            compressor.set_index_mode(true);
+            compressor.set_independent_blocks(mode == 1);
+            size_t out_size = compressor.compress_bound(in_size);
+            uint8_t * image = lzlib4_bench_alloc(out_size, options.huge_pages);
+            size_t image_size = image ? lzlib4_bench_compress(compressor, in, in_size, image, out_size, options.chunk_size) : 0;
+
+            lzlib4_reader reader;
+            if (!image_size || reader.open(image, image_size) != LZLIB4_RC_OK) {
+                fprintf(stderr, "Error creating the image (block %zu)\n", options.block_sizes[b]);
+                lzlib4_bench_free(image);
+                return_code = 1;
+                break;
+            }
+
+            for (size_t c = 0; c < latency.cache_sizes.size() && !return_code; c++) {
+                for (size_t t = 0; t < latency.threads.size() && !return_code; t++) {
+                    size_t threads = std::max((size_t) 1, latency.threads[t]);
+                    lzlib4_bench_cache cache(latency.cache_sizes[c]);
+                    lzlib4_bench_cache * used_cache = latency.cache_sizes[c] ? &cache : NULL;
+
+                    // The threads take the trace reads in order
+                    std::atomic<size_t> next_read(0);
+                    std::atomic<bool> failed(false);
+                    std::vector<std::vector<double>> latencies(threads);
+                    std::vector<std::thread> workers;
+
+                    double start = lzlib4_bench_now();
+                    for (size_t thread = 0; thread < threads; thread++) {
+                        workers.emplace_back([&, thread]() {
+                            std::vector<uint8_t> buffer;
+                            std::vector<double> &thread_latencies = latencies[thread];
+                            thread_latencies.reserve(trace.size() / threads + 1);
+
+                            for (size_t current = next_read++; current < trace.size(); current = next_read++) {
+                                const lzlib4_bench_read &read = trace[current];
+                                size_t size = read.sectors * latency.sector_size;
+                                buffer.resize(size);
+
+                                double read_start = lzlib4_bench_now();
+                                int read_code = cached_read(reader, used_cache, options.block_sizes[b], read.sector * latency.sector_size, buffer.data(), size, latency.check_crc);
+                                thread_latencies.push_back(lzlib4_bench_now() - read_start);
+
+                                if (read_code != LZLIB4_RC_OK || memcmp(buffer.data(), in + read.sector * latency.sector_size, size)) {
+                                    failed = true;
+                                    break;
+                                }
+                            }
+                        });
+                    }
+                    for (size_t thread = 0; thread < threads; thread++) {
+                        workers[thread].join();
+                    }
+                    double seconds = lzlib4_bench_now() - start;
+
+                    if (failed) {
+                        fprintf(stderr, "Wrong data readed (block %zu)\n", options.block_sizes[b]);
+                        return_code = 1;
+                        break;
+                    }
+
+                    std::vector<double> all;
+                    size_t bytes = 0;
+                    for (size_t thread = 0; thread < threads; thread++) {
+                        all.insert(all.end(), latencies[thread].begin(), latencies[thread].end());
+                    }
+                    for (size_t i = 0; i < trace.size(); i++) {
+                        bytes += trace[i].sectors * latency.sector_size;
+                    }
+                    std::sort(all.begin(), all.end());
+
+                    double average = 0;
+                    for (size_t i = 0; i < all.size(); i++) {
+                        average += all[i];
+                    }
+                    average /= all.size();
+
+                    auto percentile = [&all](double p) {
+                        size_t position = (size_t) std::ceil(p * all.size());
+                        return all[std::min(all.size() - 1, position ? position - 1 : 0)] * 1e6;
+                    };
+
+                    printf(
+                        "%8zu %-11s %6zu %7zu %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                        options.block_sizes[b],
+                        mode ? "independent" : "linked",
+                        latency.cache_sizes[c],
+                        threads,
+                        all.size() / seconds,
+                        bytes / seconds / 1e6,
+                        average * 1e6,
+                        percentile(0.5),
+                        percentile(0.99),
+                        percentile(0.999)
+                    );
+                }
+            }
+
+            reader.close();
+            lzlib4_bench_free(image);
+        }
+    }
+
+    lzlib4_bench_free(in);
+
+    return return_code;
+}
@@ -0,0 +1,308 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Thread scaling benchmark. The input is splitted in units (like the requests of a server), and every unit is
+ * compressed as a new stream: a new lzlib4 object is created, the unit is compressed and the object is closed. Then
+ * the same is done to decompress the units. The units are processed by 1..N threads, using its own threads or a
+ * shared lzlib4_pool, and the aggregate speed is compared with the speed of one thread.
+ *
+ * The time spent creating and closing the lzlib4 objects is measured separately, because every stream allocates its
+ * buffers with malloc and frees them in close(), so the allocator contention appears there when the threads grow.
+ **/
+
+#include "lzlib4_bench.h"
+#include "../lzlib4_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+// Threads benchmark options
+struct lzlib4_bench_threads_options {
+    std::vector<size_t> threads;
+    size_t unit_size = 1 << 20;
+    uint32_t rounds = 2;
+    bool own_threads = true;
+    bool shared_pool = true;
+};
+
+// Result of a phase. The times are the sum of all the threads.
+struct lzlib4_bench_phase {
+    double seconds = 0;
+    std::atomic<uint64_t> setup_ns;
+    std::atomic<uint64_t> work_ns;
+    std::atomic<bool> failed;
+
+    lzlib4_bench_phase() : setup_ns(0), work_ns(0), failed(false) {}
+};
+
+
+static uint64_t elapsed_ns(double start) {
+    return (uint64_t) ((lzlib4_bench_now() - start) * 1e9);
+}
+
+
+/**
+ * @brief Run a phase over all the units of all the rounds, using own threads or the shared pool
+ *
+ * @param threads : Threads count
+ * @param pool : Shared pool, or NULL to use own threads
+ * @param units : Units count of every round
+ * @param rounds : Rounds
+ * @param phase : Phase result
+ * @param unit_task : Function that process a unit. The second argument is false in the repeated rounds, where the
+ *                    result must not be kept because other thread can be working with the same unit.
+ */
+static void run_phase(size_t threads, lzlib4_pool * pool, size_t units, uint32_t rounds, lzlib4_bench_phase &phase, const std::function<void(size_t, bool)> &unit_task) {
+    size_t tasks = units * rounds;
+    double start = lzlib4_bench_now();
+
+    if (pool) {
+        pool->run(tasks, [&](size_t task) { unit_task(task % units, task < units); });
+    }
+    else {
+        std::atomic<size_t> next_task(0);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([&]() {
+                for (size_t task = next_task++; task < tasks; task = next_task++) {
+                    unit_task(task % units, task < units);
+                }
+            });
+        }
+        for (size_t i = 0; i < threads; i++) {
+            workers[i].join();
+        }
+    }
+
+    phase.seconds = lzlib4_bench_now() - start;
+}
+
+
+/**
+ * @brief Run the thread scaling benchmark
+ *
+ * @param argc : Arguments count, the first one is the command name
+ * @param argv : Arguments
+ * @return int : 0 if everything was right, 1 if there was an error, -1 if the options are wrong
+ */
+int lzlib4_bench_threads(int argc, char ** argv) {
+    lzlib4_bench_options options;
+    lzlib4_bench_threads_options scaling;
+
+    for (int i = 1; i < argc; i++) {
+        int parsed = lzlib4_bench_parse_option(argc, argv, &i, options);
+        if (parsed < 0) {
+            return -1;
+        }
+        if (parsed) {
+            continue;
+        }
+
+        const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            return -1;
+        }
+
+        bool right = true;
+        if (!strcmp(argv[i], "-t")) {
+            right = lzlib4_bench_parse_list(value, scaling.threads);
+        }
+        else if (!strcmp(argv[i], "-u")) {
+            scaling.unit_size = strtoull(value, NULL, 10) << 10;
+            right = scaling.unit_size > 0;
+        }
+        else if (!strcmp(argv[i], "-R")) {
+            scaling.rounds = strtoul(value, NULL, 10);
+            right = scaling.rounds > 0;
+        }
+        else if (!strcmp(argv[i], "--mode")) {
+            scaling.own_threads = !strcmp(value, "threads") || !strcmp(value, "both");
+            scaling.shared_pool = !strcmp(value, "pool") || !strcmp(value, "both");
+            right = scaling.own_threads || scaling.shared_pool;
+        }
+        else {
+            return -1;
+        }
+
+        if (!right) {
+            return -1;
+        }
+        i++;
+    }
+
+    // By default 1, 2, 4... up to the hardware threads
+    if (scaling.threads.empty()) {
+        size_t hardware = std::max(1U, std::thread::hardware_concurrency());
+        for (size_t threads = 1; threads < hardware; threads *= 2) {
+            scaling.threads.push_back(threads);
+        }
+        scaling.threads.push_back(hardware);
+    }
+
+    size_t in_size = 0;
+    uint8_t * in = lzlib4_bench_load(options, &in_size);
+    if (!in) {
+        fprintf(stderr, "Error loading the input data\n");
+        return 1;
+    }
+
+    size_t units = (in_size + scaling.unit_size - 1) / scaling.unit_size;
+    size_t block_size = options.block_sizes.back();
+    int8_t level = (int8_t) options.levels[0];
+
+    // Compressed units. Every unit has space for the worst case.
+    size_t unit_bound;
+    {
+        lzlib4 compressor(block_size, LZLIB4_INPUT_SPLIT, level);
+        unit_bound = compressor.compress_bound(scaling.unit_size);
+    }
+    uint8_t * compressed = lzlib4_bench_alloc(units * unit_bound, options.huge_pages);
+    uint8_t * decompressed = lzlib4_bench_alloc(in_size, options.huge_pages);
+    std::vector<size_t> compressed_sizes(units, 0);
+    if (!compressed || !decompressed) {
+        fprintf(stderr, "There is no memory for the output buffers\n");
+        lzlib4_bench_free(compressed);
+        lzlib4_bench_free(decompressed);
+        lzlib4_bench_free(in);
+        return 1;
+    }
+
+    printf("Input: %zu bytes in %zu units of %zu bytes, %u rounds, block %zu, level %d\n\n", in_size, units, scaling.unit_size, scaling.rounds, block_size, level);
+    printf("%-8s %7s %12s %10s %12s %10s %10s %10s\n", "mode", "threads", "compress", "scaling", "decompress", "scaling", "setup c", "setup d");
+    printf("%-8s %7s %12s %10s %12s %10s %10s %10s\n", "", "", "MB/s", "", "MB/s", "", "% time", "% time");
+
+    int return_code = 0;
+    for (uint8_t mode = 0; mode < 2 && !return_code; mode++) {
+        if ((mode == 0 && !scaling.own_threads) || (mode == 1 && !scaling.shared_pool)) {
+            continue;
+        }
+
+        double single_compress = 0;
+        double single_decompress = 0;
+
+        for (size_t t = 0; t < scaling.threads.size() && !return_code; t++) {
+            size_t threads = std::max((size_t) 1, scaling.threads[t]);
+            lzlib4_pool * pool = mode ? new lzlib4_pool(threads) : NULL;
+
+            // Compression: a new stream for every unit
+            lzlib4_bench_phase compress_phase;
+            run_phase(threads, pool, units, scaling.rounds, compress_phase, [&](size_t unit, bool keep) {
+                size_t offset = unit * scaling.unit_size;
+                size_t size = std::min(scaling.unit_size, in_size - offset);
+                thread_local std::vector<uint8_t> scratch;
+                uint8_t * out = compressed + unit * unit_bound;
+                if (!keep) {
+                    scratch.resize(unit_bound);
+                    out = scratch.data();
+                }
+
+                double start = lzlib4_bench_now();
+                lzlib4 * compressor = new lzlib4(block_size, LZLIB4_INPUT_SPLIT, level);
+                compress_phase.setup_ns += elapsed_ns(start);
+
+                start = lzlib4_bench_now();
+                size_t written = lzlib4_bench_compress(*compressor, in + offset, size, out, unit_bound, options.chunk_size);
+                compress_phase.work_ns += elapsed_ns(start);
+
+                start = lzlib4_bench_now();
+                delete compressor;
+                compress_phase.setup_ns += elapsed_ns(start);
+
+                if (!written) {
+                    compress_phase.failed = true;
+                }
+                if (keep) {
+                    compressed_sizes[unit] = written;
+                }
+            });
+
+            // Decompression: a new stream for every unit
+            lzlib4_bench_phase decompress_phase;
+            run_phase(threads, pool, units, scaling.rounds, decompress_phase, [&](size_t unit, bool keep) {
+                size_t offset = unit * scaling.unit_size;
+                size_t size = std::min(scaling.unit_size, in_size - offset);
+                thread_local std::vector<uint8_t> scratch;
+                uint8_t * out = decompressed + offset;
+                if (!keep) {
+                    scratch.resize(size);
+                    out = scratch.data();
+                }
+
+                double start = lzlib4_bench_now();
+                lzlib4 * decompressor = new lzlib4();
+                decompress_phase.setup_ns += elapsed_ns(start);
+
+                start = lzlib4_bench_now();
+                decompressor->strm.next_in = compressed + unit * unit_bound;
+                decompressor->strm.avail_in = compressed_sizes[unit];
+                decompressor->strm.next_out = out;
+                decompressor->strm.avail_out = size;
+                bool right = decompressor->decompress(false) == LZLIB4_RC_OK && !decompressor->strm.avail_out;
+                decompress_phase.work_ns += elapsed_ns(start);
+
+                start = lzlib4_bench_now();
+                delete decompressor;
+                decompress_phase.setup_ns += elapsed_ns(start);
+
+                if (!right) {
+                    decompress_phase.failed = true;
+                }
+            });
+
+            delete pool;
+
+            if (compress_phase.failed || decompress_phase.failed || memcmp(in, decompressed, in_size)) {
+                fprintf(stderr, "The decompressed data doesn't match (%zu threads)\n", threads);
+                return_code = 1;
+                break;
+            }
+
+            double bytes = (double) in_size * scaling.rounds;
+            double compress_speed = bytes / compress_phase.seconds / 1e6;
+            double decompress_speed = bytes / decompress_phase.seconds / 1e6;
+            if (t == 0) {
+                single_compress = compress_speed / threads;
+                single_decompress = decompress_speed / threads;
+            }
+
+            // Scaling efficiency compared with the first measure, per thread
+            printf(
+                "%-8s %7zu %12.1f %9.0f%% %12.1f %9.0f%% %9.2f%% %9.2f%%\n",
+                mode ? "pool" : "threads",
+                threads,
+                compress_speed,
+                compress_speed / (single_compress * threads) * 100,
+                decompress_speed,
+                decompress_speed / (single_decompress * threads) * 100,
+                compress_phase.setup_ns * 100.0 / (compress_phase.setup_ns + compress_phase.work_ns),
+                decompress_phase.setup_ns * 100.0 / (decompress_phase.setup_ns + decompress_phase.work_ns)
+            );
+        }
+    }
+
+    lzlib4_bench_free(compressed);
+    lzlib4_bench_free(decompressed);
+    lzlib4_bench_free(in);
+
+    return return_code;
+}
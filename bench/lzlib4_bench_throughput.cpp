@@ -0,0 +1,182 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Throughput benchmark. Every configuration (block size and compression level) is compressed, decompressed and
+ * checked with crc32, and the hardware counters of every operation are reported per byte or per KB of
+ * uncompressed data. The counters allow to know if a change in the speed comes from the cache, the TLB or the
+ * branch prediction.
+ **/
+
+#include "lzlib4_bench.h"
+#include "lzlib4_perf.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+
+/**
+ * @brief Print a result row. The counters are the best iteration (the one with less cycles).
+ *
+ * @param operation : Operation name
+ * @param block_size : Block size
+ * @param level : Compression level
+ * @param bytes : Uncompressed bytes processed by every iteration
+ * @param seconds : Best time
+ * @param values : Counters of the best iteration
+ */
+static void print_row(const char * operation, size_t block_size, size_t level, size_t bytes, double seconds, const lzlib4_perf_values &values) {
+    double kbytes = bytes / 1024.0;
+    printf("%-10s %8zu %5zu %9.1f", operation, block_size, level, bytes / seconds / 1e6);
+
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        if (!values.available[i]) {
+            printf(" %13s", "n/a");
+        }
+        else if (i == LZLIB4_PERF_CYCLES || i == LZLIB4_PERF_INSTRUCTIONS) {
+            // Per byte
+            printf(" %13.3f", values.value[i] / (double) bytes);
+        }
+        else {
+            // Per KB
+            printf(" %13.3f", values.value[i] / kbytes);
+        }
+    }
+    printf("\n");
+}
+
+
+/**
+ * @brief Run the throughput benchmark
+ *
+ * @param argc : Arguments count, the first one is the command name
+ * @param argv : Arguments
+ * @return int : 0 if everything was right, 1 if there was an error, -1 if the options are wrong
+ */
+int lzlib4_bench_throughput(int argc, char ** argv) {
+    lzlib4_bench_options options;
+    for (int i = 1; i < argc; i++) {
+        if (lzlib4_bench_parse_option(argc, argv, &i, options) != 1) {
+            return -1;
+        }
+    }
+
+    size_t in_size = 0;
+    uint8_t * in = lzlib4_bench_load(options, &in_size);
+    if (!in) {
+        fprintf(stderr, "Error loading the input data\n");
+        return 1;
+    }
+    uint8_t * check = lzlib4_bench_alloc(in_size, options.huge_pages);
+
+    lzlib4_perf_counters counters;
+    if (!counters.open()) {
+        fprintf(stderr, "Hardware counters are not available, only the speed will be reported\n");
+    }
+
+    printf("Input: %zu bytes, %u iterations, chunks of %zu bytes%s\n\n", in_size, options.iterations, options.chunk_size, options.huge_pages ? ", huge pages" : "");
+    printf("%-10s %8s %5s %9s", "operation", "block", "level", "MB/s");
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        printf(" %13s", lzlib4_perf_counters::name((lzlib4_perf_event) i));
+    }
+    printf("\n%-34s %13s %13s %13s %13s %13s %13s\n", "", "/byte", "/byte", "/KB", "/KB", "/KB", "/KB");
+
+    int return_code = 0;
+    for (size_t b = 0; b < options.block_sizes.size() && !return_code; b++) {
+        for (size_t l = 0; l < options.levels.size() && !return_code; l++) {
+            lzlib4 compressor(options.block_sizes[b], LZLIB4_INPUT_SPLIT, (int8_t) options.levels[l]);
+            size_t out_size = compressor.compress_bound(in_size);
+            uint8_t * out = lzlib4_bench_alloc(out_size, options.huge_pages);
+            if (!out || !check) {
+                fprintf(stderr, "There is no memory for the output buffers\n");
+                lzlib4_bench_free(out);
+                return_code = 1;
+                break;
+            }
+
+            size_t compressed = 0;
+            double best[3] = { 1e30, 1e30, 1e30 };
+            lzlib4_perf_values best_values[3];
+
+            for (uint32_t iteration = 0; iteration < options.iterations; iteration++) {
+                lzlib4_perf_values values;
+
+                // Compression
+                double start = lzlib4_bench_now();
+                counters.start();
+                compressed = lzlib4_bench_compress(compressor, in, in_size, out, out_size, options.chunk_size);
+                counters.stop(values);
+                double seconds = lzlib4_bench_now() - start;
+                if (seconds < best[0]) {
+                    best[0] = seconds;
+                    best_values[0] = values;
+                }
+
+                // Decompression
+                start = lzlib4_bench_now();
+                counters.start();
+                bool right = compressed && lzlib4_bench_decompress(out, compressed, check, in_size);
+                counters.stop(values);
+                seconds = lzlib4_bench_now() - start;
+                if (seconds < best[1]) {
+                    best[1] = seconds;
+                    best_values[1] = values;
+                }
+
+                if (!right || memcmp(in, check, in_size)) {
+                    fprintf(stderr, "The decompressed data doesn't match (block %zu, level %zu)\n", options.block_sizes[b], options.levels[l]);
+                    return_code = 1;
+                    break;
+                }
+
+                // crc32 of the whole input, in blocks like the compressor does
+                start = lzlib4_bench_now();
+                counters.start();
+                uint32_t crc = 0;
+                for (size_t pos = 0; pos < in_size; pos += options.block_sizes[b]) {
+                    crc ^= lzlib4::crc32(in + pos, std::min(options.block_sizes[b], in_size - pos));
+                }
+                counters.stop(values);
+                seconds = lzlib4_bench_now() - start;
+                if (seconds < best[2]) {
+                    best[2] = seconds;
+                    best_values[2] = values;
+                }
+                // Keep the crc alive
+                if (crc == 0x12345678) {
+                    printf(" ");
+                }
+            }
+
+            if (!return_code) {
+                print_row("compress", options.block_sizes[b], options.levels[l], in_size, best[0], best_values[0]);
+                print_row("decompress", options.block_sizes[b], options.levels[l], in_size, best[1], best_values[1]);
+                print_row("crc32", options.block_sizes[b], options.levels[l], in_size, best[2], best_values[2]);
+                printf("%-10s %8zu %5zu %8.2f%%\n", "ratio", options.block_sizes[b], options.levels[l], compressed * 100.0 / in_size);
+            }
+
+            lzlib4_bench_free(out);
+        }
+    }
+
+    lzlib4_bench_free(check);
+    lzlib4_bench_free(in);
+
+    return return_code;
+}
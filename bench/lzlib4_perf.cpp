@@ -0,0 +1,189 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_perf.h"
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+lzlib4_perf_counters::lzlib4_perf_counters() {
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        fds[i] = -1;
+    }
+}
+
+lzlib4_perf_counters::~lzlib4_perf_counters() {
+    close();
+}
+
+
+/**
+ * @brief Open the counters for the calling thread. The counters are created stopped.
+ *
+ * @return bool : true if at least one counter is available
+ */
+bool lzlib4_perf_counters::open() {
+    close();
+
+#ifdef __linux__
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        switch (i) {
+            case LZLIB4_PERF_CYCLES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+
+            case LZLIB4_PERF_INSTRUCTIONS:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+
+            case LZLIB4_PERF_L1D_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_L1D |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+
+            case LZLIB4_PERF_LLC_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                break;
+
+            case LZLIB4_PERF_BRANCH_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+
+            case LZLIB4_PERF_DTLB_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+        }
+
+        // pid 0 and cpu -1: calling thread on any CPU
+        fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+    return available();
+}
+
+
+void lzlib4_perf_counters::close() {
+#ifdef __linux__
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        if (fds[i] >= 0) {
+            ::close(fds[i]);
+        }
+        fds[i] = -1;
+    }
+#endif
+}
+
+
+/**
+ * @brief Reset and start all the counters
+ *
+ */
+void lzlib4_perf_counters::start() {
+#ifdef __linux__
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+
+/**
+ * @brief Stop the counters and read its values. The values of the multiplexed counters are scaled to the whole
+ *        measured time.
+ *
+ * @param values : Counter values
+ */
+void lzlib4_perf_counters::stop(lzlib4_perf_values &values) {
+    values = lzlib4_perf_values();
+
+#ifdef __linux__
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        // value, time enabled, time running
+        uint64_t data[3];
+        if (fds[i] < 0 || read(fds[i], data, sizeof(data)) != sizeof(data) || !data[2]) {
+            continue;
+        }
+
+        values.value[i] = data[2] < data[1] ? (uint64_t) ((double) data[0] * data[1] / data[2]) : data[0];
+        values.available[i] = true;
+    }
+#endif
+}
+
+
+/**
+ * @brief Check if any counter could be opened
+ *
+ * @return bool : true if at least one counter is available
+ */
+bool lzlib4_perf_counters::available() {
+    for (uint8_t i = 0; i < LZLIB4_PERF_EVENTS; i++) {
+        if (fds[i] >= 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+const char * lzlib4_perf_counters::name(lzlib4_perf_event event) {
+    switch (event) {
+        case LZLIB4_PERF_CYCLES: return "cycles";
+        case LZLIB4_PERF_INSTRUCTIONS: return "instructions";
+        case LZLIB4_PERF_L1D_MISSES: return "L1d-misses";
+        case LZLIB4_PERF_LLC_MISSES: return "LLC-misses";
+        case LZLIB4_PERF_BRANCH_MISSES: return "branch-misses";
+        case LZLIB4_PERF_DTLB_MISSES: return "dTLB-misses";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,68 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Hardware performance counters used by the benchmark.
+ *
+ * The counters are read using the Linux perf_event_open syscall, only for the calling thread and only in user
+ * space. Every event is opened on its own (not as a group), so if the CPU or the kernel doesn't support any of
+ * them the others can still be used. When the PMU has less counters than events, the kernel multiplexes them and
+ * the values are scaled using the time that every event was running.
+ *
+ * On other systems, or when the access is not allowed (see /proc/sys/kernel/perf_event_paranoid), the counters
+ * are just marked as not available.
+ **/
+
+#ifndef LZLIB4_PERF_H
+#define LZLIB4_PERF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum lzlib4_perf_event {
+    LZLIB4_PERF_CYCLES = 0,
+    LZLIB4_PERF_INSTRUCTIONS,
+    LZLIB4_PERF_L1D_MISSES,
+    LZLIB4_PERF_LLC_MISSES,
+    LZLIB4_PERF_BRANCH_MISSES,
+    LZLIB4_PERF_DTLB_MISSES,
+    LZLIB4_PERF_EVENTS
+};
+
+struct lzlib4_perf_values {
+    uint64_t value[LZLIB4_PERF_EVENTS] = {};
+    bool available[LZLIB4_PERF_EVENTS] = {};
+};
+
+class lzlib4_perf_counters {
+    public:
+        lzlib4_perf_counters();
+        ~lzlib4_perf_counters();
+        bool open();
+        void close();
+        void start();
+        void stop(lzlib4_perf_values &values);
+        bool available();
+        static const char * name(lzlib4_perf_event event);
+
+    private:
+        int fds[LZLIB4_PERF_EVENTS];
+};
+
+#endif
@@ -21,6 +21,60 @@
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+
+
+#define UPDC32(octet,crc) (crc_32_tab[((crc)\
+     ^ ((uint8_t)octet)) & 0xff] ^ ((crc) >> 8))
+
+
+static const uint32_t crc_32_tab[] = { /* CRC polynomial 0xedb88320 */
+0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
 
 
 /**
@@ -74,6 +128,7 @@ lzlib4::lzlib4(
     strm.state.compress_in_size = block_size;
     strm.state.compress_in_buffer = (uint8_t*) malloc(strm.state.compress_in_size);
     strm.state.compress_in_index = 0;
+    strm.state.compress_block_size = block_size;
     strm.state.compress_out_size = LZ4_COMPRESSBOUND(strm.state.compress_in_size) + sizeof(LZLIB4_BLOCK_HEADER); // Worst case
     strm.state.compress_out_buffer = (uint8_t*) malloc(strm.state.compress_out_size);
     
@@ -101,12 +156,30 @@ int lzlib4::compress(lzlib4_flush_mode flush_mode) {
         return LZLIB4_RC_BLOCK_SIZE_ERROR;
     }
 
-    // While there is data in input buffer, create blocks
-    while (strm.avail_in || flush_mode) {
+    // The flush mode is cleared in the loop, so keep the requested one for the end of the stream
+    lzlib4_flush_mode requested_flush = flush_mode;
+
+    // Work done in this call, for the work budget
+    size_t budget_bytes = 0;
+    size_t budget_blocks = 0;
+    auto budget_start = strm.state.work_budget_mode ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+    // The packing mode takes the input as a record and decides itself where to store it. The normal loop is used
+    // after that to process the flush.
+    if (strm.state.packing_window && strm.state.compress_block_mode == LZLIB4_INPUT_NOSPLIT) {
+        int return_code = pack_records(flush_mode);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+
+    // While there is data in input buffer, create blocks. The buffer can be also filled directly by the caller (see
+    // lzlib4_ostreambuf), so a full buffer is compressed even without input data.
+    while (strm.avail_in || flush_mode || strm.state.compress_in_index >= strm.state.compress_block_size) {
         // Only compress if the buffer is filled or flush_mode is LZLIB4_FULL_FLUSH
         bool to_compress = false;
         // Free space in input buffer
-        size_t space_left = strm.state.compress_in_size - strm.state.compress_in_index;
+        size_t space_left = strm.state.compress_block_size - strm.state.compress_in_index;
         // Size of the data that will be readed
         size_t to_read = 0;
 
@@ -121,6 +194,11 @@ int lzlib4::compress(lzlib4_flush_mode flush_mode) {
 
         // We have to read data from input buffer
         if (to_read) {
+            // In LZLIB4_INPUT_NOSPLIT mode the whole input is a record
+            if (strm.state.track_records && strm.state.compress_block_mode == LZLIB4_INPUT_NOSPLIT) {
+                add_record(strm.state.record_count++, strm.state.compress_block_count, strm.state.compress_in_index, to_read);
+            }
+
             // Read the data to the compression buffer
             memcpy(strm.state.compress_in_buffer + strm.state.compress_in_index, strm.next_in, to_read);
             // Update the index, pointers and sizes...
@@ -130,98 +208,1951 @@ int lzlib4::compress(lzlib4_flush_mode flush_mode) {
         }
 
         // If input buffer is filled or there is no more data with any flush mode, compress the block.
-        if (strm.state.compress_in_index > strm.state.compress_in_size) {
+        if (strm.state.compress_in_index > strm.state.compress_block_size) {
             // in index should not be bigger than size
             return LZLIB4_RC_BUFFER_ERROR;
         }
         else if (
-            (strm.state.compress_in_index == strm.state.compress_in_size) ||
+            (strm.state.compress_in_index == strm.state.compress_block_size) ||
             (strm.avail_in == 0 && flush_mode > 0)
         ) {
             to_compress = true;
         }
 
-        // If block is ready to compress, then compress it
-        if (to_compress) {
-            // A new block will be created
-            size_t compressed = LZ4_compress_HC_continue(
-                strm.state.strm_lz4,
-                (char *) strm.state.compress_in_buffer,
-                (char *) strm.state.compress_out_buffer,
-                strm.state.compress_in_index,
-                strm.state.compress_out_size
-            );
+        // If block is ready to compress, then compress it. A flush without data doesn't create an empty block.
+        // The block can be cut at a better place, except when everything must be written.
+        if (to_compress && strm.state.compress_in_index) {
+            budget_bytes += strm.state.compress_in_index;
+            budget_blocks++;
+            int return_code = finish_block(!(flush_mode && !strm.avail_in));
+            if (return_code != LZLIB4_RC_OK) {
+                return return_code;
+            }
+            // A split block keeps the tail into the buffer
+            budget_bytes -= strm.state.compress_in_index;
+        }
 
-            // If data was compressed then write the output buffer
-            if (compressed) {
-                // If output buffer is too small, raise an error
-                if ((compressed + sizeof(LZLIB4_BLOCK_HEADER)) > strm.avail_out) {
-                    return LZLIB4_RC_BUFFER_ERROR;
+        // If any flush mode was set and all the input data was processed
+        if (to_compress && flush_mode && !strm.avail_in) {
+            // Pending blocks of the reordering window must be written too
+            if (strm.state.reorder_window) {
+                int return_code = flush_window();
+                if (return_code != LZLIB4_RC_OK) {
+                    return return_code;
                 }
+            }
 
-                // Calculate the CRC, which will allow to check the block later and will be used as Identifier (is important)
-                uint32_t crc = crc32(strm.state.compress_in_buffer, strm.state.compress_in_index);
+            // If flush mode is a full flush, a stream reset is required
+            if (flush_mode == LZLIB4_FULL_FLUSH) {
+                // Reset the stream setting the block compression
+                LZ4_resetStreamHC(strm.state.strm_lz4, compression_level);
+            }
+            // Reset the flush mode to exit the loop at end
+            flush_mode = LZLIB4_NO_FLUSH;
+        }
 
-                // Add block header
-                LZLIB4_BLOCK_HEADER header = {
-                    (uint32_t) compressed, // compressed_size
-                    (uint32_t) strm.state.compress_in_index, // uncompressed_size
-                    crc // CRC
-                };
-                memcpy(strm.next_out, &header, sizeof(header));
-                // Set the new pointer position and available space
-                strm.next_out += sizeof(header);
-                strm.avail_out -= sizeof(header);
+        // Stop at the block boundary if the budget is exhausted and the loop would continue
+        if (
+            strm.state.work_budget_mode && budget_blocks &&
+            (strm.avail_in || flush_mode || strm.state.compress_in_index >= strm.state.compress_block_size)
+        ) {
+            const lzlib4_work_budget &budget = strm.state.work_budget;
+            if (
+                (budget.max_bytes && budget_bytes >= budget.max_bytes) ||
+                (budget.max_blocks && budget_blocks >= budget.max_blocks) ||
+                (
+                    budget.max_time_us &&
+                    std::chrono::steady_clock::now() - budget_start >= std::chrono::microseconds(budget.max_time_us)
+                )
+            ) {
+                return LZLIB4_RC_WORK_PENDING;
+            }
+        }
+    }
+
+    /* Flush mode was set to FINISH, so stream state will be reset */
+    if (requested_flush == LZLIB4_FINISH){
+        LZ4_resetStreamHC(strm.state.strm_lz4, compression_level);
+
+        // Write the index at the end of the stream
+        if (strm.state.index_mode) {
+            int return_code = write_index();
+            if (return_code != LZLIB4_RC_OK) {
+                return return_code;
+            }
+        }
+
+        // The next data will be a new stream, so the positions start again
+        strm.state.compress_total_out = 0;
+        strm.state.compress_total_in = 0;
+        strm.state.compress_block_count = 0;
+        strm.state.record_count = 0;
+    }
+
+    return 0;
+}
+
+
+
+/**
+ * @brief Worst case size of the output generated by the next compress call, including the blocks of the reordering
+ *        window, the pending records and the index written by LZLIB4_FINISH.
+ *
+ * @param input_size : Input data size of the next call
+ * @return size_t : Required output buffer size
+ */
+size_t lzlib4::compress_bound(size_t input_size) {
+    if (!strm.state.compress_in_size) {
+        return 0;
+    }
+
+    // Blocks that can be written: the buffered data plus the input, the reordering window and the pending records.
+    // The adaptive mode can use the minimum block size.
+    size_t block_size = strm.state.adaptive_mode ? strm.state.adaptive_options.min_block_size : strm.state.compress_block_size;
+    size_t blocks = (strm.state.compress_in_index + input_size) / block_size + 2;
+    blocks += strm.state.reorder_count + strm.state.packing_pending.size();
+
+    size_t size = blocks * strm.state.compress_out_size;
+
+    // Permutation block of every window
+    if (strm.state.reorder_window) {
+        size += (blocks / strm.state.reorder_window + 1) * (sizeof(LZLIB4_BLOCK_HEADER) + strm.state.reorder_window * sizeof(uint32_t));
+    }
+
+    // Resynchronization marker of every block, or of every window
+    if (strm.state.sync_markers) {
+        size += blocks * (sizeof(LZLIB4_BLOCK_HEADER) + LZLIB4_SYNC_SIZE);
+    }
+
+    // Index block
+    if (strm.state.index_mode) {
+        size += sizeof(LZLIB4_BLOCK_HEADER) + sizeof(LZLIB4_INDEX_TRAILER);
+        size += (strm.state.index_entries.size() + blocks) * sizeof(LZLIB4_INDEX_ENTRY);
+        if (strm.state.record_index) {
+            size += (strm.state.records.size() + blocks) * sizeof(LZLIB4_RECORD_ENTRY);
+        }
+    }
+
+    return size;
+}
+
+
+/**
+ * @brief Close the block stored into the compression buffer. The block is written, or moved to the reordering
+ *        window if that mode is enabled.
+ *
+ * @param allow_split : Allow to cut the block at a content transition. The data after the cut is kept into the
+ *                      buffer as the start of the next block.
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4::finish_block(bool allow_split) {
+    int return_code;
+
+    size_t buffered = strm.state.compress_in_index;
+    if (
+        allow_split &&
+        strm.state.split_mode &&
+        strm.state.compress_block_mode == LZLIB4_INPUT_SPLIT &&
+        buffered == strm.state.compress_block_size
+    ) {
+        strm.state.compress_in_index = find_split_point();
+    }
+
+    if (strm.state.reorder_window) {
+        // Reordering mode keeps the blocks in the window until it is full
+        return_code = queue_block();
+    }
+    else {
+        // The buffer is reused in place, so LZ4 keeps as dictionary the part of the previous block after the end of
+        // this one. A block which was cut has the start of the next block there instead, so it can't be linked.
+        bool cut = strm.state.compress_in_index != buffered;
+        return_code = write_block(
+            strm.state.compress_in_buffer,
+            strm.state.compress_in_index,
+            strm.state.compress_total_in,
+            strm.state.independent_blocks || cut ? LZLIB4_BLOCK_FLAG_INDEPENDENT : 0
+        );
+        strm.state.compress_total_in += strm.state.compress_in_index;
+    }
+
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    // Move the data after the cut to the start of the buffer
+    size_t tail = buffered - strm.state.compress_in_index;
+    if (tail) {
+        memmove(strm.state.compress_in_buffer, strm.state.compress_in_buffer + strm.state.compress_in_index, tail);
+    }
+    // An adaptive block size smaller than the moved data would leave the buffer overfilled
+    if (tail > strm.state.compress_block_size) {
+        strm.state.compress_block_size = tail;
+    }
+
+    // Reset the input index
+    strm.state.compress_in_index = tail;
+    strm.state.compress_block_count++;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Enable the smart split points. Only available in LZLIB4_INPUT_SPLIT mode.
+ *
+ * @param enabled : true to cut the blocks at content transitions
+ * @param options : Split options
+ * @return int : LZLIB4_RC_OK if the mode was changed, negative number otherwise.
+ */
+int lzlib4::set_split_points(bool enabled, const lzlib4_split_options &options) {
+    if (!strm.state.compress_in_buffer || strm.state.compress_block_mode != LZLIB4_INPUT_SPLIT) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    if (!options.granularity) {
+        return LZLIB4_RC_BLOCK_SIZE_ERROR;
+    }
+
+    strm.state.split_mode = enabled;
+    strm.state.split_options = options;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Order 0 entropy of a chunk, in bits per byte
+ *
+ * @param data : Chunk data
+ * @param size : Chunk size
+ * @return double
+ */
+static double lzlib4_entropy_bits(const uint8_t * data, size_t size) {
+    uint32_t counts[256] = {};
+    for (size_t i = 0; i < size; i++) {
+        counts[data[i]]++;
+    }
+
+    double bits = 0;
+    for (uint16_t i = 0; i < 256; i++) {
+        if (counts[i]) {
+            double probability = (double) counts[i] / size;
+            bits -= probability * log2(probability);
+        }
+    }
+
+    return bits;
+}
+
+
+/**
+ * @brief Find the best place to cut the full block stored into the compression buffer
+ *
+ * @return size_t : Size of the block. The whole buffer if there is no transition.
+ */
+size_t lzlib4::find_split_point() {
+    const lzlib4_split_options &options = strm.state.split_options;
+    const uint8_t * data = strm.state.compress_in_buffer;
+    size_t size = strm.state.compress_in_index;
+
+    size_t min_size = options.min_block_size ? options.min_block_size : size - size / 4;
+    if (min_size >= size) {
+        return size;
+    }
+
+    // Chunks of the checked area, aligned to the start of the block
+    size_t first = (min_size + options.granularity - 1) / options.granularity;
+    size_t chunks = size / options.granularity;
+    if (first < 2 || chunks <= first) {
+        return size;
+    }
+
+    // Entropy and zero chunks, including the two chunks before the checked area
+    size_t count = chunks - first + 2;
+    std::vector<double> entropy(count);
+    std::vector<bool> zero(count);
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t * chunk = data + (first - 2 + i) * options.granularity;
+        entropy[i] = lzlib4_entropy_bits(chunk, options.granularity);
+        zero[i] = entropy[i] == 0 && chunk[0] == 0;
+    }
+
+    // Score of every boundary between chunks. The later boundary wins the ties, to keep the blocks bigger.
+    double best_score = 0;
+    size_t best = size;
+    for (size_t i = 2; i < count; i++) {
+        double score = 0;
+        if (zero[i - 1] && !zero[i]) {
+            score = 8;
+        }
+        else if (!zero[i - 1] && zero[i]) {
+            score = 4;
+        }
+        else {
+            double before = (entropy[i - 2] + entropy[i - 1]) / 2;
+            double after = i + 1 < count ? (entropy[i] + entropy[i + 1]) / 2 : entropy[i];
+            double shift = fabs(after - before);
+            if (shift >= options.min_entropy_shift) {
+                score = shift;
+            }
+        }
+
+        if (score > 0 && score >= best_score) {
+            best_score = score;
+            best = (first - 2 + i) * options.granularity;
+        }
+    }
+
+    return best;
+}
+
+
+/**
+ * @brief Enable the best-fit packing of records. Only available in LZLIB4_INPUT_NOSPLIT mode.
+ *
+ * Every compress call with data is a record. Instead of closing the block when the next record doesn't fit, the
+ * records are kept until there are "window_records" of them, and then the oldest record is stored together with the
+ * subset of the pending records that fills the block as much as possible. That subset is only used when it fills
+ * the block at least "min_fill_gain" percent more than the records in arrival order, because the reordered records
+ * lose the previous records as dictionary. The records are never splitted between blocks, but they can be stored in
+ * a different order, so the position of every record is reported by records().
+ *
+ * @param window_records : Pending records (up to LZLIB4_PACKING_MAX_WINDOW). 0 disables the packing.
+ * @param min_fill_gain : Fill improvement, in percent of the block size, required to reorder the records.
+ * @return int : LZLIB4_RC_OK if the mode was enabled, negative number otherwise.
+ */
+int lzlib4::set_packing_window(uint16_t window_records, uint8_t min_fill_gain) {
+    if (window_records > LZLIB4_PACKING_MAX_WINDOW || !strm.state.compress_in_buffer || min_fill_gain > 100) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // Only the LZLIB4_INPUT_NOSPLIT mode has records
+    if (window_records && strm.state.compress_block_mode != LZLIB4_INPUT_NOSPLIT) {
+        return LZLIB4_RC_BLOCK_SIZE_ERROR;
+    }
+
+    // There can't be pending records
+    if (!strm.state.packing_pending.empty()) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    if (strm.state.packing_buffer) {
+        free(strm.state.packing_buffer);
+        strm.state.packing_buffer = NULL;
+    }
+    strm.state.packing_window = 0;
+
+    if (!window_records) {
+        // The record index still needs the records location
+        strm.state.track_records = strm.state.record_index;
+        return LZLIB4_RC_OK;
+    }
+
+    if (!memory_available(0, window_records * strm.state.compress_in_size)) {
+        return LZLIB4_RC_MEMORY_LIMIT;
+    }
+    strm.state.packing_buffer = (uint8_t*) malloc(window_records * strm.state.compress_in_size);
+    if (!strm.state.packing_buffer) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    strm.state.packing_free_slots.clear();
+    for (uint16_t i = window_records; i > 0; i--) {
+        strm.state.packing_free_slots.push_back(i - 1);
+    }
+    strm.state.packing_window = window_records;
+    strm.state.packing_min_fill_gain = min_fill_gain;
+    strm.state.track_records = true;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Keep the input data as a new pending record, and write the blocks that can be filled with them.
+ *
+ * @param flush_mode : With any flush mode, all the pending records are written.
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4::pack_records(lzlib4_flush_mode flush_mode) {
+    if (strm.avail_in) {
+        lzlib4_pending_record record;
+        record.record = strm.state.record_count++;
+        record.slot = strm.state.packing_free_slots.back();
+        record.size = strm.avail_in;
+        strm.state.packing_free_slots.pop_back();
+
+        memcpy(strm.state.packing_buffer + record.slot * strm.state.compress_in_size, strm.next_in, strm.avail_in);
+        strm.next_in += strm.avail_in;
+        strm.avail_in = 0;
+
+        strm.state.packing_pending.push_back(record);
+    }
+
+    while (
+        strm.state.packing_pending.size() >= strm.state.packing_window ||
+        (flush_mode && !strm.state.packing_pending.empty())
+    ) {
+        int return_code = pack_block();
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Fill a block with the oldest pending record and the subset of the other pending records that leaves less
+ *        free space. The subset is selected using a 0/1 knapsack over the record sizes, and the sizes are rounded
+ *        up if the block is too big for the table. If the subset doesn't improve enough the fill of the records in
+ *        arrival order, these are used instead.
+ *
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4::pack_block() {
+    std::vector<lzlib4_pending_record> &pending = strm.state.packing_pending;
+
+    // A block with data from the normal mode must be closed first
+    if (strm.state.compress_in_index) {
+        int return_code = finish_block();
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+
+    size_t granularity = strm.state.compress_in_size / LZLIB4_PACKING_TABLE_SIZE + 1;
+    size_t space = (strm.state.compress_in_size - pending[0].size) / granularity;
+
+    // table[s] keeps the record which reached the size "s" for first time
+    const uint16_t unreachable = UINT16_MAX;
+    std::vector<uint16_t> &table = strm.state.packing_table;
+    table.assign(space + 1, unreachable);
+    table[0] = 0;
+
+    size_t best = 0;
+    for (uint16_t i = 1; i < pending.size(); i++) {
+        size_t weight = (pending[i].size + granularity - 1) / granularity;
+        if (weight > space) {
+            continue;
+        }
+
+        for (size_t s = space; s >= weight; s--) {
+            if (table[s] == unreachable && table[s - weight] != unreachable) {
+                table[s] = i;
+                best = std::max(best, s);
+            }
+        }
+    }
+
+    // Selected records, in arrival order
+    std::vector<bool> selected(pending.size(), false);
+    selected[0] = true;
+    size_t packed_fill = pending[0].size;
+    for (size_t s = best; s > 0; ) {
+        uint16_t i = table[s];
+        selected[i] = true;
+        packed_fill += pending[i].size;
+        s -= (pending[i].size + granularity - 1) / granularity;
+    }
+
+    // Records that fit in arrival order, as they would be stored without packing
+    size_t arrival_fill = 0;
+    size_t arrival_count = 0;
+    while (
+        arrival_count < pending.size() &&
+        arrival_fill + pending[arrival_count].size <= strm.state.compress_in_size
+    ) {
+        arrival_fill += pending[arrival_count++].size;
+    }
+
+    if (packed_fill < arrival_fill + strm.state.compress_in_size * strm.state.packing_min_fill_gain / 100) {
+        for (size_t i = 0; i < pending.size(); i++) {
+            selected[i] = i < arrival_count;
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (!selected[i]) {
+            pending[kept++] = pending[i];
+            continue;
+        }
+
+        memcpy(
+            strm.state.compress_in_buffer + strm.state.compress_in_index,
+            strm.state.packing_buffer + pending[i].slot * strm.state.compress_in_size,
+            pending[i].size
+        );
+        add_record(pending[i].record, strm.state.compress_block_count, strm.state.compress_in_index, pending[i].size);
+        strm.state.compress_in_index += pending[i].size;
+        strm.state.packing_free_slots.push_back(pending[i].slot);
+    }
+    pending.resize(kept);
+
+    return finish_block();
+}
+
+
+/**
+ * @brief Store the position of a record
+ *
+ * @param record : Record number
+ * @param block : Block number, in the order of the uncompressed data
+ * @param offset : Position of the record into the block
+ * @param size : Record size
+ */
+void lzlib4::add_record(uint64_t record, uint64_t block, size_t offset, size_t size) {
+    lzlib4_record_location location;
+    location.record = record;
+    location.block = block;
+    location.offset = (uint32_t) offset;
+    location.size = (uint32_t) size;
+    strm.state.records.push_back(location);
+}
+
+
+/**
+ * @brief Position of every record written. Used by the packing mode, where the records can be stored in a
+ *        different order than they were received.
+ *
+ * @return const std::vector<lzlib4_record_location>& : Records location, in the order they were written
+ */
+const std::vector<lzlib4_record_location> & lzlib4::records() {
+    return strm.state.records;
+}
+
+
+/**
+ * @brief Remove the stored records location, to free the memory in long streams
+ *
+ */
+void lzlib4::clear_records() {
+    strm.state.records.clear();
+}
+
+
+// Rate control ladder, from the cheapest step. The fast engine steps use LZ4_compress_fast with the acceleration.
+struct lzlib4_rate_step {
+    int8_t compression_level;
+    int acceleration;
+};
+
+static const lzlib4_rate_step lzlib4_rate_ladder[LZLIB4_RATE_STEPS] = {
+    {0, 32}, {0, 16}, {0, 8}, {0, 4}, {0, 2}, {0, 1},
+    {3, 0}, {5, 0}, {7, 0}, {9, 0}, {10, 0}, {12, 0}
+};
+
+
+/**
+ * @brief Compress a block of data and write it (header + data) into the output buffer
+ *
+ * @param data : Uncompressed block data
+ * @param size : Uncompressed block size
+ * @param uncompressed_offset : Position of the block data into the uncompressed stream, used by the index
+ * @param flags : Block flags. If LZLIB4_BLOCK_FLAG_INDEPENDENT is set, the block will not use the previous blocks
+ *                as dictionary.
+ * @return int : LZLIB4_RC_OK if the block was written, negative number otherwise.
+ */
+int lzlib4::write_block(uint8_t * data, size_t size, uint64_t uncompressed_offset, uint32_t flags) {
+    uint8_t * block_data = strm.state.compress_out_buffer;
+    size_t compressed = 0;
+    uint8_t choice = 0;
+    bool timed = strm.state.adaptive_mode || strm.state.rate_mode;
+    auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+    if (strm.state.archival_mode) {
+        int return_code = compress_block_archival(data, size, &block_data, &compressed, &flags, &choice);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+    else if (strm.state.rate_mode && lzlib4_rate_ladder[strm.state.rate_step].acceleration) {
+        // The fast engine can't use the dictionary of the HC stream
+        flags |= LZLIB4_BLOCK_FLAG_INDEPENDENT;
+        compressed = LZ4_compress_fast_extState(
+            strm.state.rate_lz4,
+            (char *) data,
+            (char *) strm.state.compress_out_buffer,
+            size,
+            strm.state.compress_out_size,
+            lzlib4_rate_ladder[strm.state.rate_step].acceleration
+        );
+    }
+    else {
+        // After a rate control change the HC stream has the dictionary of another level or engine
+        if (strm.state.rate_mode && strm.state.rate_changed) {
+            flags |= LZLIB4_BLOCK_FLAG_INDEPENDENT;
+        }
+        if (flags & LZLIB4_BLOCK_FLAG_INDEPENDENT) {
+            LZ4_resetStreamHC_fast(strm.state.strm_lz4, compression_level);
+        }
+
+        // A new block will be created
+        compressed = LZ4_compress_HC_continue(
+            strm.state.strm_lz4,
+            (char *) data,
+            (char *) strm.state.compress_out_buffer,
+            size,
+            strm.state.compress_out_size
+        );
+    }
+
+    if (!compressed) {
+        return LZLIB4_RC_COMPRESSION_ERROR;
+    }
+    strm.state.rate_changed = false;
+
+    // Try the entropy coding stage, but keep it only if saves enough space and the block can be decoded fast enough
+    if (
+        strm.state.entropy_min_saving &&
+        !(flags & LZLIB4_BLOCK_FLAG_STORED) &&
+        entropy_cost_allowed(size, compressed)
+    ) {
+        size_t encoded = lzlib4_entropy_compress(
+            block_data,
+            compressed,
+            strm.state.compress_entropy_buffer,
+            compressed * (100 - strm.state.entropy_min_saving) / 100
+        );
+
+        if (encoded) {
+            block_data = strm.state.compress_entropy_buffer;
+            compressed = encoded;
+            flags |= LZLIB4_BLOCK_FLAG_ENTROPY;
+        }
+    }
+
+    // The blocks of a reordering window share the marker written before the window
+    size_t sync_size = 0;
+    if (strm.state.sync_markers && !strm.state.reorder_window) {
+        sync_size = sizeof(LZLIB4_BLOCK_HEADER) + LZLIB4_SYNC_SIZE;
+    }
+
+    // If output buffer is too small, raise an error
+    if ((compressed + sizeof(LZLIB4_BLOCK_HEADER) + sync_size) > strm.avail_out) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // Calculate the CRC, which will allow to check the block later and will be used as Identifier (is important)
+    uint32_t crc = crc32(data, size);
+
+    // Add block header. The flags and the archival choice are stored into the free upper bits of the sizes
+    LZLIB4_BLOCK_HEADER header = {
+        (uint32_t) compressed | flags, // compressed_size
+        (uint32_t) size | ((uint32_t) choice << LZLIB4_BLOCK_CHOICE_SHIFT), // uncompressed_size
+        crc // CRC
+    };
+
+    if (sync_size) {
+        int return_code = write_sync_marker(uncompressed_offset, header);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+
+    // Keep the block position if the index is enabled
+    if (strm.state.index_mode) {
+        LZLIB4_INDEX_ENTRY entry;
+        entry.offset = strm.state.compress_total_out;
+        entry.uncompressed_offset = uncompressed_offset;
+        entry.compressed_size = header.compressed_size;
+        entry.uncompressed_size = (uint32_t) size;
+        strm.state.index_entries.push_back(entry);
+    }
+
+    memcpy(strm.next_out, &header, sizeof(header));
+    // Set the new pointer position and available space
+    strm.next_out += sizeof(header);
+    strm.avail_out -= sizeof(header);
+
+    // Copy the compressed block to the output buffer
+    memcpy(strm.next_out, block_data, compressed);
+    // Set the new pointer position and available space
+    strm.next_out += compressed;
+    strm.avail_out -= compressed;
+
+    strm.state.compress_total_out += sizeof(header) + compressed;
+
+    if (timed) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (strm.state.adaptive_mode) {
+            adapt_block_size(size, compressed, seconds);
+        }
+        if (strm.state.rate_mode) {
+            adapt_rate(size, compressed, seconds);
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Enable the output rate control, which changes the engine and the level after every block to keep the output
+ *        rate and the CPU share under the limits. See lzlib4_rate_options. Not available in archival mode, which
+ *        selects the encoding of every block by itself.
+ *
+ * @param enabled : true to enable the rate control. When disabled, the level of the constructor is restored.
+ * @param options : Rate control options
+ * @return int : LZLIB4_RC_OK if the mode was changed, negative number otherwise.
+ */
+int lzlib4::set_rate_control(bool enabled, const lzlib4_rate_options &options) {
+    lzlib4_internal_state &state = strm.state;
+
+    if (!state.compress_in_buffer || state.archival_mode) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    if (!enabled) {
+        if (state.rate_mode) {
+            compression_level = state.rate_base_level;
+            // The last block can be from the fast engine or from another level, so its dictionary is dropped
+            LZ4_resetStreamHC(state.strm_lz4, compression_level);
+        }
+        if (state.rate_lz4) {
+            LZ4_freeStream(state.rate_lz4);
+            state.rate_lz4 = NULL;
+        }
+        state.rate_mode = false;
+
+        return LZLIB4_RC_OK;
+    }
+
+    if (
+        options.max_cpu_share <= 0 || options.smoothing <= 0 || options.smoothing > 1 ||
+        options.margin < 0 || options.margin >= 1
+    ) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // Steps allowed by the options. The ladder goes from the fast engine to the maximum HC level.
+    uint8_t min_step = LZLIB4_RATE_STEPS;
+    uint8_t max_step = 0;
+    for (uint8_t i = 0; i < LZLIB4_RATE_STEPS; i++) {
+        const lzlib4_rate_step &step = lzlib4_rate_ladder[i];
+        if (step.acceleration ? !options.allow_fast : step.compression_level > options.max_compression_level) {
+            continue;
+        }
+        min_step = std::min(min_step, i);
+        max_step = i;
+    }
+    if (min_step == LZLIB4_RATE_STEPS) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    if (options.allow_fast && !state.rate_lz4) {
+        if (!memory_available(0, sizeof(LZ4_stream_t))) {
+            return LZLIB4_RC_MEMORY_LIMIT;
+        }
+        state.rate_lz4 = LZ4_createStream();
+        if (!state.rate_lz4) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+    }
+
+    if (!state.rate_mode) {
+        state.rate_base_level = compression_level;
+    }
+
+    // Start at the strongest step not above the current level
+    uint8_t start = min_step;
+    for (uint8_t i = min_step; i <= max_step; i++) {
+        if (lzlib4_rate_ladder[i].acceleration || lzlib4_rate_ladder[i].compression_level <= state.rate_base_level) {
+            start = i;
+        }
+    }
+
+    state.rate_mode = true;
+    state.rate_options = options;
+    state.rate_min_step = min_step;
+    state.rate_max_step = max_step;
+    state.rate_step = start;
+    state.rate_changed = true;
+    state.rate_hold = 0;
+    state.rate_input = -1;
+    state.rate_last_time = -1;
+    state.rate_blocks = 0;
+    for (uint8_t i = 0; i < LZLIB4_RATE_STEPS; i++) {
+        state.rate_estimates[i] = lzlib4_rate_estimate();
+    }
+    state.rate_stats = lzlib4_rate_stats();
+    state.rate_stats.compression_level = lzlib4_rate_ladder[start].compression_level;
+    state.rate_stats.acceleration = lzlib4_rate_ladder[start].acceleration;
+    if (!lzlib4_rate_ladder[start].acceleration) {
+        compression_level = lzlib4_rate_ladder[start].compression_level;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Rates measured by the rate control and the current step
+ *
+ * @return lzlib4_rate_stats
+ */
+lzlib4_rate_stats lzlib4::rate_stats() {
+    return strm.state.rate_stats;
+}
+
+
+/**
+ * @brief Update the averages of the current step with the last block, and select the step of the next blocks
+ *
+ * @param size : Uncompressed size of the block
+ * @param compressed : Compressed size of the block
+ * @param seconds : Time used to compress the block
+ */
+void lzlib4::adapt_rate(size_t size, size_t compressed, double seconds) {
+    lzlib4_internal_state &state = strm.state;
+    const lzlib4_rate_options &options = state.rate_options;
+    double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    double weight = options.smoothing;
+
+    state.rate_blocks++;
+
+    // The first block of a visit to the step replaces the old estimate, which can be from another kind of data
+    lzlib4_rate_estimate &current = state.rate_estimates[state.rate_step];
+    double ratio = (double) compressed / size;
+    double cost = seconds / size;
+    if (current.ratio < 0 || current.block + 1 != state.rate_blocks) {
+        current.ratio = ratio;
+        current.cost = cost;
+    }
+    else {
+        current.ratio += (ratio - current.ratio) * weight;
+        current.cost += (cost - current.cost) * weight;
+    }
+    current.block = state.rate_blocks;
+
+    // Input rate, from the time between the end of the blocks
+    if (options.input_rate) {
+        state.rate_input = (double) options.input_rate;
+    }
+    else if (state.rate_last_time >= 0 && now > state.rate_last_time) {
+        double input = size / (now - state.rate_last_time);
+        state.rate_input = state.rate_input < 0 ? input : state.rate_input + (input - state.rate_input) * weight;
+    }
+    state.rate_last_time = now;
+
+    if (state.rate_input < 0) {
+        return;
+    }
+
+    double output_rate = state.rate_input * current.ratio;
+    double cpu_share = state.rate_input * current.cost;
+    state.rate_stats.input_rate = state.rate_input;
+    state.rate_stats.output_rate = output_rate;
+    state.rate_stats.cpu_share = cpu_share;
+
+    if (state.rate_hold) {
+        state.rate_hold--;
+        return;
+    }
+
+    uint8_t step = state.rate_step;
+    double max_output = (double) options.max_output_rate;
+    double free_output = max_output * (1 - options.margin);
+
+    if (cpu_share > options.max_cpu_share) {
+        // The CPU share has priority, because a compressor that doesn't keep up with the input can't keep any rate
+        if (step > state.rate_min_step) {
+            step--;
+        }
+    }
+    else if (!options.max_output_rate || output_rate > max_output) {
+        // A stronger step, unless it is already known to be too slow
+        if (step < state.rate_max_step) {
+            const lzlib4_rate_estimate &next = state.rate_estimates[step + 1];
+            bool known = next.cost >= 0 && state.rate_blocks - next.block <= LZLIB4_RATE_STALE_BLOCKS;
+            if (!known || state.rate_input * next.cost <= options.max_cpu_share) {
+                step++;
+            }
+        }
+    }
+    else if (output_rate < free_output && step > state.rate_min_step) {
+        // A cheaper step, if it is known to keep the output rate under the limit. An unknown one is only tried
+        // when there is margin for a worse ratio.
+        const lzlib4_rate_estimate &previous = state.rate_estimates[step - 1];
+        bool known = previous.ratio >= 0 && state.rate_blocks - previous.block <= LZLIB4_RATE_STALE_BLOCKS;
+        if (known ? state.rate_input * previous.ratio <= free_output : output_rate < max_output * (1 - 2 * options.margin)) {
+            step--;
+        }
+    }
+
+    if (step != state.rate_step) {
+        state.rate_step = step;
+        state.rate_changed = true;
+        state.rate_hold = options.hold_blocks;
+        state.rate_stats.changes++;
+        state.rate_stats.compression_level = lzlib4_rate_ladder[step].compression_level;
+        state.rate_stats.acceleration = lzlib4_rate_ladder[step].acceleration;
+        if (!lzlib4_rate_ladder[step].acceleration) {
+            compression_level = lzlib4_rate_ladder[step].compression_level;
+        }
+    }
+}
+
+
+/**
+ * @brief Enable the adaptive block size. Only available in LZLIB4_INPUT_SPLIT mode. The blocks can't be bigger than
+ *        the block size of the constructor, because it is the size of the compression buffer.
+ *
+ * @param enabled : true to enable the adaptive block size. When disabled, the block size of the constructor is used.
+ * @param options : Adaptive options
+ * @return int : LZLIB4_RC_OK if the mode was changed, negative number otherwise.
+ */
+int lzlib4::set_adaptive_block_size(bool enabled, const lzlib4_adaptive_options &options) {
+    if (!strm.state.compress_in_buffer || strm.state.compress_block_mode != LZLIB4_INPUT_SPLIT) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // The block size can't change while there is data into the buffer
+    if (strm.state.compress_in_index) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    lzlib4_adaptive_options adaptive = options;
+    if (!adaptive.max_block_size || adaptive.max_block_size > strm.state.compress_in_size) {
+        adaptive.max_block_size = strm.state.compress_in_size;
+    }
+    if (!adaptive.min_block_size || adaptive.min_block_size > adaptive.max_block_size) {
+        return LZLIB4_RC_BLOCK_SIZE_ERROR;
+    }
+
+    strm.state.adaptive_mode = enabled;
+    strm.state.adaptive_options = adaptive;
+    strm.state.adaptive_last_ratio = -1;
+    strm.state.adaptive_growing = false;
+    strm.state.adaptive_hold = 0;
+    strm.state.compress_block_size = enabled ? adaptive.max_block_size : strm.state.compress_in_size;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Current block size
+ *
+ * @return size_t
+ */
+size_t lzlib4::block_size() {
+    return strm.state.compress_block_size;
+}
+
+
+/**
+ * @brief Select the size of the next blocks using the result of the last one
+ *
+ * @param size : Uncompressed size of the block
+ * @param compressed : Compressed size of the block
+ * @param seconds : Time used to compress the block
+ */
+void lzlib4::adapt_block_size(size_t size, size_t compressed, double seconds) {
+    lzlib4_adaptive_options &options = strm.state.adaptive_options;
+    size_t &block_size = strm.state.compress_block_size;
+
+    // Only the full blocks are representative. The partial blocks come from flushes.
+    if (size != block_size) {
+        return;
+    }
+
+    double ratio = compressed * 100.0 / size;
+    size_t new_size = block_size;
+
+    if (compressed >= size) {
+        // Incompressible data
+        new_size = block_size / 2;
+        strm.state.adaptive_growing = false;
+        strm.state.adaptive_hold = LZLIB4_ADAPTIVE_HOLD_BLOCKS;
+    }
+    else if (options.max_block_latency_us && seconds * 1e6 > options.max_block_latency_us) {
+        // The block is too slow
+        new_size = block_size - block_size / 4;
+        strm.state.adaptive_growing = false;
+        strm.state.adaptive_hold = LZLIB4_ADAPTIVE_HOLD_BLOCKS;
+    }
+    else if (strm.state.adaptive_growing && strm.state.adaptive_last_ratio - ratio < options.min_gain) {
+        // The last growth didn't improve the ratio enough, so go back and wait
+        new_size = block_size / 2;
+        strm.state.adaptive_growing = false;
+        strm.state.adaptive_hold = LZLIB4_ADAPTIVE_HOLD_BLOCKS;
+    }
+    else if (strm.state.adaptive_hold) {
+        strm.state.adaptive_hold--;
+    }
+    else if (block_size < options.max_block_size) {
+        // Try a bigger block
+        new_size = block_size * 2;
+        strm.state.adaptive_growing = true;
+    }
+
+    new_size = std::max(options.min_block_size, std::min(options.max_block_size, new_size));
+    if (new_size != block_size) {
+        strm.state.adaptive_last_ratio = ratio;
+        block_size = new_size;
+    }
+    else {
+        strm.state.adaptive_growing = false;
+    }
+}
+
+
+/**
+ * @brief Write a metadata block (a block header with a marker followed by its data) into the output buffer
+ *
+ * @param marker : Marker stored into the crc field of the header
+ * @param data : Metadata
+ * @param size : Metadata size
+ * @return int : LZLIB4_RC_OK if the block was written, negative number otherwise.
+ */
+int lzlib4::write_marker(uint32_t marker, const uint8_t * data, size_t size) {
+    if ((size + sizeof(LZLIB4_BLOCK_HEADER)) > strm.avail_out) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    if (size > LZLIB4_BLOCK_SIZE_MASK) {
+        return LZLIB4_RC_BLOCK_SIZE_ERROR;
+    }
+
+    LZLIB4_BLOCK_HEADER header = {
+        (uint32_t) size, // compressed_size
+        0, // uncompressed_size
+        marker // CRC
+    };
+    memcpy(strm.next_out, &header, sizeof(header));
+    strm.next_out += sizeof(header);
+    strm.avail_out -= sizeof(header);
+
+    memcpy(strm.next_out, data, size);
+    strm.next_out += size;
+    strm.avail_out -= size;
+
+    strm.state.compress_total_out += sizeof(header) + size;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Write a resynchronization marker for the next block
+ *
+ * @param uncompressed_offset : Position of the next block data into the uncompressed data
+ * @param next : Header of the next block
+ * @return int : LZLIB4_RC_OK if the marker was written, negative number otherwise.
+ */
+int lzlib4::write_sync_marker(uint64_t uncompressed_offset, const LZLIB4_BLOCK_HEADER &next) {
+    uint8_t data[LZLIB4_SYNC_SIZE];
+    uint32_t check = sync_check(uncompressed_offset, (const uint8_t *) &next);
+    memcpy(data, &uncompressed_offset, sizeof(uint64_t));
+    memcpy(data + sizeof(uint64_t), &check, sizeof(uint32_t));
+
+    return write_marker(LZLIB4_MARKER_SYNC, data, sizeof(data));
+}
+
+
+/**
+ * @brief CRC of a resynchronization marker: the uncompressed position followed by the next block header
+ *
+ * @param uncompressed_offset : Position of the next block data into the uncompressed data
+ * @param next : Next block header, as it is stored into the stream
+ * @return uint32_t
+ */
+uint32_t lzlib4::sync_check(uint64_t uncompressed_offset, const uint8_t * next) {
+    uint8_t data[sizeof(uint64_t) + sizeof(LZLIB4_BLOCK_HEADER)];
+    memcpy(data, &uncompressed_offset, sizeof(uint64_t));
+    memcpy(data + sizeof(uint64_t), next, sizeof(LZLIB4_BLOCK_HEADER));
+
+    return crc32(data, sizeof(data));
+}
+
+
+/**
+ * @brief Write a resynchronization marker before every block (or before every reordering window). The markers
+ *        allow a decoder in recovery mode to skip a damaged block and continue at the next valid one. See
+ *        lzlib4::set_recovery_mode.
+ *
+ * @param enabled : true to write the markers
+ * @return int : LZLIB4_RC_OK if the mode was changed, negative number otherwise.
+ */
+int lzlib4::set_sync_markers(bool enabled) {
+    strm.state.sync_markers = enabled;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Limit the work done by every compress call, so a big input can be compressed in several calls without
+ *        blocking the caller for too long. See lzlib4_work_budget.
+ *
+ * @param budget : Work budget. All the limits at 0 disable it.
+ * @return int : LZLIB4_RC_OK if the budget was set, negative number otherwise.
+ */
+int lzlib4::set_work_budget(const lzlib4_work_budget &budget) {
+    strm.state.work_budget = budget;
+    strm.state.work_budget_mode = budget.max_bytes || budget.max_blocks || budget.max_time_us;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Check if decoding a block with the entropy coding stage stays into the maximum decoding cost
+ *
+ * @param size : Uncompressed size of the block
+ * @param compressed : Size of the LZ4 block data
+ * @return true if the stage can be used in the block
+ */
+bool lzlib4::entropy_cost_allowed(size_t size, size_t compressed) {
+    uint64_t lz4_cost = (uint64_t) size * LZLIB4_ENTROPY_COST_LZ4_OUTPUT + (uint64_t) compressed * LZLIB4_ENTROPY_COST_LZ4_INPUT;
+    uint64_t entropy_cost = (uint64_t) compressed * LZLIB4_ENTROPY_COST_HUFFMAN + LZLIB4_ENTROPY_COST_TABLES;
+
+    return entropy_cost * 100 <= lz4_cost * (strm.state.entropy_max_decode_cost - 100);
+}
+
+
+/**
+ * @brief Enable the entropy coding stage. Every LZ4 block is also encoded with a Huffman coder, and the encoded
+ *        block is kept when it is at least "min_saving" percent smaller. It improves the compression ratio of
+ *        cold data at the cost of a slower decompression, so the stage is only tried on the blocks whose estimated
+ *        decoding time stays below "max_decode_cost".
+ *
+ * @param min_saving : Minimum saving in percent (1-99). 0 disables the stage.
+ * @param max_decode_cost : Maximum decoding time of a block, in percent of its plain LZ4 decoding time (> 100).
+ * @return int : LZLIB4_RC_OK if the stage was enabled, negative number otherwise.
+ */
+int lzlib4::set_entropy_stage(uint8_t min_saving, uint16_t max_decode_cost) {
+    if (min_saving > 99 || max_decode_cost <= 100 || !strm.state.compress_out_buffer) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    if (min_saving && !strm.state.compress_entropy_buffer) {
+        if (!memory_available(0, strm.state.compress_out_size)) {
+            return LZLIB4_RC_MEMORY_LIMIT;
+        }
+        strm.state.compress_entropy_buffer = (uint8_t*) malloc(strm.state.compress_out_size);
+        if (!strm.state.compress_entropy_buffer) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+    }
+
+    strm.state.entropy_min_saving = min_saving;
+    strm.state.entropy_max_decode_cost = max_decode_cost;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Enable or disable the stream index. When enabled, the position of every block is stored and an index is
+ *        written at the end of the stream when compress is called with LZLIB4_FINISH. The index allows to locate
+ *        any position of the uncompressed data without reading the whole stream.
+ *
+ * @param enabled : true to enable the index
+ * @return int : LZLIB4_RC_OK if the index was enabled, negative number otherwise.
+ */
+int lzlib4::set_index_mode(bool enabled) {
+    // The index must be enabled before the first block
+    if (strm.state.compress_total_out) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    strm.state.index_mode = enabled;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Write the index metadata block. The entries are sorted by its position into the uncompressed data and,
+ *        if the record index is enabled, followed by the records location sorted by record number. The block ends
+ *        with a LZLIB4_INDEX_TRAILER, so the index can be located reading the last bytes of the stream.
+ *
+ * @return int : LZLIB4_RC_OK if the index was written, negative number otherwise.
+ */
+int lzlib4::write_index() {
+    std::vector<LZLIB4_INDEX_ENTRY> &entries = strm.state.index_entries;
+    std::sort(entries.begin(), entries.end(), [](const LZLIB4_INDEX_ENTRY &a, const LZLIB4_INDEX_ENTRY &b) {
+        return a.uncompressed_offset < b.uncompressed_offset;
+    });
+
+    // The records are stored by number, so the record N is the entry N
+    std::vector<lzlib4_record_location> &records = strm.state.records;
+    size_t records_count = 0;
+    if (strm.state.record_index) {
+        std::sort(records.begin(), records.end(), [](const lzlib4_record_location &a, const lzlib4_record_location &b) {
+            return a.record < b.record;
+        });
+        for (size_t i = 0; i < records.size(); i++) {
+            if (records[i].record != i) {
+                // Some records were removed with clear_records()
+                return LZLIB4_RC_INDEX_ERROR;
+            }
+        }
+        records_count = records.size();
+    }
+
+    LZLIB4_INDEX_TRAILER trailer;
+    trailer.index_offset = strm.state.compress_total_out;
+    trailer.entries = (uint32_t) entries.size();
+    trailer.records = records_count;
+
+    size_t entries_size = entries.size() * sizeof(LZLIB4_INDEX_ENTRY);
+    std::vector<uint8_t> data(entries_size + records_count * sizeof(LZLIB4_RECORD_ENTRY) + sizeof(trailer));
+    if (entries_size) {
+        memcpy(data.data(), entries.data(), entries_size);
+    }
+    for (size_t i = 0; i < records_count; i++) {
+        LZLIB4_RECORD_ENTRY record;
+        record.block = records[i].block;
+        record.offset = records[i].offset;
+        record.size = records[i].size;
+        memcpy(data.data() + entries_size + i * sizeof(record), &record, sizeof(record));
+    }
+    memcpy(data.data() + data.size() - sizeof(trailer), &trailer, sizeof(trailer));
+
+    int return_code = write_marker(LZLIB4_MARKER_INDEX, data.data(), data.size());
+    if (return_code == LZLIB4_RC_OK) {
+        // The stream was finished, so a new one can be started
+        entries.clear();
+        if (strm.state.record_index) {
+            records.clear();
+        }
+    }
+
+    return return_code;
+}
+
+
+/**
+ * @brief Locate the index of a compressed stream. The stream must end with the index metadata block.
+ *
+ * @param stream : Compressed stream
+ * @param stream_size : Compressed stream size
+ * @param index : Index location
+ * @return int : LZLIB4_RC_OK if the index was found, LZLIB4_RC_INDEX_ERROR otherwise.
+ */
+int lzlib4::read_index(const uint8_t * stream, size_t stream_size, lzlib4_index_view &index) {
+    if (!stream || stream_size < sizeof(LZLIB4_BLOCK_HEADER) + sizeof(LZLIB4_INDEX_TRAILER)) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    // The unordered streams point to its current index from the first block, and the index can be followed by newer
+    // data (see lzlib4_recompactor). The stream ends at the index for the rest of the checks.
+    LZLIB4_BLOCK_HEADER first;
+    memcpy(&first, stream, sizeof(first));
+    if (first.crc == LZLIB4_MARKER_UNORDERED && !first.uncompressed_size && first.compressed_size == LZLIB4_UNORDERED_SIZE) {
+        uint64_t position = 0;
+        memcpy(&position, stream + sizeof(first), sizeof(position));
+        if (position && position + sizeof(LZLIB4_BLOCK_HEADER) <= stream_size) {
+            LZLIB4_BLOCK_HEADER index_header;
+            memcpy(&index_header, stream + position, sizeof(index_header));
+            uint64_t end = position + sizeof(index_header) + (index_header.compressed_size & LZLIB4_BLOCK_SIZE_MASK);
+            if (index_header.crc == LZLIB4_MARKER_INDEX && end <= stream_size) {
+                stream_size = end;
+            }
+        }
+    }
+
+    memcpy(&index.trailer, stream + stream_size - sizeof(LZLIB4_INDEX_TRAILER), sizeof(LZLIB4_INDEX_TRAILER));
+    if (index.trailer.magic != LZLIB4_INDEX_MAGIC || index.trailer.index_offset >= stream_size) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    // The index block must fill the rest of the stream
+    uint64_t index_size = sizeof(LZLIB4_BLOCK_HEADER) +
+        (uint64_t) index.trailer.entries * sizeof(LZLIB4_INDEX_ENTRY) +
+        index.trailer.records * sizeof(LZLIB4_RECORD_ENTRY) +
+        sizeof(LZLIB4_INDEX_TRAILER);
+    if (index.trailer.records > stream_size || index.trailer.index_offset + index_size != stream_size) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    LZLIB4_BLOCK_HEADER header;
+    memcpy(&header, stream + index.trailer.index_offset, sizeof(header));
+    if (header.crc != LZLIB4_MARKER_INDEX || header.uncompressed_size || header.compressed_size != index_size - sizeof(header)) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    index.entries = stream + index.trailer.index_offset + sizeof(header);
+    index.records = index.entries + index.trailer.entries * sizeof(LZLIB4_INDEX_ENTRY);
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Get an index entry. The entries are copied because the index can be at any position of the stream.
+ *
+ * @param index : Index location
+ * @param block : Block number, in the order of the uncompressed data
+ * @return LZLIB4_INDEX_ENTRY
+ */
+LZLIB4_INDEX_ENTRY lzlib4::index_entry(const lzlib4_index_view &index, uint64_t block) {
+    LZLIB4_INDEX_ENTRY entry;
+    memcpy(&entry, index.entries + block * sizeof(LZLIB4_INDEX_ENTRY), sizeof(entry));
+    return entry;
+}
+
+
+/**
+ * @brief Get a record location from the index
+ *
+ * @param index : Index location
+ * @param record : Record number
+ * @return LZLIB4_RECORD_ENTRY
+ */
+LZLIB4_RECORD_ENTRY lzlib4::index_record(const lzlib4_index_view &index, uint64_t record) {
+    LZLIB4_RECORD_ENTRY entry;
+    memcpy(&entry, index.records + record * sizeof(LZLIB4_RECORD_ENTRY), sizeof(entry));
+    return entry;
+}
+
+
+/**
+ * @brief Every block is compressed without using the previous blocks as dictionary, so any block can be
+ *        decompressed without decompressing the previous ones. The compression ratio is a bit worse.
+ *
+ * @param enabled : true to compress independent blocks
+ * @return int : LZLIB4_RC_OK
+ */
+int lzlib4::set_independent_blocks(bool enabled) {
+    strm.state.independent_blocks = enabled;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Enable the record index. The location of every record (the data of every compress call in
+ *        LZLIB4_INPUT_NOSPLIT mode) is stored into the stream index, so any record can be read using
+ *        decompress_record without reading the rest of the stream. This mode enables the stream index and the
+ *        independent blocks. clear_records() must not be used while the mode is enabled.
+ *
+ * @param enabled : true to enable the record index
+ * @return int : LZLIB4_RC_OK if the mode was enabled, negative number otherwise.
+ */
+int lzlib4::set_record_index(bool enabled) {
+    if (enabled && strm.state.compress_block_mode != LZLIB4_INPUT_NOSPLIT) {
+        return LZLIB4_RC_BLOCK_SIZE_ERROR;
+    }
+
+    if (enabled) {
+        int return_code = set_index_mode(true);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+        strm.state.independent_blocks = true;
+        strm.state.track_records = true;
+    }
+
+    strm.state.record_index = enabled;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Decompress a single record using the record index. strm.next_in must point to the whole compressed stream
+ *        (for example a memory mapped file) and the record is written into strm.next_out. The input pointers are
+ *        not modified, so the function can be called again to read other records.
+ *
+ *        Only the block which contains the record is decompressed, and only up to the end of the record if the CRC
+ *        is not checked.
+ *
+ * @param record : Record number
+ * @param check_crc : Check the block CRC. The whole block must be decompressed to do it.
+ * @return int : LZLIB4_RC_OK if the record was read, negative number otherwise.
+ */
+int lzlib4::decompress_record(uint64_t record, bool check_crc) {
+    lzlib4_index_view index;
+    int return_code = read_index(strm.next_in, strm.avail_in, index);
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    if (record >= index.trailer.records) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    LZLIB4_RECORD_ENTRY location = index_record(index, record);
+    if (location.block >= index.trailer.entries) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+    if (location.size > strm.avail_out) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    LZLIB4_INDEX_ENTRY entry = index_entry(index, location.block);
+    if (entry.offset + sizeof(LZLIB4_BLOCK_HEADER) > index.trailer.index_offset) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    LZLIB4_BLOCK_HEADER header;
+    memcpy(&header, strm.next_in + entry.offset, sizeof(header));
+    uint32_t flags = header.compressed_size & ~LZLIB4_BLOCK_SIZE_MASK;
+    header.compressed_size &= LZLIB4_BLOCK_SIZE_MASK;
+    header.uncompressed_size &= LZLIB4_BLOCK_SIZE_MASK;
+
+    if (
+        entry.offset + sizeof(header) + header.compressed_size > index.trailer.index_offset ||
+        header.uncompressed_size > LZLIB4_MAX_BLOCK_SIZE ||
+        (uint64_t) location.offset + location.size > header.uncompressed_size
+    ) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    // Linked blocks need the previous blocks
+    if (!(flags & (LZLIB4_BLOCK_FLAG_INDEPENDENT | LZLIB4_BLOCK_FLAG_STORED))) {
+        return LZLIB4_RC_LINKED_BLOCK;
+    }
+
+    uint8_t * src = strm.next_in + entry.offset + sizeof(header);
+    size_t src_size = header.compressed_size;
+    uint8_t * block = src;
+
+    if (!(flags & LZLIB4_BLOCK_FLAG_STORED)) {
+        if (flags & LZLIB4_BLOCK_FLAG_ENTROPY) {
+            return_code = entropy_decode(&src, &src_size, header.uncompressed_size);
+            if (return_code != LZLIB4_RC_OK) {
+                return return_code;
+            }
+        }
+
+        if (header.uncompressed_size > strm.state.decompress_tmp_size_real) {
+            if (!memory_available(strm.state.decompress_tmp_size_real, header.uncompressed_size)) {
+                return LZLIB4_RC_MEMORY_LIMIT;
+            }
+            uint8_t * new_buffer = (uint8_t*) realloc(strm.state.decompress_tmp_buffer, header.uncompressed_size);
+            if (!new_buffer) {
+                return LZLIB4_RC_BUFFER_ERROR;
+            }
+            strm.state.decompress_tmp_buffer = new_buffer;
+            strm.state.decompress_tmp_size_real = header.uncompressed_size;
+        }
+
+        // Decompress only the block data up to the end of the record
+        size_t target = check_crc ? header.uncompressed_size : location.offset + location.size;
+        int decompressed = LZ4_decompress_safe_partial(
+            (char *) src,
+            (char *) strm.state.decompress_tmp_buffer,
+            src_size,
+            target,
+            header.uncompressed_size
+        );
+        if (decompressed < 0 || (size_t) decompressed < target) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        block = strm.state.decompress_tmp_buffer;
+    }
+    else if (src_size != header.uncompressed_size) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    if (check_crc && crc32(block, header.uncompressed_size) != header.crc) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    memcpy(strm.next_out, block + location.offset, location.size);
+    strm.next_out += location.size;
+    strm.avail_out -= location.size;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Enable the similarity reordering mode.
+ *
+ * The blocks are kept into a window of "window_blocks" blocks. When the window is full (or a flush is requested),
+ * the blocks are fingerprinted (minhash) and written in an order that keeps the similar blocks together, so every
+ * block can use the previous one as dictionary. Every window starts with a permutation metadata block, which
+ * allows the decompress function to return the data in the original order.
+ *
+ * @param window_blocks : Blocks per window (up to LZLIB4_REORDER_MAX_WINDOW). 0 disables the reordering.
+ * @return int : LZLIB4_RC_OK if the mode was enabled, negative number otherwise.
+ */
+int lzlib4::set_reorder_window(uint16_t window_blocks) {
+    if (window_blocks > LZLIB4_REORDER_MAX_WINDOW || !strm.state.compress_in_buffer) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // There can't be pending blocks
+    if (strm.state.reorder_count) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    if (strm.state.reorder_buffer) {
+        free(strm.state.reorder_buffer);
+        strm.state.reorder_buffer = NULL;
+    }
+    strm.state.reorder_window = 0;
+
+    if (!window_blocks) {
+        return LZLIB4_RC_OK;
+    }
+
+    if (!memory_available(0, window_blocks * (strm.state.compress_in_size + LZLIB4_REORDER_SLOT_GAP))) {
+        return LZLIB4_RC_MEMORY_LIMIT;
+    }
+    strm.state.reorder_slot_size = strm.state.compress_in_size + LZLIB4_REORDER_SLOT_GAP;
+    strm.state.reorder_buffer = (uint8_t*) malloc(window_blocks * strm.state.reorder_slot_size);
+    if (!strm.state.reorder_buffer) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    strm.state.reorder_sizes.assign(window_blocks, 0);
+    strm.state.reorder_fingerprints.assign(window_blocks * LZLIB4_REORDER_HASHES, 0);
+    strm.state.reorder_window = window_blocks;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Move the compression buffer data to the reordering window, and flush the window if is full
+ *
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4::queue_block() {
+    uint16_t slot = strm.state.reorder_count++;
+    memcpy(strm.state.reorder_buffer + slot * strm.state.reorder_slot_size, strm.state.compress_in_buffer, strm.state.compress_in_index);
+    strm.state.reorder_sizes[slot] = strm.state.compress_in_index;
+
+    if (strm.state.reorder_count == strm.state.reorder_window) {
+        return flush_window();
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Calculate the block minhash fingerprint. A rolling hash of every 8 bytes is sampled when its lower bits are
+ *        zero (so the samples depend on the content and not in the position), and for every sample LZLIB4_REORDER_HASHES
+ *        permutations are calculated keeping the minimum value of every one.
+ *
+ * @param data : Block data
+ * @param size : Block size
+ * @param fingerprint : Output fingerprint (LZLIB4_REORDER_HASHES values)
+ */
+static void lzlib4_fingerprint(const uint8_t * data, size_t size, uint32_t * fingerprint) {
+    for (uint8_t i = 0; i < LZLIB4_REORDER_HASHES; i++) {
+        fingerprint[i] = UINT32_MAX;
+    }
+
+    if (size < 8) {
+        return;
+    }
+
+    for (size_t pos = 0; pos + 8 <= size; pos++) {
+        uint64_t shingle;
+        memcpy(&shingle, data + pos, sizeof(shingle));
+        uint64_t hash = shingle * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+
+        // Sample one of every 16 shingles
+        if (hash & 0xF) {
+            continue;
+        }
+
+        for (uint8_t i = 0; i < LZLIB4_REORDER_HASHES; i++) {
+            uint32_t value = (uint32_t) (((hash ^ (0x632BE59BD9B4E019ULL * (i + 1))) * 0xC2B2AE3D27D4EB4FULL) >> 32);
+            if (value < fingerprint[i]) {
+                fingerprint[i] = value;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Write all the blocks in the reordering window. The first block is the first block of the window and then
+ *        the most similar block to the last written one is selected every time.
+ *
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4::flush_window() {
+    uint16_t count = strm.state.reorder_count;
+    if (!count) {
+        return LZLIB4_RC_OK;
+    }
+
+    uint32_t * fingerprints = strm.state.reorder_fingerprints.data();
+    for (uint16_t i = 0; i < count; i++) {
+        lzlib4_fingerprint(
+            strm.state.reorder_buffer + i * strm.state.reorder_slot_size,
+            strm.state.reorder_sizes[i],
+            fingerprints + i * LZLIB4_REORDER_HASHES
+        );
+    }
+
+    // Greedy chain: every time select the most similar block to the last one. With equal similarity the original
+    // order is kept.
+    std::vector<uint32_t> order(count);
+    std::vector<bool> used(count, false);
+    order[0] = 0;
+    used[0] = true;
+    for (uint16_t pos = 1; pos < count; pos++) {
+        uint32_t * last = fingerprints + order[pos - 1] * LZLIB4_REORDER_HASHES;
+        int best_score = -1;
+        uint16_t best = 0;
+
+        for (uint16_t i = 0; i < count; i++) {
+            if (used[i]) {
+                continue;
+            }
+
+            uint32_t * current = fingerprints + i * LZLIB4_REORDER_HASHES;
+            int score = 0;
+            for (uint8_t h = 0; h < LZLIB4_REORDER_HASHES; h++) {
+                if (current[h] == last[h] && current[h] != UINT32_MAX) {
+                    score++;
+                }
+            }
+
+            if (score > best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+
+        order[pos] = best;
+        used[best] = true;
+    }
+
+    // Permutation metadata block: original slot of every block in the order they are written. The window can be
+    // found after a damaged block by the resynchronization marker written before it.
+    if (strm.state.sync_markers) {
+        LZLIB4_BLOCK_HEADER permutation = {
+            (uint32_t) (count * sizeof(uint32_t)),
+            0,
+            LZLIB4_MARKER_PERMUTATION
+        };
+        int return_code = write_sync_marker(strm.state.compress_total_in, permutation);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+    int return_code = write_marker(LZLIB4_MARKER_PERMUTATION, (uint8_t *) order.data(), count * sizeof(uint32_t));
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    // Position of every slot into the uncompressed data
+    std::vector<uint64_t> offsets(count);
+    uint64_t offset = strm.state.compress_total_in;
+    for (uint16_t i = 0; i < count; i++) {
+        offsets[i] = offset;
+        offset += strm.state.reorder_sizes[i];
+    }
+
+    for (uint16_t pos = 0; pos < count; pos++) {
+        uint32_t slot = order[pos];
+        // Every window starts from an empty dictionary, because the next window will overwrite the slots
+        return_code = write_block(
+            strm.state.reorder_buffer + slot * strm.state.reorder_slot_size,
+            strm.state.reorder_sizes[slot],
+            offsets[slot],
+            (pos && !strm.state.independent_blocks) ? 0 : LZLIB4_BLOCK_FLAG_INDEPENDENT
+        );
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+
+    strm.state.compress_total_in = offset;
+    strm.state.reorder_count = 0;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Enable the archival mode. See lzlib4_archival_options for details.
+ *
+ * @param options : Archival options. An options object without candidates disables the archival mode.
+ * @return int : LZLIB4_RC_OK if the mode was enabled, negative number otherwise.
+ */
+int lzlib4::set_archival_mode(const lzlib4_archival_options &options) {
+    if (options.candidates_count > LZLIB4_ARCHIVAL_MAX_CANDIDATES) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // The mode can only be used in compression streams, and the rate control selects the encoding too
+    if (!strm.state.compress_in_buffer || strm.state.rate_mode) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // Free the buffers of a previous configuration
+    for (uint8_t i = 0; i < LZLIB4_ARCHIVAL_MAX_CANDIDATES; i++) {
+        if (strm.state.archival_lz4[i]) {
+            LZ4_freeStreamHC(strm.state.archival_lz4[i]);
+            strm.state.archival_lz4[i] = NULL;
+        }
+        if (strm.state.archival_buffer[i]) {
+            free(strm.state.archival_buffer[i]);
+            strm.state.archival_buffer[i] = NULL;
+        }
+        strm.state.archival_choices[i] = 0;
+    }
+    if (strm.state.archival_check_buffer) {
+        free(strm.state.archival_check_buffer);
+        strm.state.archival_check_buffer = NULL;
+    }
+    if (strm.state.archival_pool) {
+        delete strm.state.archival_pool;
+        strm.state.archival_pool = NULL;
+    }
+
+    strm.state.archival_mode = false;
+    strm.state.archival_options = options;
+
+    if (!options.candidates_count) {
+        return LZLIB4_RC_OK;
+    }
+
+    size_t required = options.decompression_speed_budget ? strm.state.compress_in_size : 0;
+    for (uint8_t i = 0; i < options.candidates_count; i++) {
+        if (!options.candidates[i].stored) {
+            required += LZ4_sizeofStateHC() + strm.state.compress_out_size;
+        }
+    }
+    if (!memory_available(0, required)) {
+        return LZLIB4_RC_MEMORY_LIMIT;
+    }
+
+    strm.state.archival_pool = new lzlib4_pool(options.threads ? options.threads : options.candidates_count, options.pool_options);
+
+    // The buffers are allocated and written by the worker that will use them, so in the pinned pools the memory is
+    // placed in the node of that worker.
+    strm.state.archival_pool->run(options.candidates_count, [this, &options](size_t i) {
+        // Stored candidates only need the input buffer
+        if (options.candidates[i].stored) {
+            return;
+        }
+
+        strm.state.archival_lz4[i] = LZ4_createStreamHC();
+        strm.state.archival_buffer[i] = (uint8_t*) malloc(strm.state.compress_out_size);
+        if (strm.state.archival_buffer[i] && options.pool_options.pin_threads) {
+            memset(strm.state.archival_buffer[i], 0, strm.state.compress_out_size);
+        }
+    });
+
+    for (uint8_t i = 0; i < options.candidates_count; i++) {
+        if (!options.candidates[i].stored && (!strm.state.archival_lz4[i] || !strm.state.archival_buffer[i])) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+    }
+
+    // The decompression speed check needs a place to decompress the candidates
+    if (options.decompression_speed_budget) {
+        strm.state.archival_check_buffer = (uint8_t*) malloc(strm.state.compress_in_size);
+        if (!strm.state.archival_check_buffer) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+    }
+
+    strm.state.archival_mode = true;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Encode a block with all the archival candidates and select the best one
+ *
+ * @param in : Uncompressed block data
+ * @param in_size : Uncompressed block size
+ * @param data : Pointer to the selected block data
+ * @param size : Size of the selected block data
+ * @param flags : Block flags
+ * @param choice : Selected candidate index
+ * @return int : LZLIB4_RC_OK if a candidate was selected, negative number otherwise.
+ */
+int lzlib4::compress_block_archival(uint8_t * in, size_t in_size, uint8_t ** data, size_t * size, uint32_t * flags, uint8_t * choice) {
+    lzlib4_archival_options &options = strm.state.archival_options;
+
+    // Encode the block with every candidate at once
+    strm.state.archival_pool->run(options.candidates_count, [this, &options, in, in_size](size_t i) {
+        if (options.candidates[i].stored) {
+            strm.state.archival_compressed[i] = in_size;
+            return;
+        }
+
+        // Every block starts with a clean state, so the block will not depend on the previous ones
+        LZ4_resetStreamHC_fast(strm.state.archival_lz4[i], options.candidates[i].compression_level);
+#ifdef LZ4_HC_STATIC_LINKING_ONLY
+        LZ4_setFavorDecSpeed(strm.state.archival_lz4[i], options.candidates[i].favor_decompression_speed);
+#endif
+        strm.state.archival_compressed[i] = LZ4_compress_HC_continue(
+            strm.state.archival_lz4[i],
+            (char *) in,
+            (char *) strm.state.archival_buffer[i],
+            in_size,
+            strm.state.compress_out_size
+        );
+    });
+
+    // Sort the valid candidates by size
+    uint8_t order[LZLIB4_ARCHIVAL_MAX_CANDIDATES];
+    uint8_t valid = 0;
+    for (uint8_t i = 0; i < options.candidates_count; i++) {
+        if (!strm.state.archival_compressed[i]) {
+            continue;
+        }
+
+        uint8_t pos = valid++;
+        while (pos && strm.state.archival_compressed[order[pos - 1]] > strm.state.archival_compressed[i]) {
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = i;
+    }
+
+    if (!valid) {
+        return LZLIB4_RC_COMPRESSION_ERROR;
+    }
+
+    // Select the smallest candidate which meets the decompression speed budget. If no one meets it, the smallest
+    // one is used.
+    uint8_t selected = order[0];
+    if (options.decompression_speed_budget) {
+        for (uint8_t i = 0; i < valid; i++) {
+            uint8_t candidate = order[i];
+            // Stored blocks are just a copy
+            if (options.candidates[candidate].stored) {
+                selected = candidate;
+                break;
+            }
+
+            // Best of three runs to reduce the timer noise
+            double best_time = 0;
+            for (uint8_t run = 0; run < 3; run++) {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                LZ4_decompress_safe(
+                    (char *) strm.state.archival_buffer[candidate],
+                    (char *) strm.state.archival_check_buffer,
+                    strm.state.archival_compressed[candidate],
+                    strm.state.compress_in_size
+                );
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (!run || elapsed < best_time) {
+                    best_time = elapsed;
+                }
+            }
+
+            if (best_time <= 0 || (in_size / best_time / 1000000) >= options.decompression_speed_budget) {
+                selected = candidate;
+                break;
+            }
+        }
+    }
+
+    strm.state.archival_choices[selected]++;
+    *size = strm.state.archival_compressed[selected];
+    *choice = selected;
+    *flags = LZLIB4_BLOCK_FLAG_INDEPENDENT;
+    if (options.candidates[selected].stored) {
+        *data = in;
+        *flags |= LZLIB4_BLOCK_FLAG_STORED;
+    }
+    else {
+        *data = strm.state.archival_buffer[selected];
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+int lzlib4::decompress(bool check_crc) {
+    // A damaged block can be decompressed without errors, so the recovery mode always checks the CRC
+    check_crc = check_crc || strm.state.decompress_recovery;
+
+    while (true) {
+        if (strm.state.decompress_resync && !resync()) {
+            // There is no valid block into the input
+            return LZLIB4_RC_OK;
+        }
 
-                // Copy the compressed block to the output buffer
-                memcpy(strm.next_out, strm.state.compress_out_buffer, compressed);
-                // Set the new pointer position and available space
-                strm.next_out += compressed;
-                strm.avail_out -= compressed;
-                // Reset the input index
-                strm.state.compress_in_index = 0;
-
-                // If any flush mode was set
-                if (flush_mode) {
-                    // If flush mode is a full flush, a stream reset is required
-                    if (flush_mode == LZLIB4_FULL_FLUSH) {
-                        // Reset the stream setting the block compression
-                        LZ4_resetStreamHC(strm.state.strm_lz4, compression_level);
-                    }
-                    // Reset the flush mode to exit the loop at end
-                    flush_mode = LZLIB4_NO_FLUSH;
-                }
-            }
-            else {
-                return LZLIB4_RC_COMPRESSION_ERROR;
-            }
+        int return_code = decompress_blocks(check_crc);
+        if (
+            !strm.state.decompress_recovery ||
+            (return_code != LZLIB4_RC_BLOCK_DAMAGED && return_code != LZLIB4_RC_BLOCK_SIZE_ERROR)
+        ) {
+            return return_code;
         }
-    }
 
-    /* Flush mode was set to FINISH, so stream state will be reset */
-    if (flush_mode == LZLIB4_FINISH){
-        LZ4_resetStreamHC(strm.state.strm_lz4, compression_level);
+        mark_damaged();
     }
-
-    return 0;
 }
 
 
-int lzlib4::decompress(bool check_crc) {
-    LZLIB4_BLOCK_HEADER header;
+/**
+ * @brief Decompress the blocks of the input buffer. Used by decompress, which handles the damaged blocks in
+ *        recovery mode.
+ *
+ * @param check_crc : Check the blocks CRC
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4::decompress_blocks(bool check_crc) {
+    // The header is kept into the state because the block can be readed in chunks
+    LZLIB4_BLOCK_HEADER &header = strm.state.decompress_header;
 
-    while (strm.avail_in) {
+    // Return the pending data of the reordering window before reading more blocks
+    emit_window();
+
+    // A header found by the resynchronization is already readed
+    while (strm.avail_in || strm.state.decompress_header_index == sizeof(header)) {
         bool to_decompress = false;
         size_t to_read = 0;
 
+        // In a reordering window the blocks are not written directly into the output buffer, so stop if it is full
+        // or if all the window blocks were decompressed but there was no space to return them.
+        if (strm.state.decompress_window_blocks && (
+            (!strm.avail_out && !strm.state.decompress_borrow) ||
+            strm.state.decompress_window_index == strm.state.decompress_window_blocks
+        )) {
+            break;
+        }
+
         // If block is not a partial block
         if (!strm.partial_block) {
-            // Read the block header
-            memcpy(&header, strm.next_in, sizeof(header));
+            // Read the block header, which can be splitted between input chunks
+            size_t header_read = std::min(sizeof(header) - strm.state.decompress_header_index, strm.avail_in);
+            memcpy(strm.state.decompress_header_bytes + strm.state.decompress_header_index, strm.next_in, header_read);
+            strm.next_in += header_read;
+            strm.avail_in -= header_read;
+            strm.state.decompress_header_index += header_read;
+            if (strm.state.decompress_header_index < sizeof(header)) {
+                break;
+            }
+            strm.state.decompress_header_index = 0;
+            memcpy(&header, strm.state.decompress_header_bytes, sizeof(header));
+
+            // The header must match the resynchronization marker written before it
+            if (strm.state.decompress_sync_pending) {
+                strm.state.decompress_sync_pending = false;
+                if (sync_check(strm.state.decompress_sync_offset, strm.state.decompress_header_bytes) != strm.state.decompress_sync_check) {
+                    return LZLIB4_RC_BLOCK_DAMAGED;
+                }
+            }
+
+            // Split the flags from the sizes
+            strm.state.decompress_flags = header.compressed_size & ~LZLIB4_BLOCK_SIZE_MASK;
+            header.compressed_size &= LZLIB4_BLOCK_SIZE_MASK;
+            header.uncompressed_size &= LZLIB4_BLOCK_SIZE_MASK;
+
+            // Metadata blocks don't have uncompressed data
+            bool metadata = !header.uncompressed_size && (
+                header.crc == LZLIB4_MARKER_PERMUTATION ||
+                header.crc == LZLIB4_MARKER_INDEX ||
+                header.crc == LZLIB4_MARKER_SYNC ||
+                header.crc == LZLIB4_MARKER_UNORDERED
+            );
 
             // Check if header is damaged and any of the sizes is 0
-            if (!header.compressed_size || !header.uncompressed_size || !header.crc) {
-                printf("There is no size or crc\n");
+            if (!header.compressed_size || (!metadata && (!header.uncompressed_size || !header.crc))) {
                 return LZLIB4_RC_BLOCK_DAMAGED;
             }
 
@@ -230,8 +2161,14 @@ int lzlib4::decompress(bool check_crc) {
                 return LZLIB4_RC_BLOCK_DAMAGED;
             }
 
-            // Output Buffer is smaller than the block size
-            if (header.uncompressed_size > strm.avail_out) {
+            // After a damaged block, the linked blocks are lost until the next independent block
+            if (!metadata && strm.state.decompress_dict_lost && !(strm.state.decompress_flags & LZLIB4_BLOCK_FLAG_INDEPENDENT)) {
+                return LZLIB4_RC_BLOCK_DAMAGED;
+            }
+
+            // Output Buffer is smaller than the block size. The reordering window blocks are returned in parts, and
+            // the borrowed blocks are not copied to the output buffer.
+            if (!strm.state.decompress_window_blocks && !strm.state.decompress_borrow && header.uncompressed_size > strm.avail_out) {
                 // Compressed stream doesn't fit the output buffer, so an error is returned
                 return LZLIB4_RC_BUFFER_ERROR;
             }
@@ -242,9 +2179,15 @@ int lzlib4::decompress(bool check_crc) {
             // If the compressed block size is bigger than the decompression input buffer,
             // create a bigger buffer.
             if (header.compressed_size > strm.state.decompress_in_size_real) {
+                // A damaged header can ask for a very big buffer, so the memory limit is checked first
+                if (!memory_available(strm.state.decompress_in_size_real, header.compressed_size)) {
+                    return LZLIB4_RC_MEMORY_LIMIT;
+                }
+
                 // Free the old buffer if exists
                 if (strm.state.decompress_in_buffer) {
                     free(strm.state.decompress_in_buffer);
+                    strm.state.decompress_in_size_real = 0;
                 }
                 // And create a new one
                 strm.state.decompress_in_buffer = (uint8_t*) malloc(header.compressed_size);
@@ -259,9 +2202,14 @@ int lzlib4::decompress(bool check_crc) {
             // If the decompressed block size is bigger than the decompression output buffer,
             // create a bigger buffer.
             if (header.uncompressed_size > strm.state.decompress_out_size_real) {
+                if (!memory_available(strm.state.decompress_out_size_real, header.uncompressed_size)) {
+                    return LZLIB4_RC_MEMORY_LIMIT;
+                }
+
                 // Free the old buffer if exists
                 if (strm.state.decompress_out_buffer) {
                     free(strm.state.decompress_out_buffer);
+                    strm.state.decompress_out_size_real = 0;
                 }
                 // And create a new one
                 strm.state.decompress_out_buffer = (uint8_t*) malloc(header.uncompressed_size);
@@ -279,8 +2227,6 @@ int lzlib4::decompress(bool check_crc) {
 
             // Started to process a block.
             strm.partial_block = true;
-            strm.next_in += sizeof(header);
-            strm.avail_in -= sizeof(header);
         }
 
         // Check the space left in input buffer
@@ -312,23 +2258,47 @@ int lzlib4::decompress(bool check_crc) {
             }
         }
 
-        if (to_decompress) {
+        if (to_decompress && !header.uncompressed_size) {
+            // Metadata block
+            int return_code = process_marker();
+            if (return_code != LZLIB4_RC_OK) {
+                return return_code;
+            }
+
+            // Reset the input index
+            strm.state.decompress_in_index = 0;
+            strm.partial_block = false;
+        }
+        else if (to_decompress) {
+            // Blocks of a reordering window are decompressed into its slot
+            uint8_t * out = strm.state.decompress_out_buffer;
+            uint32_t slot = 0;
+            if (strm.state.decompress_window_blocks) {
+                slot = strm.state.decompress_window_slots[strm.state.decompress_window_index];
+                if (header.uncompressed_size > strm.state.decompress_window_capacity[slot]) {
+                    if (!memory_available(strm.state.decompress_window_capacity[slot], header.uncompressed_size)) {
+                        return LZLIB4_RC_MEMORY_LIMIT;
+                    }
+                    uint8_t * new_buffer = (uint8_t*) realloc(strm.state.decompress_window_buffers[slot], header.uncompressed_size);
+                    if (!new_buffer) {
+                        return LZLIB4_RC_BUFFER_ERROR;
+                    }
+                    strm.state.decompress_window_buffers[slot] = new_buffer;
+                    strm.state.decompress_window_capacity[slot] = header.uncompressed_size;
+                }
+                out = strm.state.decompress_window_buffers[slot];
+            }
+
             // Block is full so no more data is required
-            size_t decompressed = LZ4_decompress_safe_continue(
-                strm.state.strm_lz4_decode,
-                (char *) strm.state.decompress_in_buffer,
-                (char *) strm.state.decompress_out_buffer,
-                strm.state.decompress_in_index,
-                strm.state.decompress_out_size
-            );
+            int decompressed = decode_block(out);
 
-            if (decompressed != strm.state.decompress_out_size) {
+            if (decompressed < 0 || (size_t) decompressed != strm.state.decompress_out_size) {
                 // There was an error decompressing the block
                 return LZLIB4_RC_BLOCK_SIZE_ERROR;
             }
 
             if (check_crc) {
-                uint32_t crc = crc32(strm.state.decompress_out_buffer, strm.state.decompress_out_size);
+                uint32_t crc = crc32(out, strm.state.decompress_out_size);
 
                 if (crc != header.crc) {
                     // Block CRC error
@@ -336,17 +2306,70 @@ int lzlib4::decompress(bool check_crc) {
                 }
             }
 
-            // Copy the decompressed buffer to output
-            memcpy(strm.next_out, strm.state.decompress_out_buffer, decompressed);
-            // Set the new pointer position and available space
-            strm.next_out += decompressed;
-            strm.avail_out -= decompressed;
+            // The decompressed block is the dictionary of the next one
+            strm.state.decompress_dict = out;
+            strm.state.decompress_dict_size = decompressed;
+            strm.state.decompress_dict_lost = false;
+
+            // The first valid block after a damaged block closes the lost range. The data continues at the position
+            // of the last resynchronization marker, which is this block or the start of its window.
+            if (strm.state.decompress_lost_open) {
+                lzlib4_lost_range &range = strm.state.decompress_lost.back();
+                if (strm.state.decompress_sync_offset > range.offset) {
+                    range.size = strm.state.decompress_sync_offset - range.offset;
+                }
+                else {
+                    strm.state.decompress_lost.pop_back();
+                }
+                strm.state.decompress_total_out = strm.state.decompress_sync_offset;
+                strm.state.decompress_lost_open = false;
+            }
+
+            if (strm.state.decompress_window_blocks) {
+                // Mark the slot as ready and return the data which is already in order
+                strm.state.decompress_window_sizes[slot] = decompressed;
+                strm.state.decompress_window_ready[slot] = true;
+                strm.state.decompress_window_index++;
+                emit_window();
+            }
+            else if (strm.state.decompress_borrow) {
+                // The block is returned without copying it. The buffer is kept as dictionary after the swap, so it
+                // will not be overwritten until the next block is decompressed.
+                strm.state.decompress_borrowed = out;
+                strm.state.decompress_borrowed_size = decompressed;
+                strm.state.decompress_total_out += decompressed;
+
+                std::swap(strm.state.decompress_out_buffer, strm.state.decompress_prev_buffer);
+                std::swap(strm.state.decompress_out_size_real, strm.state.decompress_prev_size_real);
+            }
+            else {
+                // Copy the decompressed buffer to output
+                memcpy(strm.next_out, out, decompressed);
+                // Set the new pointer position and available space
+                strm.next_out += decompressed;
+                strm.avail_out -= decompressed;
+                strm.state.decompress_total_out += decompressed;
+
+                // Swap the output buffers to keep the block while the next one is decompressed
+                std::swap(strm.state.decompress_out_buffer, strm.state.decompress_prev_buffer);
+                std::swap(strm.state.decompress_out_size_real, strm.state.decompress_prev_size_real);
+            }
+
             // Reset the input index
             strm.state.decompress_in_index = 0;
             strm.partial_block = false;
         }
 
-        if (strm.avail_out == 0) {
+        if (strm.state.decompress_borrow) {
+            // Stop as soon as there is a block to return
+            if (
+                strm.state.decompress_borrowed ||
+                (strm.state.decompress_window_blocks && strm.state.decompress_window_ready[strm.state.decompress_window_emit])
+            ) {
+                break;
+            }
+        }
+        else if (strm.avail_out == 0) {
             // There's no more space in output buffer so exit the loop
             break;
         }
@@ -355,10 +2378,444 @@ int lzlib4::decompress(bool check_crc) {
     return 0;
 }
 
+
+/**
+ * @brief Decompress the next block without copying it to the output buffer. The block is returned from the internal
+ *        decompression buffers, and the data is valid until the next call to any decompression function.
+ *        The input data is taken from "strm.next_in" like in decompress, and if there is not enough data to complete
+ *        a block, all the input is consumed and an empty block is returned.
+ *
+ * @param check_crc : Check the block CRC
+ * @param data : Pointer to the decompressed block data
+ * @param size : Decompressed block size. 0 if more input data is required.
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4::decompress_block(bool check_crc, const uint8_t ** data, size_t * size) {
+    *data = NULL;
+    *size = 0;
+
+    // The pending blocks of a reordering window are returned first
+    if (!borrow_window_block(data, size)) {
+        strm.state.decompress_borrow = true;
+        strm.state.decompress_borrowed = NULL;
+        strm.state.decompress_borrowed_size = 0;
+
+        int return_code = decompress(check_crc);
+        strm.state.decompress_borrow = false;
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+
+        if (strm.state.decompress_borrowed) {
+            *data = strm.state.decompress_borrowed;
+            *size = strm.state.decompress_borrowed_size;
+        }
+        else {
+            borrow_window_block(data, size);
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Take the next block of the reordering window if it is already decompressed
+ *
+ * @param data : Pointer to the block data
+ * @param size : Block size
+ * @return bool : true if a block was returned
+ */
+bool lzlib4::borrow_window_block(const uint8_t ** data, size_t * size) {
+    uint32_t &emit = strm.state.decompress_window_emit;
+    size_t &emit_pos = strm.state.decompress_window_emit_pos;
+
+    if (
+        !strm.state.decompress_window_blocks ||
+        emit >= strm.state.decompress_window_blocks ||
+        !strm.state.decompress_window_ready[emit]
+    ) {
+        return false;
+    }
+
+    *data = strm.state.decompress_window_buffers[emit] + emit_pos;
+    *size = strm.state.decompress_window_sizes[emit] - emit_pos;
+    strm.state.decompress_total_out += *size;
+    emit++;
+    emit_pos = 0;
+
+    // All the window blocks were returned
+    if (emit == strm.state.decompress_window_blocks) {
+        strm.state.decompress_window_blocks = 0;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Decompress the block stored into the decompression input buffer
+ *
+ * @param out : Output buffer. Must have space for the whole block.
+ * @return int : Decompressed size or negative number if there was an error
+ */
+int lzlib4::decode_block(uint8_t * out) {
+    uint8_t * src = strm.state.decompress_in_buffer;
+    size_t src_size = strm.state.decompress_in_index;
+
+    // Decode the entropy coding stage to get the LZ4 data
+    if (strm.state.decompress_flags & LZLIB4_BLOCK_FLAG_ENTROPY) {
+        int return_code = entropy_decode(&src, &src_size, strm.state.decompress_out_size);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+
+    if (strm.state.decompress_flags & LZLIB4_BLOCK_FLAG_STORED) {
+        // Stored blocks are just copied
+        if (src_size != strm.state.decompress_out_size) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+        memcpy(out, src, src_size);
+        return src_size;
+    }
+    else if ((strm.state.decompress_flags & LZLIB4_BLOCK_FLAG_INDEPENDENT) || !strm.state.decompress_dict) {
+        // Independent blocks don't need the previous data
+        return LZ4_decompress_safe(
+            (char *) src,
+            (char *) out,
+            src_size,
+            strm.state.decompress_out_size
+        );
+    }
+    else {
+        // Linked blocks use the previous block as dictionary
+        return LZ4_decompress_safe_usingDict(
+            (char *) src,
+            (char *) out,
+            src_size,
+            strm.state.decompress_out_size,
+            (char *) strm.state.decompress_dict,
+            strm.state.decompress_dict_size
+        );
+    }
+}
+
+
+/**
+ * @brief Decode the entropy coding stage of a block into the entropy buffer
+ *
+ * @param src : Encoded data. Is replaced by the decoded LZ4 data.
+ * @param src_size : Encoded data size. Is replaced by the decoded size.
+ * @param uncompressed_size : Block uncompressed size, used to check the decoded size
+ * @return int : LZLIB4_RC_OK if the data was decoded, negative number otherwise.
+ */
+int lzlib4::entropy_decode(uint8_t ** src, size_t * src_size, size_t uncompressed_size) {
+    size_t decoded_size = lzlib4_entropy_decoded_size(*src, *src_size);
+    if (!decoded_size || decoded_size > LZ4_COMPRESSBOUND(uncompressed_size)) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    if (decoded_size > strm.state.decompress_entropy_size_real) {
+        if (!memory_available(strm.state.decompress_entropy_size_real, decoded_size)) {
+            return LZLIB4_RC_MEMORY_LIMIT;
+        }
+        uint8_t * new_buffer = (uint8_t*) realloc(strm.state.decompress_entropy_buffer, decoded_size);
+        if (!new_buffer) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        strm.state.decompress_entropy_buffer = new_buffer;
+        strm.state.decompress_entropy_size_real = decoded_size;
+    }
+
+    int decoded = lzlib4_entropy_decompress(*src, *src_size, strm.state.decompress_entropy_buffer, decoded_size);
+    if (decoded < 0) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    *src = strm.state.decompress_entropy_buffer;
+    *src_size = decoded;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Process a metadata block stored into the decompression input buffer
+ *
+ * @return int : LZLIB4_RC_OK if the metadata is right, negative number otherwise.
+ */
+int lzlib4::process_marker() {
+    LZLIB4_BLOCK_HEADER &header = strm.state.decompress_header;
+
+    if (header.crc == LZLIB4_MARKER_PERMUTATION) {
+        // A new window can't start while the previous one is being returned
+        if (strm.state.decompress_window_blocks) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        uint32_t blocks = header.compressed_size / sizeof(uint32_t);
+        if (!blocks || blocks > LZLIB4_REORDER_MAX_WINDOW || header.compressed_size % sizeof(uint32_t)) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        std::vector<uint32_t> &slots = strm.state.decompress_window_slots;
+        slots.resize(blocks);
+        memcpy(slots.data(), strm.state.decompress_in_buffer, blocks * sizeof(uint32_t));
+
+        // Check that every slot is used only once
+        strm.state.decompress_window_ready.assign(blocks, false);
+        for (uint32_t i = 0; i < blocks; i++) {
+            if (slots[i] >= blocks || strm.state.decompress_window_ready[slots[i]]) {
+                return LZLIB4_RC_BLOCK_DAMAGED;
+            }
+            strm.state.decompress_window_ready[slots[i]] = true;
+        }
+        strm.state.decompress_window_ready.assign(blocks, false);
+
+        // The slot buffers are kept between windows
+        if (strm.state.decompress_window_buffers.size() < blocks) {
+            strm.state.decompress_window_buffers.resize(blocks, NULL);
+            strm.state.decompress_window_capacity.resize(blocks, 0);
+        }
+        strm.state.decompress_window_sizes.assign(blocks, 0);
+
+        strm.state.decompress_window_blocks = blocks;
+        strm.state.decompress_window_index = 0;
+        strm.state.decompress_window_emit = 0;
+        strm.state.decompress_window_emit_pos = 0;
+
+        // The slots will be overwritten, so the previous block can't be used as dictionary
+        strm.state.decompress_dict = NULL;
+        strm.state.decompress_dict_size = 0;
+        strm.state.decompress_dict_lost = false;
+    }
+    else if (header.crc == LZLIB4_MARKER_SYNC) {
+        if (header.compressed_size != LZLIB4_SYNC_SIZE) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        // The next header is checked with the marker
+        memcpy(&strm.state.decompress_sync_offset, strm.state.decompress_in_buffer, sizeof(uint64_t));
+        memcpy(&strm.state.decompress_sync_check, strm.state.decompress_in_buffer + sizeof(uint64_t), sizeof(uint32_t));
+        strm.state.decompress_sync_pending = true;
+    }
+    else if (header.crc == LZLIB4_MARKER_UNORDERED) {
+        // The blocks can't be returned in order without the index (see lzlib4_reader)
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    // Other metadata blocks (like the index) are not required to decompress the stream
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Copy the reordering window blocks that are already in the original order to the output buffer
+ *
+ */
+void lzlib4::emit_window() {
+    uint32_t &emit = strm.state.decompress_window_emit;
+    size_t &emit_pos = strm.state.decompress_window_emit_pos;
+
+    while (
+        strm.state.decompress_window_blocks &&
+        emit < strm.state.decompress_window_blocks &&
+        strm.state.decompress_window_ready[emit] &&
+        strm.avail_out
+    ) {
+        size_t to_copy = std::min(strm.state.decompress_window_sizes[emit] - emit_pos, strm.avail_out);
+        memcpy(strm.next_out, strm.state.decompress_window_buffers[emit] + emit_pos, to_copy);
+        strm.next_out += to_copy;
+        strm.avail_out -= to_copy;
+        strm.state.decompress_total_out += to_copy;
+        emit_pos += to_copy;
+
+        if (emit_pos == strm.state.decompress_window_sizes[emit]) {
+            emit++;
+            emit_pos = 0;
+        }
+    }
+
+    // All the window blocks were returned
+    if (strm.state.decompress_window_blocks && emit == strm.state.decompress_window_blocks) {
+        strm.state.decompress_window_blocks = 0;
+    }
+}
+
+
+/**
+ * @brief Enable the recovery mode. When a damaged block is found, the decompression continues at the next
+ *        resynchronization marker with a valid header instead of returning LZLIB4_RC_BLOCK_DAMAGED. The linked
+ *        blocks after the damaged one are lost too, until the next independent block or reordering window. The
+ *        lost data is not written to the output, and its position is returned by lzlib4::lost_ranges. The CRC of
+ *        every block is checked in this mode.
+ *
+ *        Only streams written with lzlib4::set_sync_markers can be recovered.
+ *
+ * @param enabled : true to enable the recovery mode
+ * @return int : LZLIB4_RC_OK if the mode was changed, negative number otherwise.
+ */
+int lzlib4::set_recovery_mode(bool enabled) {
+    strm.state.decompress_recovery = enabled;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Uncompressed data lost by the recovery mode, sorted by position
+ *
+ * @return const std::vector<lzlib4_lost_range>&
+ */
+const std::vector<lzlib4_lost_range> & lzlib4::lost_ranges() {
+    return strm.state.decompress_lost;
+}
+
+
+/**
+ * @brief Drop the damaged block and start the search of the next resynchronization marker
+ *
+ */
+void lzlib4::mark_damaged() {
+    if (!strm.state.decompress_lost_open) {
+        lzlib4_lost_range range;
+        range.offset = strm.state.decompress_total_out;
+        strm.state.decompress_lost.push_back(range);
+        strm.state.decompress_lost_open = true;
+    }
+
+    // A damaged header can be the data written before a marker, so the search starts at its second byte
+    strm.state.decompress_resync_carry.clear();
+    if (!strm.partial_block) {
+        strm.state.decompress_resync_carry.assign(
+            strm.state.decompress_header_bytes + 1,
+            strm.state.decompress_header_bytes + sizeof(LZLIB4_BLOCK_HEADER)
+        );
+    }
+
+    // The pending blocks of a reordering window can't be returned without the damaged block
+    strm.partial_block = false;
+    strm.state.decompress_in_index = 0;
+    strm.state.decompress_header_index = 0;
+    strm.state.decompress_window_blocks = 0;
+    strm.state.decompress_sync_pending = false;
+    strm.state.decompress_dict = NULL;
+    strm.state.decompress_dict_size = 0;
+    strm.state.decompress_dict_lost = true;
+    strm.state.decompress_resync = true;
+}
+
+
+/**
+ * @brief Check if there is a valid resynchronization marker followed by its block header
+ *
+ * @param data : Marker position. Must have the size of the marker and the next header.
+ * @param offset : Uncompressed position of the next block
+ * @param check : Marker CRC
+ * @return bool : true if the marker is valid
+ */
+static bool lzlib4_sync_marker_at(const uint8_t * data, uint64_t * offset, uint32_t * check) {
+    LZLIB4_BLOCK_HEADER header;
+    memcpy(&header, data, sizeof(header));
+    if (header.compressed_size != LZLIB4_SYNC_SIZE || header.uncompressed_size || header.crc != LZLIB4_MARKER_SYNC) {
+        return false;
+    }
+
+    uint8_t next_check[sizeof(uint64_t) + sizeof(LZLIB4_BLOCK_HEADER)];
+    memcpy(next_check, data + sizeof(header), sizeof(uint64_t));
+    memcpy(next_check + sizeof(uint64_t), data + sizeof(header) + LZLIB4_SYNC_SIZE, sizeof(LZLIB4_BLOCK_HEADER));
+    memcpy(offset, data + sizeof(header), sizeof(uint64_t));
+    memcpy(check, data + sizeof(header) + sizeof(uint64_t), sizeof(uint32_t));
+
+    return lzlib4::crc32(next_check, sizeof(next_check)) == *check;
+}
+
+
+/**
+ * @brief Search the next resynchronization marker into the input. When it is found, the marker is consumed and
+ *        the next header is stored as already readed, so the decompression continues there.
+ *
+ * @return bool : true if a marker was found. Otherwise all the input was consumed.
+ */
+bool lzlib4::resync() {
+    std::vector<uint8_t> &carry = strm.state.decompress_resync_carry;
+    // The marker header, its data and the next block header
+    const size_t marker_size = sizeof(LZLIB4_BLOCK_HEADER) * 2 + LZLIB4_SYNC_SIZE;
+    const uint8_t first_byte = LZLIB4_SYNC_SIZE;
+    uint64_t offset;
+    uint32_t check;
+    const uint8_t * found = NULL;
+    size_t consumed = 0;
+
+    // Markers which start into the bytes kept from the previous input
+    if (!carry.empty()) {
+        size_t kept = carry.size();
+        size_t taken = std::min(strm.avail_in, marker_size);
+        carry.insert(carry.end(), strm.next_in, strm.next_in + taken);
+
+        for (size_t i = 0; i < kept && !found; i++) {
+            if (carry.size() - i < marker_size) {
+                // The input ends before the marker, so keep it for the next call
+                carry.erase(carry.begin(), carry.begin() + i);
+                strm.next_in += taken;
+                strm.avail_in -= taken;
+                return false;
+            }
+            if (carry[i] == first_byte && lzlib4_sync_marker_at(carry.data() + i, &offset, &check)) {
+                found = carry.data() + i;
+                consumed = i + marker_size - kept;
+            }
+        }
+    }
+
+    // Markers into the input
+    size_t position = 0;
+    while (!found && position + marker_size <= strm.avail_in) {
+        const uint8_t * candidate = (const uint8_t *) memchr(strm.next_in + position, first_byte, strm.avail_in - marker_size + 1 - position);
+        if (!candidate) {
+            position = strm.avail_in - marker_size + 1;
+            break;
+        }
+
+        position = candidate - strm.next_in;
+        if (lzlib4_sync_marker_at(candidate, &offset, &check)) {
+            found = candidate;
+            consumed = position + marker_size;
+        }
+        else {
+            position++;
+        }
+    }
+
+    if (!found) {
+        // The last bytes can be the start of a marker
+        carry.assign(strm.next_in + position, strm.next_in + strm.avail_in);
+        strm.next_in += strm.avail_in;
+        strm.avail_in = 0;
+        return false;
+    }
+
+    strm.state.decompress_sync_offset = offset;
+    strm.state.decompress_sync_check = check;
+    strm.state.decompress_sync_pending = true;
+    memcpy(strm.state.decompress_header_bytes, found + marker_size - sizeof(LZLIB4_BLOCK_HEADER), sizeof(LZLIB4_BLOCK_HEADER));
+    strm.state.decompress_header_index = sizeof(LZLIB4_BLOCK_HEADER);
+    strm.state.decompress_resync = false;
+
+    strm.next_in += consumed;
+    strm.avail_in -= consumed;
+    carry.clear();
+
+    return true;
+}
+
 /**
  * @brief Decompress a part of the stream to fit into the output buffer. Multiple calls to this function
  *        keeping the same block in "strm.next_in" will decompress the next parts of the block.
  *        Ths function requires that the entire block exists in input buffer or will not work.
+ *        The blocks are returned in the order they are stored, so the reordered and unordered streams are
+ *        rejected with LZLIB4_RC_INDEX_ERROR.
  * 
  * @param check_crc Check the block CRC. This will ensure that every block is correct, but will be slower.
  * @param seek_to Seek to a part of the block or -1 to continue at the last position.
@@ -373,17 +2830,52 @@ int lzlib4::decompress_partial(bool reset, bool check_crc, long long seek_to) {
     while (strm.avail_out) {
         // If there is no more data in buffer or reset == true, read more data
         if (!(strm.state.decompress_tmp_size - strm.state.decompress_tmp_index) || reset) {
+            // All the input was used
+            if (!strm.avail_in) {
+                break;
+            }
+
             // Get the header
+            if (strm.avail_in < sizeof(LZLIB4_BLOCK_HEADER)) {
+                return LZLIB4_RC_NEED_MORE_DATA;
+            }
             LZLIB4_BLOCK_HEADER header;
             memcpy(&header, strm.next_in, sizeof(LZLIB4_BLOCK_HEADER));
+            header.compressed_size &= LZLIB4_BLOCK_SIZE_MASK;
+            header.uncompressed_size &= LZLIB4_BLOCK_SIZE_MASK;
+
+            // Skip the metadata blocks. The blocks are returned in the order they are stored, so the unordered
+            // and the reordered streams can't be read (the decompress function must be used instead).
+            if (!header.uncompressed_size && (header.crc == LZLIB4_MARKER_UNORDERED || header.crc == LZLIB4_MARKER_PERMUTATION)) {
+                return LZLIB4_RC_INDEX_ERROR;
+            }
+            if (!header.uncompressed_size && (header.crc == LZLIB4_MARKER_INDEX || header.crc == LZLIB4_MARKER_SYNC)) {
+                if (strm.avail_in < sizeof(header) + header.compressed_size) {
+                    return LZLIB4_RC_NEED_MORE_DATA;
+                }
+                strm.next_in += sizeof(header) + header.compressed_size;
+                strm.avail_in -= sizeof(header) + header.compressed_size;
+                if (!strm.avail_in) {
+                    break;
+                }
+                continue;
+            }
 
             // Check if compressed/uncompressed size is too high (possible corrupted header)
             if (header.compressed_size > LZ4_COMPRESSBOUND(LZLIB4_MAX_BLOCK_SIZE) || header.uncompressed_size > LZLIB4_MAX_BLOCK_SIZE) {
                 return LZLIB4_RC_BLOCK_SIZE_ERROR;
             }
 
+            // The whole block is required, because it is decompressed at once into the tmp buffer
+            if (strm.avail_in < sizeof(header) + header.compressed_size) {
+                return LZLIB4_RC_NEED_MORE_DATA;
+            }
+
             // if new block size is bigger than reserved size, realloc the memory
             if (header.uncompressed_size > strm.state.decompress_tmp_size_real) {
+                if (!memory_available(strm.state.decompress_tmp_size_real, header.uncompressed_size)) {
+                    return LZLIB4_RC_MEMORY_LIMIT;
+                }
                 uint8_t * new_buffer = (uint8_t*) realloc(strm.state.decompress_tmp_buffer, header.uncompressed_size);
                 if (new_buffer) {
                     strm.state.decompress_tmp_buffer = new_buffer;
@@ -415,7 +2907,6 @@ int lzlib4::decompress_partial(bool reset, bool check_crc, long long seek_to) {
             // If block is not complete, a subsequent calls with more data to decompress_partial will fill the buffer
             if (return_code != 0) {
                 // There was an error decompressing the block
-                printf("There was an error decompressing the block: %d\n", return_code);
                 return return_code;
             }
 
@@ -454,6 +2945,27 @@ void lzlib4::close() {
         LZ4_freeStreamDecode(strm.state.strm_lz4_decode);
     }
 
+    if (strm.state.rate_lz4) {
+        LZ4_freeStream(strm.state.rate_lz4);
+        strm.state.rate_lz4 = NULL;
+    }
+
+    // Free the archival mode states and buffers
+    for (uint8_t i = 0; i < LZLIB4_ARCHIVAL_MAX_CANDIDATES; i++) {
+        if (strm.state.archival_lz4[i]) {
+            LZ4_freeStreamHC(strm.state.archival_lz4[i]);
+        }
+        if (strm.state.archival_buffer[i]) {
+            free(strm.state.archival_buffer[i]);
+        }
+    }
+    if (strm.state.archival_check_buffer) {
+        free(strm.state.archival_check_buffer);
+    }
+    if (strm.state.archival_pool) {
+        delete strm.state.archival_pool;
+    }
+
     // Free compression and decompression buffers
     if (strm.state.compress_in_buffer) {
         free(strm.state.compress_in_buffer);
@@ -470,10 +2982,140 @@ void lzlib4::close() {
     if (strm.state.decompress_tmp_buffer) {
         free(strm.state.decompress_tmp_buffer);
     }
+    if (strm.state.decompress_prev_buffer) {
+        free(strm.state.decompress_prev_buffer);
+    }
+    if (strm.state.compress_entropy_buffer) {
+        free(strm.state.compress_entropy_buffer);
+    }
+    if (strm.state.decompress_entropy_buffer) {
+        free(strm.state.decompress_entropy_buffer);
+    }
+
+    // Free the reordering window and packing buffers
+    if (strm.state.reorder_buffer) {
+        free(strm.state.reorder_buffer);
+    }
+    if (strm.state.packing_buffer) {
+        free(strm.state.packing_buffer);
+    }
+    for (size_t i = 0; i < strm.state.decompress_window_buffers.size(); i++) {
+        if (strm.state.decompress_window_buffers[i]) {
+            free(strm.state.decompress_window_buffers[i]);
+        }
+    }
+}
+
+
+/**
+ * @brief Bytes of memory held by the context: the LZ4 states, all the compression and decompression buffers
+ *        (including the ones grown by decompress and decompress_partial) and the internal tables.
+ *
+ * @return size_t : Memory usage in bytes
+ */
+size_t lzlib4::memory_usage() {
+    lzlib4_internal_state &state = strm.state;
+    size_t usage = 0;
+
+    // LZ4 states
+    if (state.strm_lz4) {
+        usage += LZ4_sizeofStateHC();
+    }
+    if (state.strm_lz4_decode) {
+        usage += sizeof(LZ4_streamDecode_t);
+    }
+    if (state.rate_lz4) {
+        usage += sizeof(LZ4_stream_t);
+    }
+
+    // Compression buffers
+    if (state.compress_in_buffer) {
+        usage += state.compress_in_size;
+    }
+    if (state.compress_out_buffer) {
+        usage += state.compress_out_size;
+    }
+    if (state.compress_entropy_buffer) {
+        usage += state.compress_out_size;
+    }
+    if (state.reorder_buffer) {
+        usage += state.reorder_window * state.reorder_slot_size;
+    }
+    if (state.packing_buffer) {
+        usage += state.packing_window * state.compress_in_size;
+    }
+    for (uint8_t i = 0; i < LZLIB4_ARCHIVAL_MAX_CANDIDATES; i++) {
+        if (state.archival_lz4[i]) {
+            usage += LZ4_sizeofStateHC();
+        }
+        if (state.archival_buffer[i]) {
+            usage += state.compress_out_size;
+        }
+    }
+    if (state.archival_check_buffer) {
+        usage += state.compress_in_size;
+    }
+
+    // Decompression buffers. The sizes are the reserved sizes, which only grow.
+    usage += state.decompress_in_size_real;
+    usage += state.decompress_out_size_real;
+    usage += state.decompress_prev_size_real;
+    usage += state.decompress_tmp_size_real;
+    usage += state.decompress_entropy_size_real;
+    for (size_t i = 0; i < state.decompress_window_capacity.size(); i++) {
+        usage += state.decompress_window_capacity[i];
+    }
+
+    // Tables
+    usage += state.index_entries.capacity() * sizeof(LZLIB4_INDEX_ENTRY);
+    usage += state.records.capacity() * sizeof(lzlib4_record_location);
+    usage += state.reorder_sizes.capacity() * sizeof(size_t);
+    usage += state.reorder_fingerprints.capacity() * sizeof(uint32_t);
+    usage += state.packing_pending.capacity() * sizeof(lzlib4_pending_record);
+    usage += state.packing_free_slots.capacity() * sizeof(uint16_t);
+    usage += state.packing_table.capacity() * sizeof(uint16_t);
+    usage += state.decompress_window_slots.capacity() * sizeof(uint32_t);
+    usage += state.decompress_window_buffers.capacity() * sizeof(uint8_t *);
+    usage += state.decompress_window_sizes.capacity() * sizeof(size_t);
+    usage += state.decompress_window_capacity.capacity() * sizeof(size_t);
+    usage += state.decompress_window_ready.capacity() / 8;
+
+    return usage;
+}
+
+
+/**
+ * @brief Limit the memory used by the context. When a buffer would exceed the limit, the function that needs it
+ *        returns LZLIB4_RC_MEMORY_LIMIT instead of allocating it. This protects the decompressor against the damaged
+ *        or hostile headers that ask for blocks up to LZLIB4_MAX_BLOCK_SIZE. The memory already used is not freed.
+ *
+ * @param limit : Maximum memory usage in bytes. 0 to remove the limit.
+ * @return int : LZLIB4_RC_OK
+ */
+int lzlib4::set_memory_limit(size_t limit) {
+    strm.state.memory_limit = limit;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Check if a buffer can grow without exceeding the memory limit
+ *
+ * @param current_size : Current buffer size (0 for a new buffer)
+ * @param new_size : Wanted buffer size
+ * @return bool : true if the buffer can be allocated
+ */
+bool lzlib4::memory_available(size_t current_size, size_t new_size) {
+    if (!strm.state.memory_limit || new_size <= current_size) {
+        return true;
+    }
+
+    return memory_usage() - current_size + new_size <= strm.state.memory_limit;
 }
 
 
-uint32_t lzlib4::crc32(uint8_t *buf, size_t len) {
+uint32_t lzlib4::crc32(const uint8_t *buf, size_t len) {
     register uint32_t oldcrc32;
 
     oldcrc32 = 0xFFFFFFFF;
@@ -29,8 +29,14 @@
  * overhead.
  **/
 
+#ifndef LZLIB4_H
+#define LZLIB4_H
+
 #include <climits>
+#include <vector>
 #include "lz4hc.h"
+#include "lzlib4_entropy.h"
+#include "lzlib4_pool.h"
 
 // Block size of uncompressed data. This size must be able to fit into the LZLIB5_BLOCK_HEADER compressed_size variable,
 // after passing it thought the LZ4_COMPRESSBOUND macro.
@@ -54,6 +60,81 @@ struct LZLIB4_BLOCK_HEADER {
     uint32_t crc = 0;
 };
 
+// The biggest compressed block (LZ4_COMPRESSBOUND(LZLIB4_MAX_BLOCK_SIZE)) fits into 29 bits, so the three upper bits
+// of the header sizes are free and are used to store information about how the block was encoded.
+#define LZLIB4_BLOCK_SIZE_MASK 0x1FFFFFFF
+// compressed_size flags
+#define LZLIB4_BLOCK_FLAG_STORED 0x80000000         // Block data is stored as is, without compression
+#define LZLIB4_BLOCK_FLAG_INDEPENDENT 0x40000000    // Block doesn't use the previous blocks as dictionary
+#define LZLIB4_BLOCK_FLAG_ENTROPY 0x20000000        // LZ4 block data is encoded with the entropy coding stage
+// uncompressed_size upper bits: archival candidate used to encode the block
+#define LZLIB4_BLOCK_CHOICE_SHIFT 29
+
+// Metadata blocks use a block header with uncompressed_size = 0 and a marker into the crc field. The compressed_size
+// field keeps the size of the metadata that follows the header.
+#define LZLIB4_MARKER_PERMUTATION 0x50345A4C    // "LZ4P": Order of the blocks in a reordering window
+#define LZLIB4_MARKER_INDEX 0x49345A4C          // "LZ4I": Stream index
+#define LZLIB4_MARKER_SYNC 0x53345A4C           // "LZ4S": Resynchronization point before a block
+#define LZLIB4_MARKER_UNORDERED 0x55345A4C      // "LZ4U": Blocks stored out of order, only readable using the index
+#define LZLIB4_MARKER_CHANNEL 0x43345A4C        // "LZ4C": Channel of the next blocks of a multiplexed stream
+#define LZLIB4_MARKER_CHANNEL_INDEX 0x4D345A4C  // "LZ4M": Channels index of a multiplexed stream
+
+// Resynchronization marker data: position of the next block into the uncompressed data (8 bytes) and the CRC of that
+// position followed by the next block header (4 bytes). A decoder can search the marker after a damaged block, and
+// the CRC confirms that the marker and the next header are right.
+#define LZLIB4_SYNC_SIZE 12
+
+// Unordered stream marker data: position of the index (8 bytes), or 0 if the stream was not finished. The marker is
+// the first block of the stream, so the sequential decoders can refuse the stream instead of returning the blocks in
+// the wrong order.
+#define LZLIB4_UNORDERED_SIZE 8
+
+// Uncompressed data lost by the recovery mode. A range with size 0 is still open: the data is lost until the end of
+// the stream if no valid block is found.
+struct lzlib4_lost_range {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+// Stream index entry. There is one entry for every block, sorted by its position into the uncompressed data.
+struct LZLIB4_INDEX_ENTRY {
+    uint64_t offset = 0;                // Position of the block header into the compressed stream
+    uint64_t uncompressed_offset = 0;   // Position of the block data into the uncompressed data
+    uint32_t compressed_size = 0;       // Compressed size, including the block flags
+    uint32_t uncompressed_size = 0;
+};
+
+// Record index entry. There is one entry for every record, sorted by record number.
+struct LZLIB4_RECORD_ENTRY {
+    uint64_t block = 0;                 // Block number, in the order of the uncompressed data (index entry)
+    uint32_t offset = 0;                // Position of the record into the uncompressed block
+    uint32_t size = 0;
+};
+
+// The index ends with this trailer, so it is always at the end of the stream and can be located without reading it
+#define LZLIB4_INDEX_MAGIC 0x58444E49           // "INDX"
+struct LZLIB4_INDEX_TRAILER {
+    uint64_t index_offset = 0;          // Position of the index block header into the compressed stream
+    uint64_t records = 0;               // Record index entries. 0 if the record index is not enabled
+    uint32_t entries = 0;
+    uint32_t magic = LZLIB4_INDEX_MAGIC;
+};
+
+// Location of the index into a compressed stream. The entries are read with lzlib4::index_entry and
+// lzlib4::index_record, because they can be unaligned.
+struct lzlib4_index_view {
+    LZLIB4_INDEX_TRAILER trailer;
+    const uint8_t * entries = NULL;
+    const uint8_t * records = NULL;
+};
+
+// Similarity reordering limits
+#define LZLIB4_REORDER_MAX_WINDOW 1024
+#define LZLIB4_REORDER_HASHES 16
+// Space left between the window slots. LZ4 takes adjacent buffers as a single one, so a block written after the
+// slot placed just before it in memory could use more data than the previous block as dictionary.
+#define LZLIB4_REORDER_SLOT_GAP 64
+
 // Compression flush modes, keeping almost all zlib modes.
 // Only two different modes are used:
 // * LZLIB4_NO_FLUSH: Will not flush the data until
@@ -72,7 +153,11 @@ enum lzlib4_return_code {
     LZLIB4_RC_BLOCK_DAMAGED,
     LZLIB4_RC_BUFFER_ERROR,
     LZLIB4_RC_COMPRESSION_ERROR,
-    LZLIB4_RC_NEED_MORE_DATA
+    LZLIB4_RC_NEED_MORE_DATA,
+    LZLIB4_RC_INDEX_ERROR,
+    LZLIB4_RC_LINKED_BLOCK,
+    LZLIB4_RC_MEMORY_LIMIT,
+    LZLIB4_RC_WORK_PENDING
 };
 
 /**
@@ -89,17 +174,273 @@ enum lzlib4_block_mode: uint8_t {
     LZLIB4_INPUT_SPLIT
 };
 
+// Position of a record (the data of a compress call in LZLIB4_INPUT_NOSPLIT mode) into the uncompressed blocks
+struct lzlib4_record_location {
+    uint64_t record = 0;    // Record number, in the order they were passed to compress
+    uint64_t block = 0;     // Block number, in the order of the uncompressed data
+    uint32_t offset = 0;    // Position of the record into the uncompressed block
+    uint32_t size = 0;
+};
+
+// Record waiting to be packed into a block
+struct lzlib4_pending_record {
+    uint64_t record = 0;
+    uint16_t slot = 0;
+    size_t size = 0;
+};
+
+// Best-fit packing limits. The table size is the maximum number of different sizes used to select the records.
+#define LZLIB4_PACKING_MAX_WINDOW 64
+#define LZLIB4_PACKING_TABLE_SIZE 65536
+// Default fill improvement (in percent of the block size) required to store the records out of arrival order. The
+// linked blocks use the previous records as dictionary, so reordering them usually loses more than the fill gains.
+#define LZLIB4_PACKING_MIN_FILL_GAIN 10
+
+/**
+ * @brief Archival mode options.
+ *
+ * In archival mode every block is encoded with all the candidates at once (using worker threads), and the smallest
+ * result is kept. If a decompression speed budget is set, the smallest result that can be decompressed at least at
+ * that speed is kept instead. Blocks are encoded as independent blocks, so they are readable by the standard
+ * decompress functions, and the selected candidate is stored into the block header.
+ *
+ * The favor_decompression_speed option is only available when the program is linked against the static LZ4 library
+ * and LZ4_HC_STATIC_LINKING_ONLY is defined. Otherwise is ignored.
+ *
+ */
+#define LZLIB4_ARCHIVAL_MAX_CANDIDATES 8
+
+struct lzlib4_archival_candidate {
+    int8_t compression_level = LZ4HC_CLEVEL_MAX;
+    bool favor_decompression_speed = false;
+    bool stored = false;
+};
+
+struct lzlib4_archival_options {
+    lzlib4_archival_candidate candidates[LZLIB4_ARCHIVAL_MAX_CANDIDATES];
+    uint8_t candidates_count = 0;
+    // Minimum decompression speed in MB/s of the selected candidate. 0 to select always the smallest one.
+    uint32_t decompression_speed_budget = 0;
+    // Worker threads. 0 to use one thread per candidate.
+    uint8_t threads = 0;
+    // Pin the workers to CPUs. Every candidate is then encoded always by the same worker, and its LZ4 state and
+    // output buffer are allocated from that worker, so they are placed in its NUMA node.
+    lzlib4_pool_options pool_options;
+};
+
+/**
+ * @brief Adaptive block size options.
+ *
+ * The block size starts at the maximum and changes after every full block:
+ *  - Incompressible blocks halve the size, because a bigger block will not compress better and makes the reads slower.
+ *  - Blocks that take more than max_block_latency_us to be compressed reduce the size a 25%.
+ *  - Otherwise the size is doubled while the ratio improves at least min_gain percent. When it doesn't improve, the
+ *    previous size is restored and kept during LZLIB4_ADAPTIVE_HOLD_BLOCKS blocks before trying again.
+ */
+#define LZLIB4_ADAPTIVE_HOLD_BLOCKS 16
+
+struct lzlib4_adaptive_options {
+    size_t min_block_size = 4096;
+    // 0 to use the block size of the constructor, which is also the maximum allowed
+    size_t max_block_size = 0;
+    // Maximum time to compress a block. 0 disables the check.
+    uint32_t max_block_latency_us = 0;
+    // Ratio improvement (in percent of the uncompressed size) required to keep growing the blocks
+    uint8_t min_gain = 1;
+};
+
+/**
+ * @brief Smart split points options.
+ *
+ * When a block is full, the last part of the block (from min_block_size) is checked in chunks of "granularity" bytes
+ * looking for a content transition, and the block is cut there. The data after the cut is the start of the next
+ * block. The transitions, from the strongest:
+ *  - The end of a zero run, which is usually the start of a new file after the padding of the previous one.
+ *  - The start of a zero run.
+ *  - An entropy shift of at least min_entropy_shift bits per byte, like the change from text to compressed data.
+ */
+struct lzlib4_split_options {
+    // 0 to use 3/4 of the block size
+    size_t min_block_size = 0;
+    size_t granularity = 512;
+    double min_entropy_shift = 2.0;
+};
+
+/**
+ * @brief Work budget of every compress call.
+ *
+ * The budget is checked after every block, and when it is exhausted and there is still work to do, compress()
+ * returns LZLIB4_RC_WORK_PENDING. The state is kept, so the caller only has to call compress() again with the same
+ * flush mode (adding more input if wanted) to continue. At least one block is compressed in every call.
+ */
+struct lzlib4_work_budget {
+    // Uncompressed bytes compressed per call. 0 for no limit.
+    size_t max_bytes = 0;
+    // Blocks compressed per call. 0 for no limit.
+    size_t max_blocks = 0;
+    // Time per call. 0 for no limit.
+    uint32_t max_time_us = 0;
+};
+
+/**
+ * @brief Output rate control options.
+ *
+ * The controller moves along a ladder of settings, from the fast LZ4 engine with a high acceleration up to the
+ * maximum HC level (see LZLIB4_RATE_STEPS). After every block the ratio and the compression time per byte of the
+ * current step are averaged, and with the input rate they give the output rate and the CPU share (compression time
+ * divided by wall time). Then:
+ *  - Over the CPU share, the controller moves to a cheaper step.
+ *  - Over the output rate (or always, without an output limit), it moves to a stronger step if its known cost fits
+ *    into the CPU share.
+ *  - Under the output rate with enough margin, it moves to a cheaper step whose known ratio keeps the output rate
+ *    under the limit, which frees CPU.
+ * The estimates of the steps not used in the last LZLIB4_RATE_STALE_BLOCKS blocks are discarded, so a change of data
+ * type doesn't use the ratios of the old data.
+ *
+ * The fast engine blocks and the first block after a change are independent blocks, because the engines can't share
+ * the dictionary.
+ */
+#define LZLIB4_RATE_STEPS 12
+#define LZLIB4_RATE_STALE_BLOCKS 64
+
+struct lzlib4_rate_options {
+    // Maximum output rate in bytes per second. 0 for no limit, so the strongest step inside the CPU share is used.
+    uint64_t max_output_rate = 0;
+    // Maximum share of the wall time spent compressing, from 0 to 1
+    double max_cpu_share = 0.5;
+    // Input rate in bytes per second. 0 to measure it from the time between blocks, which only works when the input
+    // is compressed as it arrives. Data compressed in bulk must set it, or the CPU share will be always near 1.
+    uint64_t input_rate = 0;
+    // Weight of the last block into the averages
+    double smoothing = 0.25;
+    // Fraction of the output rate kept free before moving to a cheaper step
+    double margin = 0.1;
+    // Blocks kept with a step before the next change
+    uint32_t hold_blocks = 4;
+    // Use the fast LZ4 engine steps
+    bool allow_fast = true;
+    int8_t max_compression_level = LZ4HC_CLEVEL_MAX;
+};
+
+// Result of the last block
+struct lzlib4_rate_stats {
+    double input_rate = 0;
+    double output_rate = 0;
+    double cpu_share = 0;
+    // HC level of the current step, or 0 when the fast engine is used
+    int8_t compression_level = 0;
+    // Acceleration of the fast engine, or 0 when HC is used
+    int acceleration = 0;
+    uint64_t changes = 0;
+};
+
+// Averages of a rate control step. Negative when unknown.
+struct lzlib4_rate_estimate {
+    double ratio = -1;
+    double cost = -1;
+    uint64_t block = 0;
+};
+
 // Internal state and buffers
 struct lzlib4_internal_state {
     // Compression buffer
     uint8_t * compress_in_buffer = NULL;
     size_t compress_in_size = 0;
     size_t compress_in_index = 0;
+    // Size of the blocks. Is compress_in_size unless the adaptive block size is enabled.
+    size_t compress_block_size = 0;
     uint8_t * compress_out_buffer = NULL;
     size_t compress_out_size = 0;
 
     lzlib4_block_mode compress_block_mode;
 
+    // Archival mode buffers. Every candidate has its own LZ4HC state and output buffer
+    bool archival_mode = false;
+    lzlib4_archival_options archival_options;
+    LZ4_streamHC_t * archival_lz4[LZLIB4_ARCHIVAL_MAX_CANDIDATES] = {};
+    uint8_t * archival_buffer[LZLIB4_ARCHIVAL_MAX_CANDIDATES] = {};
+    size_t archival_compressed[LZLIB4_ARCHIVAL_MAX_CANDIDATES] = {};
+    uint8_t * archival_check_buffer = NULL;
+    lzlib4_pool * archival_pool = NULL;
+    // Number of blocks encoded with every candidate
+    uint64_t archival_choices[LZLIB4_ARCHIVAL_MAX_CANDIDATES] = {};
+
+    // Similarity reordering window. Blocks are kept here until the window is full
+    uint16_t reorder_window = 0;
+    uint16_t reorder_count = 0;
+    uint8_t * reorder_buffer = NULL;
+    size_t reorder_slot_size = 0;
+    std::vector<size_t> reorder_sizes;
+    std::vector<uint32_t> reorder_fingerprints;
+
+    // Best-fit packing of records. The pending records are stored into slots of compress_in_size bytes
+    uint16_t packing_window = 0;
+    uint8_t packing_min_fill_gain = LZLIB4_PACKING_MIN_FILL_GAIN;
+    uint8_t * packing_buffer = NULL;
+    std::vector<lzlib4_pending_record> packing_pending;
+    std::vector<uint16_t> packing_free_slots;
+    std::vector<uint16_t> packing_table;
+
+    // Adaptive block size. The ratio is the compressed percent of the last full block before a size change.
+    bool adaptive_mode = false;
+    lzlib4_adaptive_options adaptive_options;
+    double adaptive_last_ratio = -1;
+    bool adaptive_growing = false;
+    uint32_t adaptive_hold = 0;
+
+    // Smart split points
+    bool split_mode = false;
+    lzlib4_split_options split_options;
+
+    // Resynchronization markers before every block (or every reordering window)
+    bool sync_markers = false;
+
+    // Work done by every compress call
+    bool work_budget_mode = false;
+    lzlib4_work_budget work_budget;
+
+    // Output rate control. The fast engine state is only allocated when the mode is enabled. The time of the last
+    // block is in seconds of the steady clock, negative before the first block.
+    bool rate_mode = false;
+    lzlib4_rate_options rate_options;
+    LZ4_stream_t * rate_lz4 = NULL;
+    uint8_t rate_step = 0;
+    uint8_t rate_min_step = 0;
+    uint8_t rate_max_step = 0;
+    // Compression level of the constructor, restored when the mode is disabled
+    uint8_t rate_base_level = 0;
+    bool rate_changed = false;
+    uint32_t rate_hold = 0;
+    double rate_input = -1;
+    double rate_last_time = -1;
+    uint64_t rate_blocks = 0;
+    lzlib4_rate_estimate rate_estimates[LZLIB4_RATE_STEPS];
+    lzlib4_rate_stats rate_stats;
+
+    // Blocks without dictionary, and index of the records
+    bool independent_blocks = false;
+    bool record_index = false;
+
+    // Records location
+    bool track_records = false;
+    uint64_t record_count = 0;
+    std::vector<lzlib4_record_location> records;
+    // Blocks closed, in the order of the uncompressed data
+    uint64_t compress_block_count = 0;
+
+    // Entropy coding stage. Minimum saving (in percent of the LZ4 block) to keep the encoded block. 0 to disable it.
+    // The maximum decoding cost is in percent of the plain LZ4 decoding time.
+    uint8_t entropy_min_saving = 0;
+    uint16_t entropy_max_decode_cost = LZLIB4_ENTROPY_MAX_DECODE_COST;
+    uint8_t * compress_entropy_buffer = NULL;
+
+    // Stream index
+    bool index_mode = false;
+    std::vector<LZLIB4_INDEX_ENTRY> index_entries;
+    // Compressed bytes written and uncompressed bytes already stored into blocks
+    uint64_t compress_total_out = 0;
+    uint64_t compress_total_in = 0;
+
     // Decompression buffer
     uint8_t * decompress_in_buffer = NULL;
     size_t decompress_in_size = 0;
@@ -108,6 +449,52 @@ struct lzlib4_internal_state {
     uint8_t * decompress_out_buffer = NULL;
     size_t decompress_out_size = 0;
     size_t decompress_out_size_real = 0;
+    // Header of the block being decompressed and its flags
+    LZLIB4_BLOCK_HEADER decompress_header;
+    uint32_t decompress_flags = 0;
+    // Previous block, used as dictionary by the linked blocks. The output buffers are swapped after every block
+    uint8_t * decompress_prev_buffer = NULL;
+    size_t decompress_prev_size_real = 0;
+    uint8_t * decompress_dict = NULL;
+    size_t decompress_dict_size = 0;
+    // LZ4 data of the blocks which use the entropy coding stage
+    uint8_t * decompress_entropy_buffer = NULL;
+    size_t decompress_entropy_size_real = 0;
+    // Blocks returned by decompress_block without copying them
+    bool decompress_borrow = false;
+    const uint8_t * decompress_borrowed = NULL;
+    size_t decompress_borrowed_size = 0;
+
+    // Reordering window. The blocks are decompressed into its slot and returned in the original order
+    uint32_t decompress_window_blocks = 0;
+    uint32_t decompress_window_index = 0;
+    uint32_t decompress_window_emit = 0;
+    size_t decompress_window_emit_pos = 0;
+    std::vector<uint32_t> decompress_window_slots;
+    std::vector<uint8_t *> decompress_window_buffers;
+    std::vector<size_t> decompress_window_sizes;
+    std::vector<size_t> decompress_window_capacity;
+    std::vector<bool> decompress_window_ready;
+
+    // Block header, which can be readed in chunks
+    uint8_t decompress_header_bytes[sizeof(LZLIB4_BLOCK_HEADER)];
+    size_t decompress_header_index = 0;
+    // Uncompressed bytes returned
+    uint64_t decompress_total_out = 0;
+    // The last resynchronization marker, which is checked with the next header
+    bool decompress_sync_pending = false;
+    uint64_t decompress_sync_offset = 0;
+    uint32_t decompress_sync_check = 0;
+
+    // Recovery mode. After a damaged block the input is searched for the next resynchronization marker, keeping
+    // the bytes of the input end that can be the start of a marker. The linked blocks after the damage are lost too,
+    // because their dictionary was lost.
+    bool decompress_recovery = false;
+    bool decompress_resync = false;
+    bool decompress_dict_lost = false;
+    std::vector<uint8_t> decompress_resync_carry;
+    std::vector<lzlib4_lost_range> decompress_lost;
+    bool decompress_lost_open = false;
 
     // tmp buffer for partial decompression
     uint8_t * decompress_tmp_buffer = NULL;
@@ -115,6 +502,9 @@ struct lzlib4_internal_state {
     size_t decompress_tmp_size_real = 0;
     size_t decompress_tmp_index = 0;
 
+    // Maximum memory used by the context (see lzlib4::memory_usage). 0 means no limit.
+    size_t memory_limit = 0;
+
     // LZ4HC stream status
     LZ4_streamHC_t * strm_lz4 = NULL;
 
@@ -137,56 +527,6 @@ struct lzlib4_stream {
     bool partial_block = false;
 };
 
-#define UPDC32(octet,crc) (crc_32_tab[((crc)\
-     ^ ((uint8_t)octet)) & 0xff] ^ ((crc) >> 8))
-
-
-static uint32_t crc_32_tab[] = { /* CRC polynomial 0xedb88320 */
-0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
-0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
-0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
-};
-
 
 class lzlib4 {
     public:
@@ -194,13 +534,67 @@ class lzlib4 {
         lzlib4(size_t block_size, lzlib4_block_mode block_mode = LZLIB4_INPUT_SPLIT, int8_t compression_level = LZ4HC_CLEVEL_DEFAULT);
         ~lzlib4();
         int compress(lzlib4_flush_mode flush_mode);
+        size_t compress_bound(size_t input_size);
+        int set_archival_mode(const lzlib4_archival_options &options);
+        int set_index_mode(bool enabled);
+        int set_reorder_window(uint16_t window_blocks);
+        int set_entropy_stage(uint8_t min_saving, uint16_t max_decode_cost = LZLIB4_ENTROPY_MAX_DECODE_COST);
+        int set_packing_window(uint16_t window_records, uint8_t min_fill_gain = LZLIB4_PACKING_MIN_FILL_GAIN);
+        int set_adaptive_block_size(bool enabled, const lzlib4_adaptive_options &options = lzlib4_adaptive_options());
+        size_t block_size();
+        int set_split_points(bool enabled, const lzlib4_split_options &options = lzlib4_split_options());
+        int set_sync_markers(bool enabled);
+        int set_work_budget(const lzlib4_work_budget &budget);
+        int set_rate_control(bool enabled, const lzlib4_rate_options &options = lzlib4_rate_options());
+        lzlib4_rate_stats rate_stats();
+        int set_recovery_mode(bool enabled);
+        const std::vector<lzlib4_lost_range> & lost_ranges();
+        const std::vector<lzlib4_record_location> & records();
+        void clear_records();
+        int set_independent_blocks(bool enabled);
+        int set_record_index(bool enabled);
+        int decompress_record(uint64_t record, bool check_crc);
+        static int read_index(const uint8_t * stream, size_t stream_size, lzlib4_index_view &index);
+        static LZLIB4_INDEX_ENTRY index_entry(const lzlib4_index_view &index, uint64_t block);
+        static LZLIB4_RECORD_ENTRY index_record(const lzlib4_index_view &index, uint64_t record);
         int decompress(bool check_crc);
+        int decompress_block(bool check_crc, const uint8_t ** data, size_t * size);
         int decompress_partial(bool reset, bool check_crc, long long seek_to = -1);
         void close();
-        uint32_t crc32(uint8_t *buf, size_t len);
+        static uint32_t crc32(const uint8_t *buf, size_t len);
+        size_t memory_usage();
+        int set_memory_limit(size_t limit);
 
         lzlib4_stream strm;
 
     private:
+        int finish_block(bool allow_split = false);
+        size_t find_split_point();
+        int pack_records(lzlib4_flush_mode flush_mode);
+        int pack_block();
+        void add_record(uint64_t record, uint64_t block, size_t offset, size_t size);
+        int write_block(uint8_t * data, size_t size, uint64_t uncompressed_offset, uint32_t flags);
+        void adapt_block_size(size_t size, size_t compressed, double seconds);
+        void adapt_rate(size_t size, size_t compressed, double seconds);
+        int write_marker(uint32_t marker, const uint8_t * data, size_t size);
+        int write_index();
+        int write_sync_marker(uint64_t uncompressed_offset, const LZLIB4_BLOCK_HEADER &next);
+        static uint32_t sync_check(uint64_t uncompressed_offset, const uint8_t * next);
+        int compress_block_archival(uint8_t * in, size_t in_size, uint8_t ** data, size_t * size, uint32_t * flags, uint8_t * choice);
+        bool entropy_cost_allowed(size_t size, size_t compressed);
+        int queue_block();
+        int flush_window();
+        int decompress_blocks(bool check_crc);
+        void mark_damaged();
+        bool resync();
+        int process_marker();
+        int decode_block(uint8_t * out);
+        int entropy_decode(uint8_t ** src, size_t * src_size, size_t uncompressed_size);
+        void emit_window();
+        bool borrow_window_block(const uint8_t ** data, size_t * size);
+        bool memory_available(size_t current_size, size_t new_size);
+
         uint8_t compression_level = LZ4HC_CLEVEL_DEFAULT;
 };
+
+#endif
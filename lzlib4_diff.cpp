@@ -0,0 +1,272 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_diff.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+
+/**
+ * @brief Add a changed range, joining it with the previous one if they are close enough
+ *
+ * @param changed : Changed ranges
+ * @param offset : Range position
+ * @param size : Range size
+ * @param merge_gap : Maximum distance to join the ranges
+ */
+static void lzlib4_diff_add(std::vector<lzlib4_diff_range> &changed, uint64_t offset, uint64_t size, size_t merge_gap) {
+    if (!size) {
+        return;
+    }
+
+    if (!changed.empty()) {
+        lzlib4_diff_range &last = changed.back();
+        if (offset <= last.offset + last.size + merge_gap) {
+            last.size = std::max(last.offset + last.size, offset + size) - last.offset;
+            return;
+        }
+    }
+
+    lzlib4_diff_range range;
+    range.offset = offset;
+    range.size = size;
+    changed.push_back(range);
+}
+
+
+/**
+ * @brief Decompress a range of both images and add the changed bytes
+ *
+ * @param a : First image
+ * @param b : Second image
+ * @param offset : Range position
+ * @param size : Range size
+ * @param buffer_a : Buffer for the first image
+ * @param buffer_b : Buffer for the second image
+ * @param changed : Changed ranges
+ * @param options : Diff options
+ * @param stats : Diff statistics
+ * @return int : LZLIB4_RC_OK if the range was compared, negative number otherwise.
+ */
+static int lzlib4_diff_compare(
+    const lzlib4_reader &a,
+    const lzlib4_reader &b,
+    uint64_t offset,
+    uint64_t size,
+    uint8_t * buffer_a,
+    uint8_t * buffer_b,
+    std::vector<lzlib4_diff_range> &changed,
+    const lzlib4_diff_options &options,
+    lzlib4_diff_stats &stats
+) {
+    while (size) {
+        size_t chunk = (size_t) std::min(size, (uint64_t) options.buffer_size);
+        int return_code = a.read(offset, buffer_a, chunk, options.check_crc);
+        if (return_code == LZLIB4_RC_OK) {
+            return_code = b.read(offset, buffer_b, chunk, options.check_crc);
+        }
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+        stats.bytes_compared += chunk;
+
+        // The equal parts are skipped a line at a time, and the changes are searched byte by byte
+        size_t position = memcmp(buffer_a, buffer_b, chunk) ? 0 : chunk;
+        while (position < chunk) {
+            while (position + 64 <= chunk && !memcmp(buffer_a + position, buffer_b + position, 64)) {
+                position += 64;
+            }
+            while (position < chunk && buffer_a[position] == buffer_b[position]) {
+                position++;
+            }
+            if (position == chunk) {
+                break;
+            }
+            size_t start = position;
+            while (position < chunk && buffer_a[position] != buffer_b[position]) {
+                position++;
+            }
+            lzlib4_diff_add(changed, offset + start, position - start, options.merge_gap);
+        }
+
+        offset += chunk;
+        size -= chunk;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Compare two images using the block headers, and decompress only the blocks with different metadata.
+ *        The readers are only used to read, so they can be used by other threads at the same time.
+ *
+ * @param a : First image
+ * @param b : Second image
+ * @param changed : Changed ranges, sorted by position. The data after the end of the smaller image is a changed range.
+ * @param options : Diff options
+ * @param stats : Optional diff statistics
+ * @return int : LZLIB4_RC_OK if the images were compared, negative number otherwise.
+ */
+int lzlib4_diff(
+    const lzlib4_reader &a,
+    const lzlib4_reader &b,
+    std::vector<lzlib4_diff_range> &changed,
+    const lzlib4_diff_options &options,
+    lzlib4_diff_stats * stats
+) {
+    changed.clear();
+    lzlib4_diff_stats local_stats;
+    if (!stats) {
+        stats = &local_stats;
+    }
+    *stats = lzlib4_diff_stats();
+
+    if (options.exact && !options.buffer_size) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    uint8_t * buffer_a = NULL;
+    uint8_t * buffer_b = NULL;
+    uint64_t common_size = std::min(a.size(), b.size());
+    size_t blocks_a = a.blocks();
+    size_t blocks_b = b.blocks();
+    size_t i = 0;
+    size_t j = 0;
+    int return_code = LZLIB4_RC_OK;
+
+    while (i < blocks_a && j < blocks_b && return_code == LZLIB4_RC_OK) {
+        lzlib4_reader_block block_a;
+        lzlib4_reader_block block_b;
+        a.block_info(i, block_a);
+        b.block_info(j, block_b);
+
+        // Both blocks start at the same position here
+        uint64_t start = block_a.uncompressed_offset;
+        if (start >= common_size) {
+            break;
+        }
+
+        if (block_a.uncompressed_size == block_b.uncompressed_size && block_a.crc == block_b.crc) {
+            stats->blocks_equal++;
+            i++;
+            j++;
+            continue;
+        }
+
+        // Group of blocks which ends at the next common boundary (or at the end of an image)
+        uint64_t end_a = start + block_a.uncompressed_size;
+        uint64_t end_b = start + block_b.uncompressed_size;
+        size_t group_blocks = 2;
+        i++;
+        j++;
+        while (end_a != end_b) {
+            if (end_a < end_b) {
+                if (i >= blocks_a) {
+                    break;
+                }
+                a.block_info(i++, block_a);
+                end_a += block_a.uncompressed_size;
+            }
+            else {
+                if (j >= blocks_b) {
+                    break;
+                }
+                b.block_info(j++, block_b);
+                end_b += block_b.uncompressed_size;
+            }
+            group_blocks++;
+        }
+        uint64_t end = std::min(std::min(end_a, end_b), common_size);
+
+        if (!options.exact) {
+            lzlib4_diff_add(changed, start, end - start, options.merge_gap);
+            continue;
+        }
+
+        if (!buffer_a) {
+            buffer_a = (uint8_t *) malloc(options.buffer_size);
+            buffer_b = (uint8_t *) malloc(options.buffer_size);
+            if (!buffer_a || !buffer_b) {
+                return_code = LZLIB4_RC_BUFFER_ERROR;
+                break;
+            }
+        }
+
+        stats->blocks_decoded += group_blocks;
+        return_code = lzlib4_diff_compare(a, b, start, end - start, buffer_a, buffer_b, changed, options, *stats);
+    }
+
+    free(buffer_a);
+    free(buffer_b);
+    if (return_code != LZLIB4_RC_OK) {
+        changed.clear();
+        return return_code;
+    }
+
+    // The data which only exists into the bigger image
+    lzlib4_diff_add(changed, common_size, std::max(a.size(), b.size()) - common_size, options.merge_gap);
+
+    for (size_t k = 0; k < changed.size(); k++) {
+        stats->bytes_changed += changed[k].size;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Compare two compressed files (see the reader version). The files are mapped and read with a small cache,
+ *        so the linked blocks are not decompressed more than once.
+ *
+ * @param path_a : First file
+ * @param path_b : Second file
+ * @param changed : Changed ranges, sorted by position
+ * @param options : Diff options
+ * @param stats : Optional diff statistics
+ * @return int : LZLIB4_RC_OK if the files were compared, negative number otherwise.
+ */
+int lzlib4_diff(
+    const char * path_a,
+    const char * path_b,
+    std::vector<lzlib4_diff_range> &changed,
+    const lzlib4_diff_options &options,
+    lzlib4_diff_stats * stats
+) {
+    changed.clear();
+
+    lzlib4_reader a;
+    lzlib4_reader b;
+    int return_code = a.open(path_a);
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = b.open(path_b);
+    }
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = a.set_cache(2);
+    }
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = b.set_cache(2);
+    }
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    return lzlib4_diff(a, b, changed, options, stats);
+}
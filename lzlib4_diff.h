@@ -0,0 +1,80 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Compressed-domain diff of two images.
+ *
+ * Every block header has the size and the CRC of the uncompressed block, so two images can be compared without
+ * decompressing them: the blocks which start at the same position and have the same size and CRC are equal, even if
+ * they were compressed with different options. Only the parts where the metadata differs are decompressed and
+ * compared byte by byte to find the changed ranges.
+ *
+ * The blocks are compared by position, so the metadata only helps where both images have the same block boundaries.
+ * Data inserted or removed in the middle moves all the following blocks, and from there everything is decompressed.
+ * Linked streams should be read with the reader cache enabled (two blocks are enough for the diff), otherwise every
+ * block is decompressed starting from the last independent block.
+ **/
+
+#ifndef LZLIB4_DIFF_H
+#define LZLIB4_DIFF_H
+
+#include "lzlib4_reader.h"
+#include <vector>
+
+// Uncompressed range which is different in the two images
+struct lzlib4_diff_range {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+struct lzlib4_diff_options {
+    // Decompress the blocks with different metadata to find the exact changed bytes. Without it the whole blocks are
+    // reported as changed and nothing is decompressed.
+    bool exact = true;
+    // Check the CRC of the decompressed blocks
+    bool check_crc = false;
+    // Changed ranges closer than this are reported as one range
+    size_t merge_gap = 64;
+    // Bytes compared at once
+    size_t buffer_size = 1 << 20;
+};
+
+struct lzlib4_diff_stats {
+    size_t blocks_equal = 0;            // Blocks skipped because the metadata was equal (counted once per pair)
+    size_t blocks_decoded = 0;          // Blocks decompressed, from both images
+    uint64_t bytes_compared = 0;
+    uint64_t bytes_changed = 0;
+};
+
+int lzlib4_diff(
+    const lzlib4_reader &a,
+    const lzlib4_reader &b,
+    std::vector<lzlib4_diff_range> &changed,
+    const lzlib4_diff_options &options = lzlib4_diff_options(),
+    lzlib4_diff_stats * stats = NULL
+);
+int lzlib4_diff(
+    const char * path_a,
+    const char * path_b,
+    std::vector<lzlib4_diff_range> &changed,
+    const lzlib4_diff_options &options = lzlib4_diff_options(),
+    lzlib4_diff_stats * stats = NULL
+);
+
+#endif
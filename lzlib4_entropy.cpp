@@ -0,0 +1,457 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_entropy.h"
+#include <string.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+// Smaller inputs don't have enough data to pay the code lengths table
+#define LZLIB4_ENTROPY_MIN_SIZE 256
+// Symbols of every stream decoded after a refill (a refill keeps at least 56 bits into the buffer)
+#define LZLIB4_ENTROPY_FAST_SYMBOLS (56 / LZLIB4_ENTROPY_MAX_BITS)
+
+// The fast decoding loop keeps the state of every stream into its own variables
+#if LZLIB4_ENTROPY_STREAMS != 4
+#error "The entropy decoder is written for 4 streams"
+#endif
+
+struct lzlib4_entropy_entry {
+    uint8_t symbol;
+    uint8_t length;
+};
+
+
+/**
+ * @brief Calculate the Huffman code lengths of every symbol. If any code is longer than LZLIB4_ENTROPY_MAX_BITS,
+ *        the frequencies are flattened and the lengths are calculated again.
+ *
+ * @param frequencies : Symbol frequencies
+ * @param lengths : Output code lengths (0 for the unused symbols)
+ */
+static void lzlib4_entropy_lengths(const uint32_t * frequencies, uint8_t * lengths) {
+    uint32_t current[256];
+    memcpy(current, frequencies, sizeof(current));
+
+    while (true) {
+        // Tree nodes: the first 256 are the leaves
+        std::vector<uint64_t> weight;
+        std::vector<int> parent(512, -1);
+        typedef std::pair<uint64_t, int> node;
+        std::priority_queue<node, std::vector<node>, std::greater<node> > queue;
+
+        weight.resize(256);
+        int used = 0;
+        for (int i = 0; i < 256; i++) {
+            weight[i] = current[i];
+            if (current[i]) {
+                queue.push(node(current[i], i));
+                used++;
+            }
+        }
+
+        memset(lengths, 0, 256);
+        if (used == 1) {
+            // A single symbol still needs one bit
+            lengths[queue.top().second] = 1;
+            return;
+        }
+
+        while (queue.size() > 1) {
+            node a = queue.top();
+            queue.pop();
+            node b = queue.top();
+            queue.pop();
+
+            int id = (int) weight.size();
+            weight.push_back(a.first + b.first);
+            parent[a.second] = id;
+            parent[b.second] = id;
+            queue.push(node(a.first + b.first, id));
+        }
+
+        uint8_t max_length = 0;
+        for (int i = 0; i < 256; i++) {
+            if (!current[i]) {
+                continue;
+            }
+
+            uint8_t length = 0;
+            for (int n = i; parent[n] != -1; n = parent[n]) {
+                length++;
+            }
+            lengths[i] = length;
+            max_length = std::max(max_length, length);
+        }
+
+        if (max_length <= LZLIB4_ENTROPY_MAX_BITS) {
+            return;
+        }
+
+        // Too long codes, so reduce the differences between the frequencies
+        for (int i = 0; i < 256; i++) {
+            if (current[i]) {
+                current[i] = (current[i] >> 1) | 1;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Assign the canonical codes from the code lengths. The codes are returned bit reversed, because the streams
+ *        are written and read starting from the lowest bit.
+ *
+ * @param lengths : Code lengths
+ * @param codes : Output bit reversed codes
+ */
+static void lzlib4_entropy_codes(const uint8_t * lengths, uint16_t * codes) {
+    uint16_t count[LZLIB4_ENTROPY_MAX_BITS + 1] = {};
+    uint16_t next[LZLIB4_ENTROPY_MAX_BITS + 2] = {};
+
+    for (int i = 0; i < 256; i++) {
+        count[lengths[i]]++;
+    }
+    count[0] = 0;
+
+    uint16_t code = 0;
+    for (int length = 1; length <= LZLIB4_ENTROPY_MAX_BITS; length++) {
+        code = (code + count[length - 1]) << 1;
+        next[length] = code;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        uint8_t length = lengths[i];
+        if (!length) {
+            codes[i] = 0;
+            continue;
+        }
+
+        // Reverse the 16 bits and keep the "length" upper ones
+        uint32_t value = next[length]++;
+        value = ((value & 0x5555) << 1) | ((value >> 1) & 0x5555);
+        value = ((value & 0x3333) << 2) | ((value >> 2) & 0x3333);
+        value = ((value & 0x0F0F) << 4) | ((value >> 4) & 0x0F0F);
+        value = ((value & 0x00FF) << 8) | ((value >> 8) & 0x00FF);
+        codes[i] = (uint16_t) (value >> (16 - length));
+    }
+}
+
+
+/**
+ * @brief Encode a buffer.
+ *
+ * @param src : Data to encode
+ * @param src_size : Size of the data
+ * @param dst : Output buffer
+ * @param dst_capacity : Output buffer size
+ * @return size_t : Encoded size, or 0 if the encoded data is not smaller than the input or doesn't fit the buffer.
+ */
+size_t lzlib4_entropy_compress(const uint8_t * src, size_t src_size, uint8_t * dst, size_t dst_capacity) {
+    if (src_size < LZLIB4_ENTROPY_MIN_SIZE || src_size > UINT32_MAX || dst_capacity < LZLIB4_ENTROPY_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint32_t frequencies[256] = {};
+    for (size_t i = 0; i < src_size; i++) {
+        frequencies[src[i]]++;
+    }
+
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    lzlib4_entropy_lengths(frequencies, lengths);
+    lzlib4_entropy_codes(lengths, codes);
+
+    // Estimate the size before encoding anything
+    uint64_t total_bits = 0;
+    for (int i = 0; i < 256; i++) {
+        total_bits += (uint64_t) frequencies[i] * lengths[i];
+    }
+    size_t limit = std::min(dst_capacity, src_size);
+    if (LZLIB4_ENTROPY_HEADER_SIZE + total_bits / 8 + LZLIB4_ENTROPY_STREAMS >= limit) {
+        return 0;
+    }
+
+    // Header
+    uint32_t decoded_size = (uint32_t) src_size;
+    memcpy(dst, &decoded_size, sizeof(decoded_size));
+    for (int i = 0; i < 128; i++) {
+        dst[4 + i] = lengths[i * 2] | (lengths[i * 2 + 1] << 4);
+    }
+
+    uint8_t * out = dst + LZLIB4_ENTROPY_HEADER_SIZE;
+    uint8_t * out_end = dst + limit;
+    size_t segment = (src_size + LZLIB4_ENTROPY_STREAMS - 1) / LZLIB4_ENTROPY_STREAMS;
+
+    for (int stream = 0; stream < LZLIB4_ENTROPY_STREAMS; stream++) {
+        size_t start = std::min(src_size, stream * segment);
+        size_t end = std::min(src_size, start + segment);
+        uint8_t * stream_start = out;
+        uint64_t bit_buffer = 0;
+        int bits = 0;
+
+        for (size_t i = start; i < end; i++) {
+            bit_buffer |= (uint64_t) codes[src[i]] << bits;
+            bits += lengths[src[i]];
+
+            // Write the full bytes
+            while (bits >= 8) {
+                if (out >= out_end) {
+                    return 0;
+                }
+                *out++ = (uint8_t) bit_buffer;
+                bit_buffer >>= 8;
+                bits -= 8;
+            }
+        }
+
+        // Last bits, padded with zeroes
+        if (bits) {
+            if (out >= out_end) {
+                return 0;
+            }
+            *out++ = (uint8_t) bit_buffer;
+        }
+
+        if (stream < LZLIB4_ENTROPY_STREAMS - 1) {
+            uint32_t stream_size = (uint32_t) (out - stream_start);
+            memcpy(dst + 4 + 128 + stream * 4, &stream_size, sizeof(stream_size));
+        }
+    }
+
+    return out - dst;
+}
+
+
+/**
+ * @brief Get the decoded size of an encoded buffer
+ *
+ * @param src : Encoded data
+ * @param src_size : Encoded data size
+ * @return size_t : Decoded size or 0 if the data is not valid
+ */
+size_t lzlib4_entropy_decoded_size(const uint8_t * src, size_t src_size) {
+    if (src_size < LZLIB4_ENTROPY_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint32_t decoded_size;
+    memcpy(&decoded_size, src, sizeof(decoded_size));
+    return decoded_size;
+}
+
+
+// Bit reader of one stream
+struct lzlib4_entropy_reader {
+    const uint8_t * pos;
+    const uint8_t * end;
+    uint64_t bit_buffer;
+    int bits;
+};
+
+// Fill the bit buffer with 8 bytes at once. Only used when there are at least 8 bytes left.
+static inline void lzlib4_entropy_refill_fast(lzlib4_entropy_reader &reader) {
+    uint64_t value;
+    memcpy(&value, reader.pos, sizeof(value));
+    reader.bit_buffer |= value << reader.bits;
+    reader.pos += (63 - reader.bits) >> 3;
+    reader.bits |= 56;
+}
+
+// Fill the bit buffer byte by byte
+static inline void lzlib4_entropy_refill(lzlib4_entropy_reader &reader) {
+    while (reader.bits <= 56 && reader.pos < reader.end) {
+        reader.bit_buffer |= (uint64_t) *reader.pos++ << reader.bits;
+        reader.bits += 8;
+    }
+}
+
+
+// Decode a symbol. There must be at least LZLIB4_ENTROPY_MAX_BITS bits in the buffer.
+static inline void lzlib4_entropy_decode(const lzlib4_entropy_entry * table, lzlib4_entropy_reader &reader, uint8_t * &output) {
+    const lzlib4_entropy_entry &entry = table[reader.bit_buffer & ((1 << LZLIB4_ENTROPY_MAX_BITS) - 1)];
+    *output++ = entry.symbol;
+    reader.bit_buffer >>= entry.length;
+    reader.bits -= entry.length;
+}
+
+
+// Iterations of the fast decoding loop that can be done without checking the stream limits. Every iteration reads
+// 8 bytes, advances up to 7 and writes LZLIB4_ENTROPY_FAST_SYMBOLS symbols.
+static inline size_t lzlib4_entropy_iterations(const lzlib4_entropy_reader &reader, const uint8_t * output, const uint8_t * output_end) {
+    size_t input_left = reader.end - reader.pos;
+    if (input_left < 8) {
+        return 0;
+    }
+
+    return std::min((input_left - 8) / 7 + 1, (size_t) (output_end - output) / LZLIB4_ENTROPY_FAST_SYMBOLS);
+}
+
+
+/**
+ * @brief Decode a buffer
+ *
+ * @param src : Encoded data
+ * @param src_size : Encoded data size
+ * @param dst : Output buffer
+ * @param dst_capacity : Output buffer size
+ * @return int : Decoded size or a negative number if the data is not valid.
+ */
+int lzlib4_entropy_decompress(const uint8_t * src, size_t src_size, uint8_t * dst, size_t dst_capacity) {
+    size_t decoded_size = lzlib4_entropy_decoded_size(src, src_size);
+    if (!decoded_size || decoded_size > dst_capacity || decoded_size > INT32_MAX) {
+        return -1;
+    }
+
+    // Read the code lengths and check that they are a valid prefix code
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    uint32_t kraft = 0;
+    for (int i = 0; i < 128; i++) {
+        lengths[i * 2] = src[4 + i] & 0x0F;
+        lengths[i * 2 + 1] = src[4 + i] >> 4;
+    }
+    for (int i = 0; i < 256; i++) {
+        if (lengths[i] > LZLIB4_ENTROPY_MAX_BITS) {
+            return -1;
+        }
+        if (lengths[i]) {
+            kraft += 1 << (LZLIB4_ENTROPY_MAX_BITS - lengths[i]);
+        }
+    }
+    if (!kraft || kraft > (1 << LZLIB4_ENTROPY_MAX_BITS)) {
+        return -1;
+    }
+    lzlib4_entropy_codes(lengths, codes);
+
+    // Decoding table. A complete code fills every entry. Otherwise (only possible with a single symbol) the unused
+    // entries decode the first symbol.
+    lzlib4_entropy_entry table[1 << LZLIB4_ENTROPY_MAX_BITS];
+    if (kraft != (1 << LZLIB4_ENTROPY_MAX_BITS)) {
+        for (int i = 0; i < (1 << LZLIB4_ENTROPY_MAX_BITS); i++) {
+            table[i].symbol = 0;
+            table[i].length = 1;
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        if (!lengths[i]) {
+            continue;
+        }
+        for (uint32_t fill = codes[i]; fill < (1 << LZLIB4_ENTROPY_MAX_BITS); fill += 1 << lengths[i]) {
+            table[fill].symbol = (uint8_t) i;
+            table[fill].length = lengths[i];
+        }
+    }
+
+    // Streams
+    lzlib4_entropy_reader readers[LZLIB4_ENTROPY_STREAMS];
+    const uint8_t * stream_pos = src + LZLIB4_ENTROPY_HEADER_SIZE;
+    const uint8_t * src_end = src + src_size;
+    for (int stream = 0; stream < LZLIB4_ENTROPY_STREAMS; stream++) {
+        size_t stream_size = src_end - stream_pos;
+        if (stream < LZLIB4_ENTROPY_STREAMS - 1) {
+            uint32_t size;
+            memcpy(&size, src + 4 + 128 + stream * 4, sizeof(size));
+            if (size > stream_size) {
+                return -1;
+            }
+            stream_size = size;
+        }
+
+        readers[stream].pos = stream_pos;
+        readers[stream].end = stream_pos + stream_size;
+        readers[stream].bit_buffer = 0;
+        readers[stream].bits = 0;
+        stream_pos += stream_size;
+    }
+
+    size_t segment = (decoded_size + LZLIB4_ENTROPY_STREAMS - 1) / LZLIB4_ENTROPY_STREAMS;
+    uint8_t * outputs[LZLIB4_ENTROPY_STREAMS];
+    uint8_t * outputs_end[LZLIB4_ENTROPY_STREAMS];
+    for (int stream = 0; stream < LZLIB4_ENTROPY_STREAMS; stream++) {
+        size_t start = std::min(decoded_size, stream * segment);
+        outputs[stream] = dst + start;
+        outputs_end[stream] = dst + std::min(decoded_size, start + segment);
+    }
+
+    // Fast loop: after a refill there are enough bits for LZLIB4_ENTROPY_FAST_SYMBOLS symbols. The four streams
+    // are independent, so their decoding can overlap. The stream state is copied into locals, because the output
+    // writes could alias the arrays and the compiler would reload them after every symbol.
+    lzlib4_entropy_reader reader0 = readers[0];
+    lzlib4_entropy_reader reader1 = readers[1];
+    lzlib4_entropy_reader reader2 = readers[2];
+    lzlib4_entropy_reader reader3 = readers[3];
+    uint8_t * output0 = outputs[0];
+    uint8_t * output1 = outputs[1];
+    uint8_t * output2 = outputs[2];
+    uint8_t * output3 = outputs[3];
+    while (true) {
+        size_t iterations = lzlib4_entropy_iterations(reader0, output0, outputs_end[0]);
+        iterations = std::min(iterations, lzlib4_entropy_iterations(reader1, output1, outputs_end[1]));
+        iterations = std::min(iterations, lzlib4_entropy_iterations(reader2, output2, outputs_end[2]));
+        iterations = std::min(iterations, lzlib4_entropy_iterations(reader3, output3, outputs_end[3]));
+        if (!iterations) {
+            break;
+        }
+
+        for (size_t i = 0; i < iterations; i++) {
+            lzlib4_entropy_refill_fast(reader0);
+            lzlib4_entropy_refill_fast(reader1);
+            lzlib4_entropy_refill_fast(reader2);
+            lzlib4_entropy_refill_fast(reader3);
+
+            for (int symbol = 0; symbol < LZLIB4_ENTROPY_FAST_SYMBOLS; symbol++) {
+                lzlib4_entropy_decode(table, reader0, output0);
+                lzlib4_entropy_decode(table, reader1, output1);
+                lzlib4_entropy_decode(table, reader2, output2);
+                lzlib4_entropy_decode(table, reader3, output3);
+            }
+        }
+    }
+    readers[0] = reader0;
+    readers[1] = reader1;
+    readers[2] = reader2;
+    readers[3] = reader3;
+    outputs[0] = output0;
+    outputs[1] = output1;
+    outputs[2] = output2;
+    outputs[3] = output3;
+
+    // End of every stream, checking that the data is not exhausted
+    const uint32_t mask = (1 << LZLIB4_ENTROPY_MAX_BITS) - 1;
+    for (int stream = 0; stream < LZLIB4_ENTROPY_STREAMS; stream++) {
+        lzlib4_entropy_reader &reader = readers[stream];
+        while (outputs[stream] < outputs_end[stream]) {
+            if (reader.bits < LZLIB4_ENTROPY_MAX_BITS) {
+                lzlib4_entropy_refill(reader);
+            }
+
+            const lzlib4_entropy_entry &entry = table[reader.bit_buffer & mask];
+            if (entry.length > reader.bits) {
+                return -1;
+            }
+            *outputs[stream]++ = entry.symbol;
+            reader.bit_buffer >>= entry.length;
+            reader.bits -= entry.length;
+        }
+    }
+
+    return (int) decoded_size;
+}
@@ -0,0 +1,498 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_file_writer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <new>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+lzlib4_file_writer::lzlib4_file_writer() : next_offset(0), error(LZLIB4_RC_OK) {
+}
+
+lzlib4_file_writer::~lzlib4_file_writer() {
+    close();
+}
+
+
+/**
+ * @brief Create the output file and the workers
+ *
+ * @param path : Output file path. It is truncated if exists.
+ * @param options : Writer options
+ * @return int : LZLIB4_RC_OK if the file was created, negative number otherwise.
+ */
+int lzlib4_file_writer::open(const char * path, const lzlib4_file_writer_options &options) {
+    close();
+
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    if (!options.block_size || options.block_size > LZLIB4_MAX_BLOCK_SIZE) {
+        return LZLIB4_RC_BLOCK_SIZE_ERROR;
+    }
+    this->options = options;
+
+    size_t threads = options.threads ? options.threads : std::max(std::thread::hardware_concurrency(), 1u);
+    pool = new (std::nothrow) lzlib4_pool(threads, options.pool_options);
+    // The pinned pools don't run tasks in the calling thread
+    scratch_count = threads + 1;
+    scratch = new (std::nothrow) lzlib4_file_writer_scratch[scratch_count];
+    buffer_size = sizeof(LZLIB4_BLOCK_HEADER) + LZ4_COMPRESSBOUND(options.block_size);
+    if (!pool || !scratch) {
+        close();
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    slots.resize(options.max_in_flight ? options.max_in_flight : std::max(threads * 2, (size_t) 2));
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i].data = (uint8_t *) malloc(options.block_size);
+        if (!slots[i].data) {
+            close();
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        free_slots.push_back(i);
+    }
+
+    file = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        close();
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // The unordered marker goes first. Its index position is written by finish().
+    uint8_t marker[sizeof(LZLIB4_BLOCK_HEADER) + LZLIB4_UNORDERED_SIZE] = {};
+    LZLIB4_BLOCK_HEADER header = {
+        LZLIB4_UNORDERED_SIZE, // compressed_size
+        0, // uncompressed_size
+        LZLIB4_MARKER_UNORDERED // CRC
+    };
+    memcpy(marker, &header, sizeof(header));
+
+    int return_code = write_at(0, marker, sizeof(marker));
+    if (return_code != LZLIB4_RC_OK) {
+        close();
+        return return_code;
+    }
+    next_offset = sizeof(marker);
+    error = LZLIB4_RC_OK;
+
+    // Every task of the job is a worker loop, so the pool keeps compressing blocks until finish()
+    closing = false;
+    dispatcher = std::thread([this]() {
+        pool->run(pool->size(), [this](size_t) {
+            worker_loop();
+        });
+    });
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+/**
+ * @brief Write data into the file at a position
+ *
+ * @param offset : File position
+ * @param data : Data to write
+ * @param size : Data size
+ * @return int : LZLIB4_RC_OK if all the data was written, negative number otherwise.
+ */
+int lzlib4_file_writer::write_at(uint64_t offset, const uint8_t * data, size_t size) {
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    while (size) {
+        ssize_t written = pwrite(file, data, size, offset);
+        if (written <= 0) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+/**
+ * @brief Compress a block and write it at the end of the file. Called by the workers.
+ *
+ * @param data : Block data
+ * @param size : Block size
+ * @param entry : Index entry of the block, where its position and sizes are stored
+ * @return int : LZLIB4_RC_OK if the block was written, negative number otherwise.
+ */
+int lzlib4_file_writer::compress_block(const uint8_t * data, size_t size, LZLIB4_INDEX_ENTRY &entry) {
+    // There is always a free scratch, because there are more than workers
+    lzlib4_file_writer_scratch * current = NULL;
+    for (size_t i = 0; !current; i = (i + 1) % scratch_count) {
+        bool expected = false;
+        if (scratch[i].busy.compare_exchange_strong(expected, true)) {
+            current = &scratch[i];
+        }
+    }
+
+    int return_code = LZLIB4_RC_OK;
+    if (!current->lz4 || !current->buffer) {
+        if (!current->lz4) {
+            current->lz4 = LZ4_createStreamHC();
+        }
+        if (!current->buffer) {
+            current->buffer = (uint8_t *) malloc(buffer_size);
+        }
+        if (!current->lz4 || !current->buffer) {
+            return_code = LZLIB4_RC_BUFFER_ERROR;
+        }
+    }
+
+    if (return_code == LZLIB4_RC_OK) {
+        uint8_t * block_data = current->buffer + sizeof(LZLIB4_BLOCK_HEADER);
+        int compressed;
+        if (options.acceleration > 0) {
+            compressed = LZ4_compress_fast(
+                (const char *) data,
+                (char *) block_data,
+                size,
+                buffer_size - sizeof(LZLIB4_BLOCK_HEADER),
+                options.acceleration
+            );
+        }
+        else {
+            LZ4_resetStreamHC_fast(current->lz4, options.compression_level);
+            compressed = LZ4_compress_HC_continue(
+                current->lz4,
+                (const char *) data,
+                (char *) block_data,
+                size,
+                buffer_size - sizeof(LZLIB4_BLOCK_HEADER)
+            );
+        }
+
+        uint32_t flags = LZLIB4_BLOCK_FLAG_INDEPENDENT;
+        if (compressed <= 0 || (size_t) compressed >= size) {
+            // Incompressible data is stored as is
+            memcpy(block_data, data, size);
+            compressed = size;
+            flags |= LZLIB4_BLOCK_FLAG_STORED;
+        }
+
+        LZLIB4_BLOCK_HEADER header = {
+            (uint32_t) compressed | flags, // compressed_size
+            (uint32_t) size | ((options.acceleration > 0 ? LZLIB4_TIER_FAST : LZLIB4_TIER_HC) << LZLIB4_BLOCK_CHOICE_SHIFT), // uncompressed_size
+            lzlib4::crc32(data, size) // CRC
+        };
+        memcpy(current->buffer, &header, sizeof(header));
+
+        // Take the space and write the block, without waiting for the previous blocks
+        size_t block_size = sizeof(header) + compressed;
+        uint64_t offset = next_offset.fetch_add(block_size);
+        return_code = write_at(offset, current->buffer, block_size);
+
+        entry.offset = offset;
+        entry.compressed_size = header.compressed_size;
+        entry.uncompressed_size = (uint32_t) size;
+    }
+
+    current->busy = false;
+
+    return return_code;
+}
+
+
+/**
+ * @brief Workers loop. Takes the ready blocks until finish() is called and the queue is empty. After an error the
+ *        blocks are only released.
+ *
+ */
+void lzlib4_file_writer::worker_loop() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (true) {
+        queue_ready.wait(lock, [this] { return !ready.empty() || closing; });
+        if (ready.empty()) {
+            return;
+        }
+
+        lzlib4_file_writer_slot &current = slots[ready.front()];
+        ready.pop_front();
+        lock.unlock();
+
+        LZLIB4_INDEX_ENTRY entry;
+        int return_code = error;
+        if (return_code == LZLIB4_RC_OK) {
+            return_code = compress_block(current.data, current.size, entry);
+        }
+
+        lock.lock();
+        if (return_code == LZLIB4_RC_OK) {
+            entries[current.entry].offset = entry.offset;
+            entries[current.entry].compressed_size = entry.compressed_size;
+            entries[current.entry].uncompressed_size = entry.uncompressed_size;
+        }
+        else {
+            set_error(return_code);
+        }
+        current.size = 0;
+        free_slots.push_back(&current - slots.data());
+        slot_free.notify_one();
+    }
+}
+
+
+/**
+ * @brief Keep the first error. The writer stays in error state until it is closed.
+ *
+ * @param return_code : Error
+ */
+void lzlib4_file_writer::set_error(int return_code) {
+    int expected = LZLIB4_RC_OK;
+    if (error.compare_exchange_strong(expected, return_code)) {
+        slot_free.notify_all();
+    }
+}
+
+
+/**
+ * @brief Take a free slot to be filled, waiting for the workers if all of them are in flight
+ *
+ * @return int : LZLIB4_RC_OK if the slot was taken, the writer error otherwise.
+ */
+int lzlib4_file_writer::take_slot() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    slot_free.wait(lock, [this] { return !free_slots.empty() || error != LZLIB4_RC_OK; });
+    if (error != LZLIB4_RC_OK) {
+        return error;
+    }
+
+    filling = &slots[free_slots.back()];
+    free_slots.pop_back();
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Queue the slot being filled. Its index entry is added now, so the entries keep the uncompressed order.
+ *
+ */
+void lzlib4_file_writer::submit_slot() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        LZLIB4_INDEX_ENTRY entry;
+        entry.uncompressed_offset = uncompressed_size;
+        entries.push_back(entry);
+        uncompressed_size += filling->size;
+
+        filling->entry = entries.size() - 1;
+        ready.push_back(filling - slots.data());
+    }
+    queue_ready.notify_one();
+    filling = NULL;
+}
+
+
+/**
+ * @brief Compress data. The full blocks are queued to the workers, and the rest of the data is kept for the next
+ *        call. Only waits when there are max_in_flight blocks queued or being compressed.
+ *
+ * @param data : Data to compress
+ * @param size : Data size
+ * @return int : LZLIB4_RC_OK if the data was queued, negative number otherwise. After an error the writer keeps
+ *               returning it, and the file can't be finished.
+ */
+int lzlib4_file_writer::write(const uint8_t * data, size_t size) {
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    if (error != LZLIB4_RC_OK) {
+        return error;
+    }
+
+    while (size) {
+        if (!filling) {
+            int return_code = take_slot();
+            if (return_code != LZLIB4_RC_OK) {
+                return return_code;
+            }
+        }
+
+        size_t to_copy = std::min(size, options.block_size - filling->size);
+        memcpy(filling->data + filling->size, data, to_copy);
+        filling->size += to_copy;
+        data += to_copy;
+        size -= to_copy;
+
+        if (filling->size == options.block_size) {
+            submit_slot();
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Stop the workers after the queued blocks are done
+ *
+ */
+void lzlib4_file_writer::stop_workers() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        closing = true;
+    }
+    queue_ready.notify_all();
+
+    if (dispatcher.joinable()) {
+        dispatcher.join();
+    }
+}
+
+
+/**
+ * @brief Write the last block, wait for the workers and write the index. The file is closed.
+ *
+ * @return int : LZLIB4_RC_OK if the file was finished, negative number otherwise.
+ */
+int lzlib4_file_writer::finish() {
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    if (filling && filling->size && error == LZLIB4_RC_OK) {
+        submit_slot();
+    }
+    stop_workers();
+
+    // The index goes after the blocks written by the workers
+    int return_code = error;
+    uint64_t index_offset = next_offset;
+    if (return_code == LZLIB4_RC_OK) {
+        std::vector<uint8_t> block;
+        return_code = index_block(entries, index_offset, block);
+        if (return_code == LZLIB4_RC_OK) {
+            return_code = write_at(index_offset, block.data(), block.size());
+            next_offset += block.size();
+        }
+    }
+
+    // The stream is complete once the marker has the index position
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = write_at(sizeof(LZLIB4_BLOCK_HEADER), (const uint8_t *) &index_offset, sizeof(index_offset));
+    }
+
+    close();
+
+    return return_code;
+}
+
+
+/**
+ * @brief Build the index metadata block of an unordered stream. It is the same index written by lzlib4 (without
+ *        records), but it can be placed anywhere after the blocks.
+ *
+ * @param entries : Index entries, sorted by uncompressed position
+ * @param index_offset : Position of the index block into the stream
+ * @param block : Index block, including its header
+ * @return int : LZLIB4_RC_OK if the block was built, negative number otherwise.
+ */
+int lzlib4_file_writer::index_block(const std::vector<LZLIB4_INDEX_ENTRY> &entries, uint64_t index_offset, std::vector<uint8_t> &block) {
+    LZLIB4_INDEX_TRAILER trailer;
+    trailer.index_offset = index_offset;
+    trailer.entries = (uint32_t) entries.size();
+
+    size_t entries_size = entries.size() * sizeof(LZLIB4_INDEX_ENTRY);
+    if (entries_size + sizeof(trailer) > LZLIB4_BLOCK_SIZE_MASK) {
+        return LZLIB4_RC_BLOCK_SIZE_ERROR;
+    }
+
+    block.resize(sizeof(LZLIB4_BLOCK_HEADER) + entries_size + sizeof(trailer));
+    LZLIB4_BLOCK_HEADER header = {
+        (uint32_t) (entries_size + sizeof(trailer)), // compressed_size
+        0, // uncompressed_size
+        LZLIB4_MARKER_INDEX // CRC
+    };
+    memcpy(block.data(), &header, sizeof(header));
+    if (entries_size) {
+        memcpy(block.data() + sizeof(header), entries.data(), entries_size);
+    }
+    memcpy(block.data() + block.size() - sizeof(trailer), &trailer, sizeof(trailer));
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Close the file and free the workers. An unfinished file is kept with the blocks queued before, but it has
+ *        no index.
+ *
+ */
+void lzlib4_file_writer::close() {
+    // The queued blocks are still written
+    stop_workers();
+
+#ifndef _WIN32
+    if (file >= 0) {
+        ::close(file);
+    }
+#endif
+    file = -1;
+
+    delete pool;
+    pool = NULL;
+
+    for (size_t i = 0; i < scratch_count; i++) {
+        if (scratch[i].lz4) {
+            LZ4_freeStreamHC(scratch[i].lz4);
+        }
+        free(scratch[i].buffer);
+    }
+    delete[] scratch;
+    scratch = NULL;
+    scratch_count = 0;
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        free(slots[i].data);
+    }
+    slots.clear();
+    free_slots.clear();
+    ready.clear();
+    filling = NULL;
+
+    uncompressed_size = 0;
+    entries.clear();
+}
+
+
+/**
+ * @brief Bytes written to the file. After finish() it is the final file size.
+ *
+ * @return uint64_t
+ */
+uint64_t lzlib4_file_writer::compressed_size() const {
+    return next_offset;
+}
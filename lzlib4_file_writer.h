@@ -0,0 +1,129 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Parallel file writer with out-of-order block emission.
+ *
+ * write() only copies the data into a queue of blocks, and the blocks are compressed by a worker pool in the
+ * background. Every worker writes its block to the file as soon as it is done: the space is taken with an atomic
+ * append offset and the block is written with pwrite, so there is no queue keeping the finished blocks until the
+ * previous ones are done, and a slow block doesn't stop the other workers nor the caller. write() only waits when
+ * max_in_flight blocks are queued or being compressed, and finish() waits for all of them.
+ *
+ * The blocks are independent (a linked block would need the previous one) and they are stored in the order they
+ * were finished, so the uncompressed position of every block is only into the index written by finish(). The stream
+ * starts with a LZLIB4_MARKER_UNORDERED block, so the sequential decoders refuse it (LZLIB4_RC_INDEX_ERROR), and it
+ * must be read with lzlib4_reader, which follows the index.
+ **/
+
+#ifndef LZLIB4_FILE_WRITER_H
+#define LZLIB4_FILE_WRITER_H
+
+#include "lzlib4.h"
+#include "lzlib4_pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Encoding tier of the blocks, stored into the archival choice bits of the block header (see
+// LZLIB4_BLOCK_CHOICE_SHIFT). The fast blocks are the ones recompressed by lzlib4_recompactor.
+#define LZLIB4_TIER_FAST 0
+#define LZLIB4_TIER_HC 1
+
+struct lzlib4_file_writer_options {
+    size_t block_size = LZLIB4_BLOCK_SIZE;
+    int8_t compression_level = LZ4HC_CLEVEL_DEFAULT;
+    // Use the fast LZ4 compressor with this acceleration instead of LZ4HC. 0 to use LZ4HC. The blocks can be
+    // recompressed later with LZ4HC (see lzlib4_recompactor).
+    int acceleration = 0;
+    // Compression threads. 0 to use one per CPU.
+    size_t threads = 0;
+    // Blocks queued or being compressed. 0 to use two per thread.
+    size_t max_in_flight = 0;
+    lzlib4_pool_options pool_options;
+};
+
+// Compression state of a worker. The blocks are built with the header before the data, so they are written at once.
+struct lzlib4_file_writer_scratch {
+    std::atomic<bool> busy;
+    LZ4_streamHC_t * lz4 = NULL;
+    uint8_t * buffer = NULL;
+
+    lzlib4_file_writer_scratch() : busy(false) {}
+};
+
+// Block waiting to be compressed, and its entry into the index
+struct lzlib4_file_writer_slot {
+    uint8_t * data = NULL;
+    size_t size = 0;
+    size_t entry = 0;
+};
+
+class lzlib4_file_writer {
+    public:
+        lzlib4_file_writer();
+        ~lzlib4_file_writer();
+        int open(const char * path, const lzlib4_file_writer_options &options = lzlib4_file_writer_options());
+        int write(const uint8_t * data, size_t size);
+        int finish();
+        void close();
+        uint64_t compressed_size() const;
+        static int index_block(const std::vector<LZLIB4_INDEX_ENTRY> &entries, uint64_t index_offset, std::vector<uint8_t> &block);
+
+    private:
+        int compress_block(const uint8_t * data, size_t size, LZLIB4_INDEX_ENTRY &entry);
+        int write_at(uint64_t offset, const uint8_t * data, size_t size);
+        void worker_loop();
+        int take_slot();
+        void submit_slot();
+        void stop_workers();
+        void set_error(int return_code);
+
+        int file = -1;
+        lzlib4_file_writer_options options;
+        lzlib4_pool * pool = NULL;
+        lzlib4_file_writer_scratch * scratch = NULL;
+        size_t scratch_count = 0;
+        size_t buffer_size = 0;
+
+        // Next free position of the file, taken by the workers when a block is done
+        std::atomic<uint64_t> next_offset;
+        std::atomic<int> error;
+
+        // Blocks queue. The caller fills the "filling" slot, and the full slots wait into "ready" until a worker
+        // takes them. The entries are completed by the workers, so they are only accessed with the mutex.
+        std::vector<lzlib4_file_writer_slot> slots;
+        std::vector<size_t> free_slots;
+        std::deque<size_t> ready;
+        lzlib4_file_writer_slot * filling = NULL;
+        std::mutex queue_mutex;
+        std::condition_variable queue_ready;
+        std::condition_variable slot_free;
+        bool closing = false;
+        // Thread that keeps the pool running the workers loop until finish()
+        std::thread dispatcher;
+
+        uint64_t uncompressed_size = 0;
+        std::vector<LZLIB4_INDEX_ENTRY> entries;
+};
+
+#endif
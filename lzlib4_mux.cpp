@@ -0,0 +1,717 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_mux.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+#ifdef _WIN32
+#include <stdio.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+lzlib4_mux_writer::lzlib4_mux_writer() {
+}
+
+lzlib4_mux_writer::~lzlib4_mux_writer() {
+    close();
+}
+
+
+/**
+ * @brief Create a multiplexed file
+ *
+ * @param path : File path. It is truncated if exists.
+ * @param options : Writer options
+ * @return int : LZLIB4_RC_OK if the file was created, negative number otherwise.
+ */
+int lzlib4_mux_writer::open(const char * path, const lzlib4_mux_options &options) {
+    close();
+
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    if (!options.block_size || options.block_size > LZLIB4_MAX_BLOCK_SIZE) {
+        return LZLIB4_RC_BLOCK_SIZE_ERROR;
+    }
+    this->options = options;
+
+    file = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // The marker points to the last checkpoint, so it starts without one
+    uint8_t marker[sizeof(LZLIB4_BLOCK_HEADER) + LZLIB4_UNORDERED_SIZE] = {};
+    LZLIB4_BLOCK_HEADER header = {
+        LZLIB4_UNORDERED_SIZE, // compressed_size
+        0, // uncompressed_size
+        LZLIB4_MARKER_UNORDERED // CRC
+    };
+    memcpy(marker, &header, sizeof(header));
+
+    int return_code = append(marker, sizeof(marker));
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = flush_output();
+    }
+    if (return_code != LZLIB4_RC_OK) {
+        ::close(file);
+        file = -1;
+    }
+
+    return return_code;
+#endif
+}
+
+
+/**
+ * @brief Stream of a channel, created the first time the channel is used
+ *
+ * @param channel : Channel id
+ * @return lzlib4* : Channel stream, or NULL if it can't be created
+ */
+lzlib4 * lzlib4_mux_writer::channel_stream(uint32_t channel) {
+    std::unordered_map<uint32_t, lzlib4 *>::iterator found = channels.find(channel);
+    if (found != channels.end()) {
+        return found->second;
+    }
+
+    lzlib4 * stream = new (std::nothrow) lzlib4(options.block_size, LZLIB4_INPUT_SPLIT, options.compression_level);
+    if (!stream) {
+        return NULL;
+    }
+    stream->set_independent_blocks(options.independent_blocks);
+
+    channels[channel] = stream;
+    channel_sizes[channel] = 0;
+
+    return stream;
+}
+
+
+/**
+ * @brief Compress the pending input of a channel and append the generated blocks to the file
+ *
+ * @param channel : Channel id
+ * @param stream : Channel stream, with the input already set
+ * @param flush_mode : Flush mode of the compress call
+ * @return int : LZLIB4_RC_OK if the blocks were added, negative number otherwise.
+ */
+int lzlib4_mux_writer::run_channel(uint32_t channel, lzlib4 * stream, lzlib4_flush_mode flush_mode) {
+    channel_output.resize(std::max(channel_output.size(), stream->compress_bound(stream->strm.avail_in)));
+    stream->strm.next_out = channel_output.data();
+    stream->strm.avail_out = channel_output.size();
+
+    int return_code = stream->compress(flush_mode);
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    // The channel stream only generates data blocks, which are moved to the file one by one
+    size_t produced = stream->strm.next_out - channel_output.data();
+    size_t position = 0;
+    while (position + sizeof(LZLIB4_BLOCK_HEADER) <= produced) {
+        LZLIB4_BLOCK_HEADER header;
+        memcpy(&header, channel_output.data() + position, sizeof(header));
+        size_t block_size = sizeof(header) + (header.compressed_size & LZLIB4_BLOCK_SIZE_MASK);
+        if (position + block_size > produced || !(header.uncompressed_size & LZLIB4_BLOCK_SIZE_MASK)) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+
+        if (current_channel != channel) {
+            uint8_t marker[sizeof(LZLIB4_BLOCK_HEADER) + sizeof(uint32_t)];
+            LZLIB4_BLOCK_HEADER marker_header = {
+                sizeof(uint32_t), // compressed_size
+                0, // uncompressed_size
+                LZLIB4_MARKER_CHANNEL // CRC
+            };
+            memcpy(marker, &marker_header, sizeof(marker_header));
+            memcpy(marker + sizeof(marker_header), &channel, sizeof(channel));
+            return_code = append(marker, sizeof(marker));
+            if (return_code != LZLIB4_RC_OK) {
+                return return_code;
+            }
+            current_channel = channel;
+        }
+
+        LZLIB4_MUX_ENTRY entry;
+        entry.offset = output_offset + output.size();
+        entry.uncompressed_offset = channel_sizes[channel];
+        entry.channel = channel;
+        entry.compressed_size = header.compressed_size;
+        entry.uncompressed_size = header.uncompressed_size & LZLIB4_BLOCK_SIZE_MASK;
+
+        return_code = append(channel_output.data() + position, block_size);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+        channel_sizes[channel] += entry.uncompressed_size;
+        entries.push_back(entry);
+        position += block_size;
+
+        if (options.index_interval && entries.size() >= options.index_interval) {
+            return_code = write_checkpoint();
+            if (return_code != LZLIB4_RC_OK) {
+                return return_code;
+            }
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Add data to a channel. The data is compressed when a block of the channel is full.
+ *
+ * @param channel : Channel id
+ * @param data : Data to add
+ * @param size : Data size
+ * @return int : LZLIB4_RC_OK if the data was added, negative number otherwise.
+ */
+int lzlib4_mux_writer::write(uint32_t channel, const uint8_t * data, size_t size) {
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    lzlib4 * stream = channel_stream(channel);
+    if (!stream) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // Big inputs are added in parts, to keep the channel output buffer small
+    size_t part_size = options.block_size * 16;
+    while (size) {
+        size_t part = std::min(size, part_size);
+        stream->strm.next_in = (uint8_t *) data;
+        stream->strm.avail_in = part;
+
+        int return_code = run_channel(channel, stream, LZLIB4_NO_FLUSH);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+        data += part;
+        size -= part;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Compress the data pending in all the channels and write a checkpoint, so all the data written until now
+ *        can be read
+ *
+ * @return int : LZLIB4_RC_OK if everything was written, negative number otherwise.
+ */
+int lzlib4_mux_writer::flush() {
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // In channel order, so the same input always generates the same file
+    std::vector<uint32_t> ids;
+    for (std::unordered_map<uint32_t, lzlib4 *>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        ids.push_back(it->first);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        lzlib4 * stream = channels[ids[i]];
+        stream->strm.next_in = NULL;
+        stream->strm.avail_in = 0;
+        int return_code = run_channel(ids[i], stream, LZLIB4_SYNC_FLUSH);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+    }
+
+    return write_checkpoint();
+}
+
+
+/**
+ * @brief Add data to the output buffer, writing it to the file when it is full
+ *
+ * @param data : Data to add
+ * @param size : Data size
+ * @return int : LZLIB4_RC_OK if the data was added, negative number otherwise.
+ */
+int lzlib4_mux_writer::append(const uint8_t * data, size_t size) {
+    output.insert(output.end(), data, data + size);
+    if (output.size() >= LZLIB4_MUX_WRITE_BUFFER) {
+        return flush_output();
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+int lzlib4_mux_writer::flush_output() {
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    size_t written = 0;
+    while (written < output.size()) {
+        ssize_t result = ::write(file, output.data() + written, output.size() - written);
+        if (result <= 0) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        written += result;
+    }
+
+    output_offset += output.size();
+    output.clear();
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+/**
+ * @brief Write the index of the blocks added since the last checkpoint and point the file marker to it
+ *
+ * @return int : LZLIB4_RC_OK if the checkpoint was written, negative number otherwise.
+ */
+int lzlib4_mux_writer::write_checkpoint() {
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    if (entries.empty()) {
+        return flush_output();
+    }
+
+    LZLIB4_MUX_TRAILER trailer;
+    trailer.index_offset = output_offset + output.size();
+    trailer.previous_index = last_index;
+    trailer.entries = (uint32_t) entries.size();
+
+    size_t entries_size = entries.size() * sizeof(LZLIB4_MUX_ENTRY);
+    std::vector<uint8_t> data(sizeof(LZLIB4_BLOCK_HEADER) + entries_size + sizeof(trailer));
+    LZLIB4_BLOCK_HEADER header = {
+        (uint32_t) (entries_size + sizeof(trailer)), // compressed_size
+        0, // uncompressed_size
+        LZLIB4_MARKER_CHANNEL_INDEX // CRC
+    };
+    memcpy(data.data(), &header, sizeof(header));
+    memcpy(data.data() + sizeof(header), entries.data(), entries_size);
+    memcpy(data.data() + data.size() - sizeof(trailer), &trailer, sizeof(trailer));
+
+    int return_code = append(data.data(), data.size());
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = flush_output();
+    }
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    // The checkpoint is on the file before it is referenced
+    if (pwrite(file, &trailer.index_offset, sizeof(uint64_t), sizeof(LZLIB4_BLOCK_HEADER)) != sizeof(uint64_t)) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    last_index = trailer.index_offset;
+    entries.clear();
+    // The blocks after a checkpoint always start with a channel marker
+    current_channel = -1;
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+void lzlib4_mux_writer::free_channels() {
+    for (std::unordered_map<uint32_t, lzlib4 *>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        delete it->second;
+    }
+    channels.clear();
+    channel_sizes.clear();
+}
+
+
+/**
+ * @brief Finish all the channels, write the last checkpoint and close the file
+ *
+ * @return int : LZLIB4_RC_OK if the file was finished, negative number otherwise.
+ */
+int lzlib4_mux_writer::close() {
+    if (file < 0) {
+        return LZLIB4_RC_OK;
+    }
+
+    int return_code = flush();
+
+#ifndef _WIN32
+    ::close(file);
+#endif
+    file = -1;
+
+    free_channels();
+    channel_output.clear();
+    output.clear();
+    output_offset = 0;
+    current_channel = -1;
+    entries.clear();
+    last_index = 0;
+
+    return return_code;
+}
+
+
+lzlib4_mux_reader::lzlib4_mux_reader() {
+}
+
+lzlib4_mux_reader::~lzlib4_mux_reader() {
+    close();
+}
+
+
+/**
+ * @brief Open a multiplexed file. A file which is being written can be opened too, and the blocks written after
+ *        the open are not seen until it is opened again.
+ *
+ * @param path : File path
+ * @return int : LZLIB4_RC_OK if the file was opened, LZLIB4_RC_INDEX_ERROR if it is not a multiplexed file, or
+ *               other negative number.
+ */
+int lzlib4_mux_reader::open(const char * path) {
+    close();
+
+#ifdef _WIN32
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t * data = (uint8_t*) malloc(file_size > 0 ? file_size : 1);
+    if (!data || fread(data, 1, file_size, file) != (size_t) file_size) {
+        free(data);
+        fclose(file);
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    fclose(file);
+#else
+    int file = ::open(path, O_RDONLY);
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    struct stat file_stat;
+    if (fstat(file, &file_stat) || file_stat.st_size <= 0) {
+        ::close(file);
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    size_t file_size = file_stat.st_size;
+    void * data = mmap(NULL, file_size, PROT_READ, MAP_SHARED, file, 0);
+    ::close(file);
+    if (data == MAP_FAILED) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+#endif
+
+    mapping = data;
+    stream = (const uint8_t *) data;
+    stream_size = file_size;
+
+    LZLIB4_BLOCK_HEADER header;
+    uint64_t position = 0;
+    if (stream_size < sizeof(header) + LZLIB4_UNORDERED_SIZE) {
+        close();
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+    memcpy(&header, stream, sizeof(header));
+    memcpy(&position, stream + sizeof(header), sizeof(position));
+    if (header.crc != LZLIB4_MARKER_UNORDERED || header.uncompressed_size || header.compressed_size != LZLIB4_UNORDERED_SIZE) {
+        close();
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    // The checkpoints, and then the blocks written after the last one
+    uint64_t scan_from = sizeof(header) + LZLIB4_UNORDERED_SIZE;
+    int return_code = LZLIB4_RC_OK;
+    if (position) {
+        return_code = load_checkpoints(position, &scan_from);
+    }
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = scan_blocks(scan_from);
+    }
+    if (return_code != LZLIB4_RC_OK) {
+        close();
+    }
+
+    return return_code;
+}
+
+
+void lzlib4_mux_reader::close() {
+    if (mapping) {
+#ifdef _WIN32
+        free(mapping);
+#else
+        munmap(mapping, stream_size);
+#endif
+        mapping = NULL;
+    }
+
+    stream = NULL;
+    stream_size = 0;
+    table.clear();
+}
+
+
+/**
+ * @brief Add a block to its channel table. The blocks must be added in order.
+ *
+ * @param entry : Block entry
+ */
+void lzlib4_mux_reader::add_entry(const LZLIB4_MUX_ENTRY &entry) {
+    table[entry.channel].push_back(entry);
+}
+
+
+/**
+ * @brief Read the index checkpoints, from the last one to the first one
+ *
+ * @param position : Position of the last checkpoint
+ * @param scan_from : Position after the last checkpoint
+ * @return int : LZLIB4_RC_OK if the checkpoints were read, negative number otherwise.
+ */
+int lzlib4_mux_reader::load_checkpoints(uint64_t position, uint64_t * scan_from) {
+    std::vector<LZLIB4_MUX_TRAILER> checkpoints;
+
+    while (position) {
+        LZLIB4_BLOCK_HEADER header;
+        if (position + sizeof(header) > stream_size) {
+            return LZLIB4_RC_INDEX_ERROR;
+        }
+        memcpy(&header, stream + position, sizeof(header));
+        uint64_t end = position + sizeof(header) + header.compressed_size;
+        if (
+            header.crc != LZLIB4_MARKER_CHANNEL_INDEX ||
+            header.uncompressed_size ||
+            header.compressed_size < sizeof(LZLIB4_MUX_TRAILER) ||
+            end > stream_size
+        ) {
+            return LZLIB4_RC_INDEX_ERROR;
+        }
+
+        LZLIB4_MUX_TRAILER trailer;
+        memcpy(&trailer, stream + end - sizeof(trailer), sizeof(trailer));
+        if (
+            trailer.magic != LZLIB4_MUX_MAGIC ||
+            trailer.index_offset != position ||
+            trailer.previous_index >= position ||
+            sizeof(trailer) + (uint64_t) trailer.entries * sizeof(LZLIB4_MUX_ENTRY) != header.compressed_size
+        ) {
+            return LZLIB4_RC_INDEX_ERROR;
+        }
+
+        if (checkpoints.empty()) {
+            *scan_from = end;
+        }
+        checkpoints.push_back(trailer);
+        position = trailer.previous_index;
+    }
+
+    // The entries are added from the first checkpoint, so every channel gets its blocks in order
+    for (size_t i = checkpoints.size(); i > 0; i--) {
+        const uint8_t * entries = stream + checkpoints[i - 1].index_offset + sizeof(LZLIB4_BLOCK_HEADER);
+        for (uint32_t e = 0; e < checkpoints[i - 1].entries; e++) {
+            LZLIB4_MUX_ENTRY entry;
+            memcpy(&entry, entries + e * sizeof(entry), sizeof(entry));
+
+            std::vector<LZLIB4_MUX_ENTRY> &blocks = table[entry.channel];
+            uint64_t expected = blocks.empty() ? 0 : blocks.back().uncompressed_offset + blocks.back().uncompressed_size;
+            if (
+                entry.uncompressed_offset != expected ||
+                !entry.uncompressed_size ||
+                entry.offset + sizeof(LZLIB4_BLOCK_HEADER) + (entry.compressed_size & LZLIB4_BLOCK_SIZE_MASK) > checkpoints[i - 1].index_offset
+            ) {
+                return LZLIB4_RC_BLOCK_DAMAGED;
+            }
+            add_entry(entry);
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Read the block headers from a position to the end of the file. An incomplete block at the end (which is
+ *        still being written) is ignored.
+ *
+ * @param position : Position of the first header
+ * @return int : LZLIB4_RC_OK if the blocks were added, negative number otherwise.
+ */
+int lzlib4_mux_reader::scan_blocks(uint64_t position) {
+    int64_t channel = -1;
+
+    while (position + sizeof(LZLIB4_BLOCK_HEADER) <= stream_size) {
+        LZLIB4_BLOCK_HEADER header;
+        memcpy(&header, stream + position, sizeof(header));
+        uint32_t compressed_size = header.compressed_size & LZLIB4_BLOCK_SIZE_MASK;
+        uint32_t block_size = header.uncompressed_size & LZLIB4_BLOCK_SIZE_MASK;
+        if (!compressed_size) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+        if (position + sizeof(header) + compressed_size > stream_size) {
+            break;
+        }
+
+        if (!block_size) {
+            if (header.crc == LZLIB4_MARKER_CHANNEL && compressed_size == sizeof(uint32_t)) {
+                uint32_t id;
+                memcpy(&id, stream + position + sizeof(header), sizeof(id));
+                channel = id;
+            }
+            else if (header.crc == LZLIB4_MARKER_CHANNEL_INDEX) {
+                // A checkpoint written after the open, its blocks were already added
+                channel = -1;
+            }
+            else {
+                return LZLIB4_RC_BLOCK_DAMAGED;
+            }
+        }
+        else {
+            if (channel < 0 || block_size > LZLIB4_MAX_BLOCK_SIZE) {
+                return LZLIB4_RC_BLOCK_DAMAGED;
+            }
+
+            std::vector<LZLIB4_MUX_ENTRY> &blocks = table[(uint32_t) channel];
+            LZLIB4_MUX_ENTRY entry;
+            entry.offset = position;
+            entry.uncompressed_offset = blocks.empty() ? 0 : blocks.back().uncompressed_offset + blocks.back().uncompressed_size;
+            entry.channel = (uint32_t) channel;
+            entry.compressed_size = header.compressed_size;
+            entry.uncompressed_size = block_size;
+            add_entry(entry);
+        }
+
+        position += sizeof(header) + compressed_size;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Channels of the file, sorted by id
+ *
+ * @return std::vector<uint32_t>
+ */
+std::vector<uint32_t> lzlib4_mux_reader::channels() const {
+    std::vector<uint32_t> ids;
+    for (std::unordered_map<uint32_t, std::vector<LZLIB4_MUX_ENTRY>>::const_iterator it = table.begin(); it != table.end(); ++it) {
+        ids.push_back(it->first);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    return ids;
+}
+
+
+/**
+ * @brief Uncompressed size of a channel
+ *
+ * @param channel : Channel id
+ * @return uint64_t : Channel size, 0 if the channel doesn't exist
+ */
+uint64_t lzlib4_mux_reader::channel_size(uint32_t channel) const {
+    std::unordered_map<uint32_t, std::vector<LZLIB4_MUX_ENTRY>>::const_iterator found = table.find(channel);
+    if (found == table.end() || found->second.empty()) {
+        return 0;
+    }
+
+    return found->second.back().uncompressed_offset + found->second.back().uncompressed_size;
+}
+
+
+/**
+ * @brief Read a part of a channel. Only the blocks of the channel are read: linked blocks are decompressed from the
+ *        last independent block (or the start of the channel). Can be called from any number of threads.
+ *
+ * @param channel : Channel id
+ * @param offset : Position into the channel data
+ * @param out : Output buffer
+ * @param size : Bytes to read
+ * @param check_crc : Check the CRC of the decompressed blocks
+ * @return int : LZLIB4_RC_OK if all the data was read, negative number otherwise.
+ */
+int lzlib4_mux_reader::read(uint32_t channel, uint64_t offset, uint8_t * out, size_t size, bool check_crc) const {
+    std::unordered_map<uint32_t, std::vector<LZLIB4_MUX_ENTRY>>::const_iterator found = table.find(channel);
+    uint64_t total = channel_size(channel);
+    if (found == table.end() || offset > total || size > total - offset) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+    if (!size) {
+        return LZLIB4_RC_OK;
+    }
+
+    const std::vector<LZLIB4_MUX_ENTRY> &blocks = found->second;
+    size_t first = std::upper_bound(blocks.begin(), blocks.end(), offset, [](uint64_t value, const LZLIB4_MUX_ENTRY &entry) {
+        return value < entry.uncompressed_offset;
+    }) - blocks.begin() - 1;
+    size_t start = first;
+    while (start > 0 && !(blocks[start].compressed_size & (LZLIB4_BLOCK_FLAG_INDEPENDENT | LZLIB4_BLOCK_FLAG_STORED))) {
+        start--;
+    }
+
+    // The channel blocks are a lzlib4 stream, so they are decompressed with a stream of its own
+    lzlib4 decompressor;
+    std::vector<uint8_t> block;
+    uint64_t end = offset + size;
+    for (size_t i = start; i < blocks.size() && blocks[i].uncompressed_offset < end; i++) {
+        const LZLIB4_MUX_ENTRY &entry = blocks[i];
+        block.resize(std::max(block.size(), (size_t) entry.uncompressed_size));
+
+        decompressor.strm.next_in = (uint8_t *) stream + entry.offset;
+        decompressor.strm.avail_in = sizeof(LZLIB4_BLOCK_HEADER) + (entry.compressed_size & LZLIB4_BLOCK_SIZE_MASK);
+        decompressor.strm.next_out = block.data();
+        decompressor.strm.avail_out = block.size();
+        int return_code = decompressor.decompress(check_crc);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+        if (block.size() - decompressor.strm.avail_out != entry.uncompressed_size) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        // Part of the block inside the requested range
+        uint64_t from = std::max(offset, entry.uncompressed_offset);
+        uint64_t to = std::min(end, entry.uncompressed_offset + entry.uncompressed_size);
+        if (from < to) {
+            memcpy(out + (from - offset), block.data() + (from - entry.uncompressed_offset), to - from);
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
@@ -0,0 +1,136 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Multiplexed stream container.
+ *
+ * Many logical channels (like the telemetry of several devices) are written into a single append-only file. Every
+ * channel is compressed by its own lzlib4 stream, so it keeps its own linked history, and its blocks are interleaved
+ * with the blocks of the other channels as they are done. A LZLIB4_MARKER_CHANNEL block is written before the blocks
+ * of a channel when the channel changes.
+ *
+ * The writer adds an index checkpoint every index_interval blocks: a LZLIB4_MARKER_CHANNEL_INDEX block with the
+ * location of the blocks written since the previous checkpoint, which points to that previous checkpoint. The
+ * position of the last checkpoint is stored into the LZLIB4_MARKER_UNORDERED block at the start of the file (which
+ * also makes the sequential decoders refuse the file). The reader follows the checkpoints and reads the headers
+ * written after the last one, so a file which is still being written (or was not closed) can be read too.
+ *
+ * File format:
+ *   LZLIB4_MARKER_UNORDERED block (position of the last index checkpoint, 0 if there is none)
+ *   LZLIB4_MARKER_CHANNEL block (uint32_t channel) followed by blocks of that channel
+ *   ...
+ *   LZLIB4_MARKER_CHANNEL_INDEX block (LZLIB4_MUX_ENTRY entries followed by a LZLIB4_MUX_TRAILER)
+ *   ...
+ **/
+
+#ifndef LZLIB4_MUX_H
+#define LZLIB4_MUX_H
+
+#include "lzlib4.h"
+#include <unordered_map>
+#include <vector>
+
+#define LZLIB4_MUX_MAGIC 0x4958554D             // "MUXI"
+// Buffered output written to the file at once
+#define LZLIB4_MUX_WRITE_BUFFER (1 << 20)
+
+// Index entry of a block
+struct LZLIB4_MUX_ENTRY {
+    uint64_t offset = 0;                // Position of the block header into the file
+    uint64_t uncompressed_offset = 0;   // Position of the block data into the channel data
+    uint32_t channel = 0;
+    uint32_t compressed_size = 0;       // Compressed size, including the block flags
+    uint32_t uncompressed_size = 0;
+    uint32_t reserved = 0;
+};
+
+// The checkpoints end with this trailer
+struct LZLIB4_MUX_TRAILER {
+    uint64_t index_offset = 0;          // Position of this checkpoint
+    uint64_t previous_index = 0;        // Position of the previous checkpoint, 0 if this is the first one
+    uint32_t entries = 0;
+    uint32_t magic = LZLIB4_MUX_MAGIC;
+};
+
+struct lzlib4_mux_options {
+    size_t block_size = LZLIB4_BLOCK_SIZE;
+    int8_t compression_level = LZ4HC_CLEVEL_DEFAULT;
+    // Independent blocks allow the random access into a channel without decompressing it from the start
+    bool independent_blocks = false;
+    // Blocks between the index checkpoints
+    size_t index_interval = 1024;
+};
+
+class lzlib4_mux_writer {
+    public:
+        lzlib4_mux_writer();
+        ~lzlib4_mux_writer();
+        int open(const char * path, const lzlib4_mux_options &options = lzlib4_mux_options());
+        int write(uint32_t channel, const uint8_t * data, size_t size);
+        int flush();
+        int close();
+
+    private:
+        lzlib4 * channel_stream(uint32_t channel);
+        int run_channel(uint32_t channel, lzlib4 * stream, lzlib4_flush_mode flush_mode);
+        int append(const uint8_t * data, size_t size);
+        int write_checkpoint();
+        int flush_output();
+        void free_channels();
+
+        int file = -1;
+        lzlib4_mux_options options;
+        std::unordered_map<uint32_t, lzlib4 *> channels;
+        std::unordered_map<uint32_t, uint64_t> channel_sizes;
+        std::vector<uint8_t> channel_output;
+
+        // Data not written to the file yet, which starts at output_offset
+        std::vector<uint8_t> output;
+        uint64_t output_offset = 0;
+        int64_t current_channel = -1;
+
+        // Blocks since the last checkpoint
+        std::vector<LZLIB4_MUX_ENTRY> entries;
+        uint64_t last_index = 0;
+};
+
+class lzlib4_mux_reader {
+    public:
+        lzlib4_mux_reader();
+        ~lzlib4_mux_reader();
+        int open(const char * path);
+        void close();
+        std::vector<uint32_t> channels() const;
+        uint64_t channel_size(uint32_t channel) const;
+        int read(uint32_t channel, uint64_t offset, uint8_t * out, size_t size, bool check_crc = false) const;
+
+    private:
+        int load_checkpoints(uint64_t position, uint64_t * scan_from);
+        int scan_blocks(uint64_t position);
+        void add_entry(const LZLIB4_MUX_ENTRY &entry);
+
+        const uint8_t * stream = NULL;
+        size_t stream_size = 0;
+        void * mapping = NULL;
+
+        // Blocks of every channel, sorted by its uncompressed position
+        std::unordered_map<uint32_t, std::vector<LZLIB4_MUX_ENTRY>> table;
+};
+
+#endif
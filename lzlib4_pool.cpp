@@ -0,0 +1,286 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_pool.h"
+#include <stdio.h>
+#include <algorithm>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+
+/**
+ * @brief Create the pool workers
+ *
+ * @param threads : Number of threads that will run the tasks, including the thread that calls run(). A pool of
+ *                  1 thread doesn't create any worker and runs everything in the calling thread.
+ */
+lzlib4_pool::lzlib4_pool(size_t threads) {
+    next_task = 0;
+
+    start_workers(threads ? threads - 1 : 0);
+}
+
+
+/**
+ * @brief Create the pool workers pinned to CPUs
+ *
+ * @param threads : Number of workers. With pin_threads all of them are new threads, because the calling thread
+ *                  doesn't run tasks.
+ * @param options : Pinning options
+ */
+lzlib4_pool::lzlib4_pool(size_t threads, const lzlib4_pool_options &options) {
+    next_task = 0;
+
+    if (!options.pin_threads) {
+        start_workers(threads ? threads - 1 : 0);
+        return;
+    }
+
+    std::vector<int> cpus = options.cpus;
+#ifdef __linux__
+    if (cpus.empty()) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (!sched_getaffinity(0, sizeof(allowed), &allowed)) {
+            for (int i = 0; i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &allowed)) {
+                    cpus.push_back(i);
+                }
+            }
+        }
+    }
+#endif
+
+    pinned = true;
+    for (size_t i = 0; i < std::max(threads, (size_t) 1); i++) {
+        worker_cpus.push_back(cpus.empty() ? -1 : cpus[i % cpus.size()]);
+    }
+    start_workers(worker_cpus.size());
+}
+
+lzlib4_pool::~lzlib4_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_ready.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+
+/**
+ * @brief Run "tasks" tasks calling task(index) for every one, and wait until all of them are done.
+ *
+ * @param tasks : Number of tasks to run
+ * @param task : Function that will be called with the task index
+ */
+void lzlib4_pool::run(size_t tasks, const std::function<void(size_t)> &task) {
+    if (!tasks) {
+        return;
+    }
+
+    // Without workers or with only one task, there is nothing to distribute. The pinned pools always use the
+    // workers.
+    if (workers.empty() || (tasks == 1 && !pinned)) {
+        for (size_t i = 0; i < tasks; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    // Only one job at a time
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pinned) {
+            if (tasks > claimed_size) {
+                claimed.reset(new std::atomic<bool>[tasks]);
+                claimed_size = tasks;
+            }
+            for (size_t i = 0; i < tasks; i++) {
+                claimed[i] = false;
+            }
+        }
+        job = &task;
+        job_tasks = tasks;
+        pending_tasks = tasks;
+        next_task = 0;
+        job_generation++;
+    }
+    job_ready.notify_all();
+
+    // The calling thread works too, except in the pinned pools
+    if (!pinned) {
+        take_tasks(workers.size());
+    }
+
+    // Wait until all the tasks are done and no worker is still looking at the job
+    std::unique_lock<std::mutex> lock(mutex);
+    job_done.wait(lock, [this] { return pending_tasks == 0 && active_workers == 0; });
+    job = NULL;
+}
+
+
+/**
+ * @brief Number of threads used by the pool, including the calling thread
+ *
+ * @return size_t
+ */
+size_t lzlib4_pool::size() {
+    return pinned ? workers.size() : workers.size() + 1;
+}
+
+
+/**
+ * @brief CPU of a pinned worker
+ *
+ * @param worker : Worker index
+ * @return int : CPU number, or -1 if the worker is not pinned
+ */
+int lzlib4_pool::cpu(size_t worker) {
+    return worker < worker_cpus.size() ? worker_cpus[worker] : -1;
+}
+
+
+/**
+ * @brief NUMA node of a pinned worker, readed from /sys/devices/system/cpu/cpuN/nodeM
+ *
+ * @param worker : Worker index
+ * @return int : Node number, or -1 if the worker is not pinned or the node is unknown
+ */
+int lzlib4_pool::node(size_t worker) {
+    int worker_cpu = cpu(worker);
+    if (worker_cpu < 0) {
+        return -1;
+    }
+
+    int worker_node = -1;
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", worker_cpu);
+    DIR * directory = opendir(path);
+    if (!directory) {
+        return -1;
+    }
+
+    struct dirent * entry;
+    while ((entry = readdir(directory))) {
+        if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            worker_node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(directory);
+#endif
+
+    return worker_node;
+}
+
+
+void lzlib4_pool::start_workers(size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        workers.emplace_back(&lzlib4_pool::worker_loop, this, i);
+    }
+}
+
+
+void lzlib4_pool::worker_loop(size_t worker) {
+    uint64_t last_generation = 0;
+
+#ifdef __linux__
+    if (cpu(worker) >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu(worker), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_ready.wait(lock, [this, last_generation] { return stopping || (job && job_generation != last_generation); });
+
+            if (stopping) {
+                return;
+            }
+
+            last_generation = job_generation;
+            active_workers++;
+        }
+
+        take_tasks(worker);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active_workers--;
+        }
+        job_done.notify_all();
+    }
+}
+
+
+void lzlib4_pool::take_tasks(size_t worker) {
+    if (!pinned) {
+        while (true) {
+            size_t current = next_task++;
+            if (current >= job_tasks) {
+                break;
+            }
+
+            run_task(current);
+        }
+        return;
+    }
+
+    // The own tasks first, and then the tasks that the other workers didn't take yet
+    for (size_t current = worker; current < job_tasks; current += workers.size()) {
+        if (claim_task(current)) {
+            run_task(current);
+        }
+    }
+    for (size_t current = 0; current < job_tasks; current++) {
+        if (claim_task(current)) {
+            run_task(current);
+        }
+    }
+}
+
+
+bool lzlib4_pool::claim_task(size_t task) {
+    return !claimed[task].exchange(true);
+}
+
+
+void lzlib4_pool::run_task(size_t task) {
+    (*job)(task);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    pending_tasks--;
+}
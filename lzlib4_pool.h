@@ -0,0 +1,93 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Small worker pool used by the modes that work over several blocks (or several encodings of the same block) at once.
+ *
+ * The pool only knows how to run a "parallel for": run() splits a job into N tasks, the workers and the calling
+ * thread take the tasks one by one, and the call returns when all of them are done. This keeps the callers simple
+ * because they don't have to deal with futures or queues, they just fill an array of results indexed by task.
+ *
+ * On multi-socket machines the workers can be pinned to CPUs (lzlib4_pool_options). Pinned pools also assign the
+ * tasks by locality: the task N is offered first to the worker N % workers, and the other workers only take it when
+ * they have finished their own tasks. Because Linux places the memory pages on the node of the thread that writes
+ * them first, the buffers initialized inside a task stay on the node of the worker which will use them again with
+ * the same task index. In machines with only one node this is just CPU pinning.
+ **/
+
+#ifndef LZLIB4_POOL_H
+#define LZLIB4_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct lzlib4_pool_options {
+    // Pin every worker to a CPU. When pinned, the calling thread doesn't run tasks, so all of them run in a known CPU.
+    bool pin_threads = false;
+    // CPUs used by the workers, in order. Empty to use the CPUs allowed to the process.
+    std::vector<int> cpus;
+};
+
+class lzlib4_pool {
+    public:
+        lzlib4_pool(size_t threads);
+        lzlib4_pool(size_t threads, const lzlib4_pool_options &options);
+        ~lzlib4_pool();
+        void run(size_t tasks, const std::function<void(size_t)> &task);
+        size_t size();
+        int cpu(size_t worker);
+        int node(size_t worker);
+
+    private:
+        void start_workers(size_t workers);
+        void worker_loop(size_t worker);
+        void take_tasks(size_t worker);
+        bool claim_task(size_t task);
+        void run_task(size_t task);
+
+        std::vector<std::thread> workers;
+        std::mutex run_mutex;
+        std::mutex mutex;
+        std::condition_variable job_ready;
+        std::condition_variable job_done;
+
+        // Current job. The generation number allows the workers to know when there is a new job to do.
+        const std::function<void(size_t)> * job = NULL;
+        size_t job_tasks = 0;
+        uint64_t job_generation = 0;
+        std::atomic<size_t> next_task;
+        size_t pending_tasks = 0;
+        size_t active_workers = 0;
+        bool stopping = false;
+
+        // Pinned workers. The tasks are claimed one by one to allow the assignment by locality.
+        bool pinned = false;
+        std::vector<int> worker_cpus;
+        std::unique_ptr<std::atomic<bool>[]> claimed;
+        size_t claimed_size = 0;
+};
+
+#endif
@@ -0,0 +1,1486 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_reader.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <new>
+
+#ifdef _WIN32
+#include <stdio.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+/**
+ * @brief Unpin a cache entry. The detached entries are freed by its last user.
+ *
+ * @param entry : Cache entry
+ */
+static void lzlib4_reader_release_entry(lzlib4_reader_cache_entry * entry) {
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1 && entry->detached) {
+        free(entry->data);
+        delete entry;
+    }
+}
+
+
+lzlib4_reader_view::lzlib4_reader_view() {
+}
+
+lzlib4_reader_view::lzlib4_reader_view(const lzlib4_reader_view &other) {
+    *this = other;
+}
+
+lzlib4_reader_view & lzlib4_reader_view::operator=(const lzlib4_reader_view &other) {
+    if (this != &other) {
+        if (other.entry) {
+            other.entry->refs++;
+        }
+        release();
+        entry = other.entry;
+        view_data = other.view_data;
+        view_size = other.view_size;
+    }
+
+    return *this;
+}
+
+lzlib4_reader_view::~lzlib4_reader_view() {
+    release();
+}
+
+const uint8_t * lzlib4_reader_view::data() const {
+    return view_data;
+}
+
+size_t lzlib4_reader_view::size() const {
+    return view_size;
+}
+
+
+/**
+ * @brief Release the view. The cached block can be replaced when all its views are released.
+ *
+ */
+void lzlib4_reader_view::release() {
+    if (entry) {
+        lzlib4_reader_release_entry(entry);
+    }
+    entry = NULL;
+    view_data = NULL;
+    view_size = 0;
+}
+
+
+lzlib4_reader::lzlib4_reader() : cache_hits(0), cache_misses(0), shared_hits(0) {
+}
+
+lzlib4_reader::~lzlib4_reader() {
+    stop_prefetch();
+    close();
+    free_cache();
+    delete pool;
+}
+
+
+/**
+ * @brief Open a compressed stream stored in memory. The memory must be valid until the reader is closed.
+ *
+ * @param data : Compressed stream
+ * @param size : Compressed stream size
+ * @return int : LZLIB4_RC_OK if the stream was opened, negative number otherwise.
+ */
+int lzlib4_reader::open(const uint8_t * data, size_t size) {
+    close();
+
+    stream = data;
+    stream_size = size;
+
+    // Use the index if the stream has it, otherwise read all the headers
+    int return_code = build_table_from_index();
+    if (return_code == LZLIB4_RC_INDEX_ERROR) {
+        return_code = build_table_from_headers();
+    }
+
+    if (return_code != LZLIB4_RC_OK) {
+        close();
+        return return_code;
+    }
+
+    for (size_t i = 0; i < table.size(); i++) {
+        max_block_size = std::max(max_block_size, table[i].uncompressed_size);
+        max_compressed_size = std::max(max_compressed_size, table[i].compressed_size);
+    }
+    if (!table.empty()) {
+        uncompressed_size = table.back().uncompressed_offset + table.back().uncompressed_size;
+    }
+    if (shared_image_auto) {
+        shared_image = table_image_id();
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Open a compressed file. The file is mapped into memory (or readed on systems without mmap).
+ *
+ * @param path : File path
+ * @return int : LZLIB4_RC_OK if the file was opened, negative number otherwise.
+ */
+int lzlib4_reader::open(const char * path) {
+    close();
+
+#ifdef _WIN32
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t * data = (uint8_t*) malloc(file_size > 0 ? file_size : 1);
+    if (!data || fread(data, 1, file_size, file) != (size_t) file_size) {
+        free(data);
+        fclose(file);
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    fclose(file);
+#else
+    int file = ::open(path, O_RDONLY);
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    struct stat file_stat;
+    if (fstat(file, &file_stat) || file_stat.st_size <= 0) {
+        ::close(file);
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    size_t file_size = file_stat.st_size;
+    void * data = mmap(NULL, file_size, PROT_READ, MAP_SHARED, file, 0);
+    ::close(file);
+    if (data == MAP_FAILED) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+#endif
+
+    int return_code = open((const uint8_t *) data, file_size);
+    // The mapping is set after open(), because open() closes the previous stream
+    mapping = data;
+    mapping_size = file_size;
+    if (return_code != LZLIB4_RC_OK) {
+        close();
+    }
+
+    return return_code;
+}
+
+
+/**
+ * @brief Close the stream and free all the buffers. Must not be called while other threads are reading.
+ *
+ */
+void lzlib4_reader::close() {
+    // The prefetcher must not use the stream anymore
+    prefetch_drain();
+
+    if (mapping) {
+#ifdef _WIN32
+        free(mapping);
+#else
+        munmap(mapping, mapping_size);
+#endif
+        mapping = NULL;
+        mapping_size = 0;
+    }
+
+    for (size_t i = 0; i < LZLIB4_READER_SCRATCH_SLOTS; i++) {
+        free_scratch(&scratch_slots[i]);
+    }
+
+    // The cache size is kept, but the blocks belong to the closed stream
+    cache_map.clear();
+    for (size_t i = 0; i < cache_size; i++) {
+        cache[i].block = -1;
+        cache[i].checked = false;
+    }
+
+    stream = NULL;
+    stream_size = 0;
+    table.clear();
+    uncompressed_size = 0;
+    max_block_size = 0;
+    max_compressed_size = 0;
+}
+
+
+/**
+ * @brief Uncompressed size of the stream
+ *
+ * @return uint64_t
+ */
+uint64_t lzlib4_reader::size() const {
+    return uncompressed_size;
+}
+
+
+/**
+ * @brief Number of blocks of the stream
+ *
+ * @return size_t
+ */
+size_t lzlib4_reader::blocks() const {
+    return table.size();
+}
+
+
+/**
+ * @brief Information of a block, in uncompressed order
+ *
+ * @param block : Block number
+ * @param info : Block information
+ * @return int : LZLIB4_RC_OK if the block exists, LZLIB4_RC_INDEX_ERROR otherwise.
+ */
+int lzlib4_reader::block_info(size_t block, lzlib4_reader_block &info) const {
+    if (block >= table.size()) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    info = table[block];
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Build the blocks table using the stream index
+ *
+ * @return int : LZLIB4_RC_OK if the table was built, LZLIB4_RC_INDEX_ERROR if there is no index, or other
+ *               negative number if the stream is damaged.
+ */
+int lzlib4_reader::build_table_from_index() {
+    lzlib4_index_view index;
+    int return_code = lzlib4::read_index(stream, stream_size, index);
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    table.resize(index.trailer.entries);
+    uint64_t expected_offset = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+        LZLIB4_INDEX_ENTRY entry = lzlib4::index_entry(index, i);
+        if (entry.offset + sizeof(LZLIB4_BLOCK_HEADER) > index.trailer.index_offset || entry.uncompressed_offset != expected_offset) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        LZLIB4_BLOCK_HEADER header;
+        memcpy(&header, stream + entry.offset, sizeof(header));
+        if (header.compressed_size != entry.compressed_size || (header.uncompressed_size & LZLIB4_BLOCK_SIZE_MASK) != entry.uncompressed_size) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        lzlib4_reader_block &block = table[i];
+        block.offset = entry.offset + sizeof(header);
+        block.uncompressed_offset = entry.uncompressed_offset;
+        block.compressed_size = header.compressed_size & LZLIB4_BLOCK_SIZE_MASK;
+        block.uncompressed_size = entry.uncompressed_size;
+        block.flags = header.compressed_size & ~LZLIB4_BLOCK_SIZE_MASK;
+        block.crc = header.crc;
+
+        if (
+            block.offset + block.compressed_size > index.trailer.index_offset ||
+            block.uncompressed_size > LZLIB4_MAX_BLOCK_SIZE ||
+            !block.uncompressed_size
+        ) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        expected_offset += block.uncompressed_size;
+    }
+
+    // The dictionary of every block is the previous block in the compressed stream, which is not the previous one
+    // in the table if the blocks were reordered.
+    std::vector<size_t> stream_order(table.size());
+    for (size_t i = 0; i < stream_order.size(); i++) {
+        stream_order[i] = i;
+    }
+    std::sort(stream_order.begin(), stream_order.end(), [this](size_t a, size_t b) {
+        return table[a].offset < table[b].offset;
+    });
+    for (size_t i = 1; i < stream_order.size(); i++) {
+        table[stream_order[i]].previous = stream_order[i - 1];
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Build the blocks table reading all the block headers. The reordering windows are also supported.
+ *
+ * @return int : LZLIB4_RC_OK if the table was built, negative number otherwise.
+ */
+int lzlib4_reader::build_table_from_headers() {
+    size_t position = 0;
+    uint64_t uncompressed_offset = 0;
+    int64_t previous = -1;
+
+    // Blocks of the current reordering window, in stream order, and its slots
+    std::vector<uint32_t> window_slots;
+    std::vector<size_t> window_blocks;
+
+    while (position + sizeof(LZLIB4_BLOCK_HEADER) <= stream_size) {
+        LZLIB4_BLOCK_HEADER header;
+        memcpy(&header, stream + position, sizeof(header));
+        uint32_t flags = header.compressed_size & ~LZLIB4_BLOCK_SIZE_MASK;
+        uint32_t compressed_size = header.compressed_size & LZLIB4_BLOCK_SIZE_MASK;
+        uint32_t block_size = header.uncompressed_size & LZLIB4_BLOCK_SIZE_MASK;
+
+        if (!compressed_size || position + sizeof(header) + compressed_size > stream_size) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        const uint8_t * data = stream + position + sizeof(header);
+        position += sizeof(header) + compressed_size;
+
+        // Metadata blocks
+        if (!block_size) {
+            if (header.crc == LZLIB4_MARKER_PERMUTATION) {
+                if (!window_blocks.empty() || compressed_size % sizeof(uint32_t)) {
+                    return LZLIB4_RC_BLOCK_DAMAGED;
+                }
+                window_slots.resize(compressed_size / sizeof(uint32_t));
+                memcpy(window_slots.data(), data, compressed_size);
+                previous = -1;
+            }
+            else if (header.crc == LZLIB4_MARKER_UNORDERED) {
+                // The position of the blocks is only into the index
+                return LZLIB4_RC_INDEX_ERROR;
+            }
+            else if (header.crc != LZLIB4_MARKER_INDEX && header.crc != LZLIB4_MARKER_SYNC) {
+                return LZLIB4_RC_BLOCK_DAMAGED;
+            }
+            continue;
+        }
+
+        if (block_size > LZLIB4_MAX_BLOCK_SIZE) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+
+        lzlib4_reader_block block;
+        block.offset = position - compressed_size;
+        block.compressed_size = compressed_size;
+        block.uncompressed_size = block_size;
+        block.flags = flags;
+        block.crc = header.crc;
+        block.previous = previous;
+        block.uncompressed_offset = uncompressed_offset;
+        previous = table.size();
+        table.push_back(block);
+
+        if (window_slots.empty()) {
+            uncompressed_offset += block_size;
+            continue;
+        }
+
+        // The window blocks get its position when the window is complete
+        window_blocks.push_back(table.size() - 1);
+        if (window_blocks.size() == window_slots.size()) {
+            std::vector<size_t> by_slot(window_slots.size(), SIZE_MAX);
+            for (size_t i = 0; i < window_slots.size(); i++) {
+                if (window_slots[i] >= by_slot.size() || by_slot[window_slots[i]] != SIZE_MAX) {
+                    return LZLIB4_RC_BLOCK_DAMAGED;
+                }
+                by_slot[window_slots[i]] = window_blocks[i];
+            }
+            for (size_t i = 0; i < by_slot.size(); i++) {
+                table[by_slot[i]].uncompressed_offset = uncompressed_offset;
+                uncompressed_offset += table[by_slot[i]].uncompressed_size;
+            }
+            window_slots.clear();
+            window_blocks.clear();
+        }
+    }
+
+    if (!window_slots.empty()) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    // Sort the table by the uncompressed position, keeping the stream predecessors
+    std::vector<size_t> order(table.size());
+    std::vector<size_t> new_position(table.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        return table[a].uncompressed_offset < table[b].uncompressed_offset;
+    });
+    for (size_t i = 0; i < order.size(); i++) {
+        new_position[order[i]] = i;
+    }
+
+    std::vector<lzlib4_reader_block> sorted(table.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        sorted[i] = table[order[i]];
+        if (sorted[i].previous >= 0) {
+            sorted[i].previous = new_position[sorted[i].previous];
+        }
+    }
+    table.swap(sorted);
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Find the block which contains an uncompressed position
+ *
+ * @param offset : Uncompressed position
+ * @return size_t : Block number
+ */
+size_t lzlib4_reader::find_block(uint64_t offset) const {
+    size_t low = 0;
+    size_t high = table.size();
+
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (table[middle].uncompressed_offset <= offset) {
+            low = middle;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+
+/**
+ * @brief Take a free scratch from the pool. The search starts at a position that depends on the thread, so every
+ *        thread will usually take the same scratch, and no locks are used.
+ *
+ * @return lzlib4_reader_scratch* : Scratch, or NULL if all of them are in use
+ */
+lzlib4_reader_scratch * lzlib4_reader::take_scratch() const {
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % LZLIB4_READER_SCRATCH_SLOTS;
+
+    for (size_t i = 0; i < LZLIB4_READER_SCRATCH_SLOTS; i++) {
+        lzlib4_reader_scratch * scratch = &scratch_slots[(start + i) % LZLIB4_READER_SCRATCH_SLOTS];
+        bool expected = false;
+        if (!scratch->busy.load(std::memory_order_relaxed) &&
+            scratch->busy.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return scratch;
+        }
+    }
+
+    return NULL;
+}
+
+
+void lzlib4_reader::release_scratch(lzlib4_reader_scratch * scratch) const {
+    scratch->busy.store(false, std::memory_order_release);
+}
+
+
+/**
+ * @brief Allocate the scratch buffers if they are not allocated yet
+ *
+ * @param scratch : Scratch buffers
+ * @return int : LZLIB4_RC_OK if the buffers are ready, negative number otherwise.
+ */
+int lzlib4_reader::prepare_scratch(lzlib4_reader_scratch * scratch) const {
+    if (scratch->block_size < max_block_size) {
+        free(scratch->block);
+        free(scratch->dict);
+        scratch->block = (uint8_t*) malloc(max_block_size);
+        scratch->dict = (uint8_t*) malloc(max_block_size);
+        scratch->block_size = max_block_size;
+
+        if (!scratch->block || !scratch->dict) {
+            free_scratch(scratch);
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+void lzlib4_reader::free_scratch(lzlib4_reader_scratch * scratch) {
+    free(scratch->block);
+    free(scratch->dict);
+    free(scratch->entropy);
+    scratch->block = NULL;
+    scratch->dict = NULL;
+    scratch->entropy = NULL;
+    scratch->block_size = 0;
+    scratch->entropy_size = 0;
+}
+
+
+/**
+ * @brief Decompress a block. Linked blocks are decompressed starting from the last block that doesn't need a
+ *        dictionary.
+ *
+ * @param block : Block number
+ * @param scratch : Scratch buffers
+ * @param check_crc : Check the CRC of the block
+ * @param data : Pointer to the decompressed data. It can point to the scratch, to "out" or to the stream (stored
+ *               blocks).
+ * @param out : Buffer for the decompressed block, instead of the scratch. Must have space for the whole block.
+ * @return int : LZLIB4_RC_OK if the block was decompressed, negative number otherwise.
+ */
+int lzlib4_reader::decode_block(size_t block, lzlib4_reader_scratch * scratch, bool check_crc, const uint8_t ** data, uint8_t * out) const {
+    // Blocks to decompress, from the last one to the first one. A cached block stops the chain, because it can be
+    // used as dictionary.
+    std::vector<size_t> chain;
+    lzlib4_reader_cache_entry * base = NULL;
+    int64_t current = block;
+    while (current >= 0) {
+        if ((size_t) current != block && cache_size && (base = cache_find(current))) {
+            break;
+        }
+        chain.push_back(current);
+        const lzlib4_reader_block &info = table[current];
+        if (info.flags & (LZLIB4_BLOCK_FLAG_INDEPENDENT | LZLIB4_BLOCK_FLAG_STORED)) {
+            break;
+        }
+        current = info.previous;
+    }
+
+    const uint8_t * dict = base ? base->data : NULL;
+    size_t dict_size = base ? base->size : 0;
+    int return_code = LZLIB4_RC_OK;
+
+    for (size_t i = chain.size(); i > 0 && return_code == LZLIB4_RC_OK; i--) {
+        const lzlib4_reader_block &info = table[chain[i - 1]];
+        const uint8_t * src = stream + info.offset;
+        size_t src_size = info.compressed_size;
+
+        if (info.flags & LZLIB4_BLOCK_FLAG_STORED) {
+            // Stored blocks are used directly from the stream
+            if (src_size != info.uncompressed_size) {
+                return_code = LZLIB4_RC_BLOCK_DAMAGED;
+                break;
+            }
+            dict = src;
+            dict_size = src_size;
+            continue;
+        }
+
+        if (info.flags & LZLIB4_BLOCK_FLAG_ENTROPY) {
+            size_t decoded_size = lzlib4_entropy_decoded_size(src, src_size);
+            if (!decoded_size || decoded_size > LZ4_COMPRESSBOUND(info.uncompressed_size)) {
+                return_code = LZLIB4_RC_BLOCK_DAMAGED;
+                break;
+            }
+            if (decoded_size > scratch->entropy_size) {
+                uint8_t * new_buffer = (uint8_t*) realloc(scratch->entropy, decoded_size);
+                if (!new_buffer) {
+                    return_code = LZLIB4_RC_BUFFER_ERROR;
+                    break;
+                }
+                scratch->entropy = new_buffer;
+                scratch->entropy_size = decoded_size;
+            }
+
+            int decoded = lzlib4_entropy_decompress(src, src_size, scratch->entropy, decoded_size);
+            if (decoded < 0) {
+                return_code = LZLIB4_RC_BLOCK_DAMAGED;
+                break;
+            }
+            src = scratch->entropy;
+            src_size = decoded;
+        }
+
+        // The last block can be decompressed to the caller buffer. Otherwise the output buffer can't be the
+        // dictionary, so the buffers are swapped.
+        uint8_t * target;
+        if (i == 1 && out) {
+            target = out;
+        }
+        else {
+            if (dict == scratch->block) {
+                std::swap(scratch->block, scratch->dict);
+            }
+            target = scratch->block;
+        }
+
+        int decompressed;
+        if ((info.flags & LZLIB4_BLOCK_FLAG_INDEPENDENT) || !dict) {
+            decompressed = LZ4_decompress_safe((char *) src, (char *) target, src_size, info.uncompressed_size);
+        }
+        else {
+            decompressed = LZ4_decompress_safe_usingDict(
+                (char *) src,
+                (char *) target,
+                src_size,
+                info.uncompressed_size,
+                (const char *) dict,
+                dict_size
+            );
+        }
+
+        if (decompressed < 0 || (uint32_t) decompressed != info.uncompressed_size) {
+            return_code = LZLIB4_RC_BLOCK_DAMAGED;
+            break;
+        }
+
+        dict = target;
+        dict_size = decompressed;
+    }
+
+    if (base) {
+        lzlib4_reader_release_entry(base);
+    }
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    if (check_crc && lzlib4::crc32(dict, dict_size) != table[block].crc) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    *data = dict;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Read a part of the uncompressed data. Can be called from any number of threads at the same time.
+ *
+ * @param offset : Uncompressed position
+ * @param out : Output buffer
+ * @param size : Bytes to read
+ * @param check_crc : Check the CRC of the decompressed blocks
+ * @return int : LZLIB4_RC_OK if all the data was read, negative number otherwise.
+ */
+int lzlib4_reader::read(uint64_t offset, uint8_t * out, size_t size, bool check_crc) const {
+    if (offset > uncompressed_size || size > uncompressed_size - offset) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+    if (!size) {
+        return LZLIB4_RC_OK;
+    }
+
+    // If all the scratch buffers are in use, a temporary one is created
+    lzlib4_reader_scratch temporary;
+    lzlib4_reader_scratch * scratch = take_scratch();
+    bool pooled = scratch != NULL;
+    if (!pooled) {
+        scratch = &temporary;
+    }
+
+    int return_code = prepare_scratch(scratch);
+
+    size_t block = find_block(offset);
+    while (size && return_code == LZLIB4_RC_OK) {
+        prefetch_access(block);
+
+        // The blocks are kept into the cache if it is enabled
+        const uint8_t * data;
+        lzlib4_reader_cache_entry * entry = NULL;
+        if (cache_size) {
+            return_code = pin_block(block, scratch, check_crc, &data, &entry);
+        }
+        else {
+            return_code = decode_block(block, scratch, check_crc, &data);
+        }
+        if (return_code != LZLIB4_RC_OK) {
+            break;
+        }
+
+        const lzlib4_reader_block &info = table[block];
+        size_t block_offset = offset - info.uncompressed_offset;
+        size_t to_copy = std::min(size, (size_t) (info.uncompressed_size - block_offset));
+        memcpy(out, data + block_offset, to_copy);
+        if (entry) {
+            lzlib4_reader_release_entry(entry);
+        }
+
+        out += to_copy;
+        offset += to_copy;
+        size -= to_copy;
+        block++;
+    }
+
+    if (pooled) {
+        release_scratch(scratch);
+    }
+    else {
+        free_scratch(scratch);
+    }
+
+    return return_code;
+}
+
+
+/**
+ * @brief Enable the decompressed blocks cache. The cache keeps the last used blocks (LRU), and it is shared by all
+ *        the threads. Must not be called while other threads are reading or while there are views.
+ *
+ * @param blocks : Maximum number of cached blocks. 0 disables the cache.
+ * @return int : LZLIB4_RC_OK if the cache was changed, negative number otherwise.
+ */
+int lzlib4_reader::set_cache(size_t blocks) {
+    // The prefetcher and the shared cache need the cache
+    if (!blocks && (prefetch_enabled || shared_cache)) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    prefetch_drain();
+    free_cache();
+
+    if (blocks) {
+        cache = new (std::nothrow) lzlib4_reader_cache_entry[blocks];
+        if (!cache) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        cache_size = blocks;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+void lzlib4_reader::free_cache() {
+    for (size_t i = 0; i < cache_size; i++) {
+        free(cache[i].data);
+    }
+    delete[] cache;
+    cache = NULL;
+    cache_size = 0;
+    cache_map.clear();
+}
+
+
+/**
+ * @brief Take a block from the cache
+ *
+ * @param block : Block number
+ * @return lzlib4_reader_cache_entry* : Pinned entry, or NULL if the block is not cached
+ */
+lzlib4_reader_cache_entry * lzlib4_reader::cache_find(size_t block) const {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto found = cache_map.find(block);
+    if (found == cache_map.end()) {
+        return NULL;
+    }
+
+    found->second->refs++;
+    found->second->last_use = ++cache_clock;
+
+    return found->second;
+}
+
+
+/**
+ * @brief Take the least recently used entry which is not pinned, to decompress a new block into it
+ *
+ * @return lzlib4_reader_cache_entry* : Pinned entry, or NULL if all the entries are in use
+ */
+lzlib4_reader_cache_entry * lzlib4_reader::cache_reserve() const {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    lzlib4_reader_cache_entry * oldest = NULL;
+    for (size_t i = 0; i < cache_size; i++) {
+        if (!cache[i].refs.load(std::memory_order_acquire) && (!oldest || cache[i].last_use < oldest->last_use)) {
+            oldest = &cache[i];
+            // Free entries are always the best
+            if (oldest->block < 0) {
+                break;
+            }
+        }
+    }
+
+    if (oldest) {
+        if (oldest->block >= 0) {
+            cache_map.erase(oldest->block);
+        }
+        oldest->block = -1;
+        oldest->checked = false;
+        oldest->refs = 1;
+    }
+
+    return oldest;
+}
+
+
+/**
+ * @brief Add a decompressed block to the cache. If other thread added the same block meanwhile, the entry is kept
+ *        free.
+ *
+ * @param entry : Entry with the decompressed block
+ * @param block : Block number
+ */
+void lzlib4_reader::cache_publish(lzlib4_reader_cache_entry * entry, size_t block) const {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    if (cache_map.find(block) == cache_map.end()) {
+        cache_map[block] = entry;
+        entry->block = block;
+    }
+    entry->last_use = ++cache_clock;
+}
+
+
+/**
+ * @brief Get a decompressed block from the cache, decompressing it if it is not cached. Stored blocks are taken
+ *        directly from the stream.
+ *
+ * @param block : Block number
+ * @param scratch : Scratch buffers
+ * @param check_crc : Check the CRC of the block
+ * @param data : Pointer to the decompressed data
+ * @param entry : Pinned cache entry, which must be released with lzlib4_reader_release_entry. NULL for the
+ *                stored blocks.
+ * @param prefetch : The block is requested by the prefetcher, so it is not counted into the statistics
+ * @return int : LZLIB4_RC_OK if the block is ready, negative number otherwise.
+ */
+int lzlib4_reader::pin_block(size_t block, lzlib4_reader_scratch * scratch, bool check_crc, const uint8_t ** data, lzlib4_reader_cache_entry ** entry, bool prefetch) const {
+    const lzlib4_reader_block &info = table[block];
+    *entry = NULL;
+
+    if (info.flags & LZLIB4_BLOCK_FLAG_STORED) {
+        if (info.compressed_size != info.uncompressed_size) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+        if (check_crc && lzlib4::crc32(stream + info.offset, info.uncompressed_size) != info.crc) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+        *data = stream + info.offset;
+        return LZLIB4_RC_OK;
+    }
+
+    lzlib4_reader_cache_entry * cached = cache_size ? cache_find(block) : NULL;
+    if (!prefetch) {
+        (cached ? cache_hits : cache_misses)++;
+    }
+    if (cached) {
+        if (check_crc && !cached->checked) {
+            if (lzlib4::crc32(cached->data, cached->size) != info.crc) {
+                lzlib4_reader_release_entry(cached);
+                return LZLIB4_RC_BLOCK_DAMAGED;
+            }
+            cached->checked = true;
+        }
+        *data = cached->data;
+        *entry = cached;
+        return LZLIB4_RC_OK;
+    }
+
+    // If all the entries are in use, the block is decompressed into a detached entry
+    cached = cache_size ? cache_reserve() : NULL;
+    if (!cached) {
+        cached = new (std::nothrow) lzlib4_reader_cache_entry();
+        if (!cached) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        cached->detached = true;
+        cached->refs = 1;
+    }
+
+    if (!cached->data) {
+        cached->data = (uint8_t*) malloc(max_block_size);
+        if (!cached->data) {
+            lzlib4_reader_release_entry(cached);
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+    }
+
+    // The second tier is the cache shared with other processes
+    size_t shared_size = 0;
+    bool shared = shared_cache &&
+        shared_cache->get(shared_image, block, cached->data, max_block_size, &shared_size) &&
+        shared_size == info.uncompressed_size &&
+        (!check_crc || lzlib4::crc32(cached->data, shared_size) == info.crc);
+
+    if (shared) {
+        if (!prefetch) {
+            shared_hits++;
+        }
+    }
+    else {
+        const uint8_t * decoded;
+        int return_code = decode_block(block, scratch, check_crc, &decoded, cached->data);
+        if (return_code != LZLIB4_RC_OK) {
+            lzlib4_reader_release_entry(cached);
+            return return_code;
+        }
+
+        if (shared_cache) {
+            shared_cache->put(shared_image, block, cached->data, info.uncompressed_size);
+        }
+    }
+
+    cached->size = info.uncompressed_size;
+    cached->checked = check_crc;
+    if (!cached->detached) {
+        cache_publish(cached, block);
+    }
+
+    *data = cached->data;
+    *entry = cached;
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Get a view of the uncompressed data without copying it. The view points to the decompressed block into the
+ *        cache, or to the stream if the block is stored, and the block is kept until the view is released. Can be
+ *        called from any number of threads at the same time. Without cache every view has its own block.
+ *
+ * @param offset : Uncompressed position
+ * @param size : Bytes to view. A view doesn't cross the block end, so it can be smaller (see
+ *               lzlib4_reader_view::size) and the rest of the data must be viewed from the next block.
+ * @param view : View of the data. The previous data of the view is released.
+ * @param check_crc : Check the CRC of the decompressed block
+ * @return int : LZLIB4_RC_OK if the view is ready, negative number otherwise.
+ */
+int lzlib4_reader::view(uint64_t offset, size_t size, lzlib4_reader_view &view, bool check_crc) const {
+    view.release();
+
+    if (offset > uncompressed_size || size > uncompressed_size - offset) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+    if (!size) {
+        return LZLIB4_RC_OK;
+    }
+
+    lzlib4_reader_scratch temporary;
+    lzlib4_reader_scratch * scratch = take_scratch();
+    bool pooled = scratch != NULL;
+    if (!pooled) {
+        scratch = &temporary;
+    }
+
+    size_t block = find_block(offset);
+    prefetch_access(block);
+
+    const uint8_t * data = NULL;
+    lzlib4_reader_cache_entry * entry = NULL;
+    int return_code = prepare_scratch(scratch);
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = pin_block(block, scratch, check_crc, &data, &entry);
+    }
+
+    if (pooled) {
+        release_scratch(scratch);
+    }
+    else {
+        free_scratch(scratch);
+    }
+
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    const lzlib4_reader_block &info = table[block];
+    size_t block_offset = offset - info.uncompressed_offset;
+    view.entry = entry;
+    view.view_data = data + block_offset;
+    view.view_size = std::min(size, (size_t) (info.uncompressed_size - block_offset));
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Use worker threads to decompress the blocks of a vectored read. Must not be called while other threads are
+ *        reading.
+ *
+ * @param threads : Number of threads. 0 or 1 to decompress the blocks in the calling thread.
+ * @param options : Pool options
+ * @return int : LZLIB4_RC_OK if the threads were changed, negative number otherwise.
+ */
+int lzlib4_reader::set_threads(size_t threads, const lzlib4_pool_options &options) {
+    delete pool;
+    pool = NULL;
+
+    if (threads > 1) {
+        pool = new (std::nothrow) lzlib4_pool(threads, options);
+        if (!pool) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+// Part of a vectored read range which is inside a single block
+struct lzlib4_reader_piece {
+    size_t block;
+    size_t block_offset;
+    size_t size;
+    uint8_t * out;
+};
+
+
+/**
+ * @brief Read several parts of the uncompressed data with a single call. The ranges are splitted by block and
+ *        grouped, so every block is decompressed only once even if many ranges use it. The blocks are decompressed
+ *        in parallel if the reader has threads (see lzlib4_reader::set_threads). Can be called from any number of
+ *        threads at the same time.
+ *
+ *        The linked blocks still need its previous blocks as dictionary, so using the cache is recommended with
+ *        them (see lzlib4_reader::set_cache).
+ *
+ * @param ranges : Ranges to read. The output buffers must not overlap.
+ * @param count : Number of ranges
+ * @param check_crc : Check the CRC of the decompressed blocks
+ * @param blocks_read : Number of different blocks used by the ranges. Can be NULL.
+ * @return int : LZLIB4_RC_OK if all the ranges were read, negative number otherwise.
+ */
+int lzlib4_reader::readv(const lzlib4_reader_range * ranges, size_t count, bool check_crc, size_t * blocks_read) const {
+    if (blocks_read) {
+        *blocks_read = 0;
+    }
+
+    // Split the ranges by block
+    std::vector<lzlib4_reader_piece> pieces;
+    pieces.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t offset = ranges[i].offset;
+        size_t size = ranges[i].size;
+        uint8_t * out = ranges[i].out;
+
+        if (offset > uncompressed_size || size > uncompressed_size - offset) {
+            return LZLIB4_RC_INDEX_ERROR;
+        }
+
+        size_t block = size ? find_block(offset) : 0;
+        if (size) {
+            prefetch_access(block);
+        }
+        while (size) {
+            const lzlib4_reader_block &info = table[block];
+            lzlib4_reader_piece piece;
+            piece.block = block;
+            piece.block_offset = offset - info.uncompressed_offset;
+            piece.size = std::min(size, (size_t) (info.uncompressed_size - piece.block_offset));
+            piece.out = out;
+            pieces.push_back(piece);
+
+            out += piece.size;
+            offset += piece.size;
+            size -= piece.size;
+            block++;
+        }
+    }
+
+    std::sort(pieces.begin(), pieces.end(), [](const lzlib4_reader_piece &a, const lzlib4_reader_piece &b) {
+        return a.block < b.block || (a.block == b.block && a.block_offset < b.block_offset);
+    });
+
+    // First piece of every block, and the end of the last one
+    std::vector<size_t> groups;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        if (!i || pieces[i].block != pieces[i - 1].block) {
+            groups.push_back(i);
+        }
+    }
+    size_t blocks = groups.size();
+    groups.push_back(pieces.size());
+
+    if (blocks_read) {
+        *blocks_read = blocks;
+    }
+
+    std::atomic<int> error(LZLIB4_RC_OK);
+    auto read_block = [&](size_t group) {
+        if (error.load(std::memory_order_relaxed) != LZLIB4_RC_OK) {
+            return;
+        }
+
+        lzlib4_reader_scratch temporary;
+        lzlib4_reader_scratch * scratch = take_scratch();
+        bool pooled = scratch != NULL;
+        if (!pooled) {
+            scratch = &temporary;
+        }
+
+        size_t block = pieces[groups[group]].block;
+        const uint8_t * data = NULL;
+        lzlib4_reader_cache_entry * entry = NULL;
+        int return_code = prepare_scratch(scratch);
+        if (return_code == LZLIB4_RC_OK) {
+            if (cache_size) {
+                return_code = pin_block(block, scratch, check_crc, &data, &entry);
+            }
+            else {
+                return_code = decode_block(block, scratch, check_crc, &data);
+            }
+        }
+
+        // Scatter the block to every range which uses it
+        if (return_code == LZLIB4_RC_OK) {
+            for (size_t i = groups[group]; i < groups[group + 1]; i++) {
+                memcpy(pieces[i].out, data + pieces[i].block_offset, pieces[i].size);
+            }
+        }
+        else {
+            int expected = LZLIB4_RC_OK;
+            error.compare_exchange_strong(expected, return_code);
+        }
+
+        if (entry) {
+            lzlib4_reader_release_entry(entry);
+        }
+        if (pooled) {
+            release_scratch(scratch);
+        }
+        else {
+            free_scratch(scratch);
+        }
+    };
+
+    if (pool && blocks > 1) {
+        pool->run(blocks, read_block);
+    }
+    else {
+        for (size_t i = 0; i < blocks; i++) {
+            read_block(i);
+        }
+    }
+
+    return error.load();
+}
+
+
+/**
+ * @brief Check if a block is cached, without pinning it
+ *
+ * @param block : Block number
+ * @return bool
+ */
+bool lzlib4_reader::cache_contains(size_t block) const {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    return cache_map.find(block) != cache_map.end();
+}
+
+
+/**
+ * @brief Enable the prefetcher. The predicted blocks are decompressed into the cache, so the cache must be enabled
+ *        first (see lzlib4_reader::set_cache). Must not be called while other threads are reading.
+ *
+ * @param enabled : true to enable the prefetcher
+ * @param options : Prefetcher options
+ * @return int : LZLIB4_RC_OK if the prefetcher was changed, negative number otherwise.
+ */
+int lzlib4_reader::set_prefetch(bool enabled, const lzlib4_prefetch_options &options) {
+    stop_prefetch();
+
+    if (!enabled) {
+        return LZLIB4_RC_OK;
+    }
+    if (!cache_size || !options.threads || !options.streams || !options.max_depth || !options.queue_size) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    prefetch_options = options;
+    prefetch_streams.assign(options.streams, lzlib4_prefetch_stream());
+    prefetch_depth = options.max_depth;
+    prefetch_issued = 0;
+    prefetch_useful = 0;
+    prefetch_window_issued = 0;
+    prefetch_window_useful = 0;
+    prefetch_paused = 0;
+    prefetch_stopping = false;
+    prefetch_enabled = true;
+
+    for (size_t i = 0; i < options.threads; i++) {
+        prefetch_threads.emplace_back(&lzlib4_reader::prefetch_loop, this);
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+void lzlib4_reader::stop_prefetch() {
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        prefetch_stopping = true;
+        prefetch_queue.clear();
+        prefetch_pending.clear();
+    }
+    prefetch_ready.notify_all();
+
+    for (size_t i = 0; i < prefetch_threads.size(); i++) {
+        prefetch_threads[i].join();
+    }
+    prefetch_threads.clear();
+    prefetch_enabled = false;
+}
+
+
+/**
+ * @brief Drop the pending predictions and wait until the background threads are idle
+ *
+ */
+void lzlib4_reader::prefetch_drain() {
+    std::unique_lock<std::mutex> lock(prefetch_mutex);
+    prefetch_queue.clear();
+    prefetch_pending.clear();
+    for (size_t i = 0; i < prefetch_streams.size(); i++) {
+        prefetch_streams[i] = lzlib4_prefetch_stream();
+    }
+    prefetch_idle.wait(lock, [this] { return !prefetch_busy; });
+}
+
+
+/**
+ * @brief Background thread: decompress the predicted blocks into the cache
+ *
+ */
+void lzlib4_reader::prefetch_loop() {
+    while (true) {
+        size_t block;
+        {
+            std::unique_lock<std::mutex> lock(prefetch_mutex);
+            prefetch_ready.wait(lock, [this] { return prefetch_stopping || !prefetch_queue.empty(); });
+            if (prefetch_stopping) {
+                return;
+            }
+            block = prefetch_queue.front();
+            prefetch_queue.pop_front();
+            prefetch_busy++;
+        }
+
+        if (!cache_contains(block)) {
+            lzlib4_reader_scratch * scratch = take_scratch();
+            if (scratch) {
+                const uint8_t * data;
+                lzlib4_reader_cache_entry * entry = NULL;
+                if (prepare_scratch(scratch) == LZLIB4_RC_OK && pin_block(block, scratch, false, &data, &entry, true) == LZLIB4_RC_OK && entry) {
+                    lzlib4_reader_release_entry(entry);
+                }
+                release_scratch(scratch);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(prefetch_mutex);
+            prefetch_busy--;
+        }
+        prefetch_idle.notify_all();
+    }
+}
+
+
+/**
+ * @brief Record a block access, update the access streams and queue the predicted blocks
+ *
+ * @param block : Block number
+ */
+void lzlib4_reader::prefetch_access(size_t block) const {
+    if (!prefetch_enabled) {
+        return;
+    }
+
+    std::vector<size_t> predicted;
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        int64_t current = block;
+        prefetch_clock++;
+
+        if (prefetch_pending.erase(block)) {
+            prefetch_useful++;
+            prefetch_window_useful++;
+        }
+
+        // A stopped prefetcher is tried again after some accesses
+        if (!prefetch_depth && ++prefetch_paused >= LZLIB4_PREFETCH_RETRY) {
+            prefetch_depth = 1;
+            prefetch_paused = 0;
+        }
+
+        // The stream which expected this block, or the nearest one, or the least recently used one is replaced
+        lzlib4_prefetch_stream * stream = NULL;
+        lzlib4_prefetch_stream * nearest = NULL;
+        lzlib4_prefetch_stream * oldest = &prefetch_streams[0];
+        int64_t nearest_distance = 0;
+        for (size_t i = 0; i < prefetch_streams.size() && !stream; i++) {
+            lzlib4_prefetch_stream &candidate = prefetch_streams[i];
+            if (candidate.last >= 0 && candidate.stride && candidate.last + candidate.stride == current) {
+                stream = &candidate;
+                break;
+            }
+
+            int64_t distance = current > candidate.last ? current - candidate.last : candidate.last - current;
+            if (candidate.last >= 0 && distance && distance <= prefetch_options.max_stride && (!nearest || distance < nearest_distance)) {
+                nearest = &candidate;
+                nearest_distance = distance;
+            }
+            if (candidate.last_use < oldest->last_use) {
+                oldest = &candidate;
+            }
+        }
+
+        if (stream) {
+            stream->confidence++;
+        }
+        else if (nearest) {
+            // New stride for the stream
+            stream = nearest;
+            stream->stride = current - stream->last;
+            stream->confidence = 1;
+            stream->issued = -1;
+        }
+        else {
+            stream = oldest;
+            *stream = lzlib4_prefetch_stream();
+        }
+        stream->last = current;
+        stream->last_use = prefetch_clock;
+
+        // Predict the next blocks of a confirmed stream, skipping the blocks already predicted
+        if (stream->confidence >= 2) {
+            for (size_t i = 1; i <= prefetch_depth; i++) {
+                int64_t next = current + stream->stride * (int64_t) i;
+                if (next < 0 || next >= (int64_t) table.size()) {
+                    break;
+                }
+                if (stream->issued >= 0 && (stream->stride > 0 ? next <= stream->issued : next >= stream->issued)) {
+                    continue;
+                }
+                stream->issued = next;
+                predicted.push_back(next);
+            }
+        }
+    }
+
+    // The cache is checked out of the prefetcher lock
+    size_t queued = 0;
+    for (size_t i = 0; i < predicted.size(); i++) {
+        if (cache_contains(predicted[i])) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        if (prefetch_queue.size() >= prefetch_options.queue_size) {
+            prefetch_pending.erase(prefetch_queue.front());
+            prefetch_queue.pop_front();
+        }
+        prefetch_queue.push_back(predicted[i]);
+        prefetch_pending.insert(predicted[i]);
+        prefetch_issued++;
+        queued++;
+
+        // Change the depth with the accuracy of the last predictions
+        if (++prefetch_window_issued >= LZLIB4_PREFETCH_WINDOW) {
+            uint32_t accuracy = prefetch_window_useful * 100 / prefetch_window_issued;
+            if (accuracy < 25) {
+                prefetch_depth /= 2;
+            }
+            else if (accuracy > 75) {
+                prefetch_depth = std::min(prefetch_depth * 2, prefetch_options.max_depth);
+            }
+            prefetch_window_issued = 0;
+            prefetch_window_useful = 0;
+        }
+    }
+
+    if (queued) {
+        prefetch_ready.notify_all();
+    }
+}
+
+
+/**
+ * @brief Reader statistics
+ *
+ * @return lzlib4_reader_stats
+ */
+lzlib4_reader_stats lzlib4_reader::stats() const {
+    lzlib4_reader_stats stats;
+    stats.cache_hits = cache_hits.load();
+    stats.cache_misses = cache_misses.load();
+    stats.shared_hits = shared_hits.load();
+
+    std::lock_guard<std::mutex> lock(prefetch_mutex);
+    stats.prefetch_issued = prefetch_issued;
+    stats.prefetch_useful = prefetch_useful;
+    stats.prefetch_depth = prefetch_enabled ? prefetch_depth : 0;
+
+    return stats;
+}
+
+
+/**
+ * @brief Use a cache shared with other processes as second tier of the cache. The blocks which are not in the
+ *        cache are searched into the shared cache before decompressing them, and the decompressed blocks are stored
+ *        into it. The cache must be enabled first (see lzlib4_reader::set_cache). Must not be called while other
+ *        threads are reading.
+ *
+ * @param shared : Shared cache, which must be kept open while the reader uses it. NULL to stop using it.
+ * @param image : Image id of the stream into the shared cache. 0 to compute it from the blocks table (see
+ *                lzlib4_shared_cache::image_id).
+ * @return int : LZLIB4_RC_OK if the shared cache was changed, negative number otherwise.
+ */
+int lzlib4_reader::set_shared_cache(lzlib4_shared_cache * shared, uint64_t image) {
+    if (shared && !cache_size) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    prefetch_drain();
+
+    shared_cache = shared;
+    shared_image = image;
+    shared_image_auto = !image;
+    if (shared_image_auto && stream) {
+        shared_image = table_image_id();
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Image id of the opened stream into the shared cache, from its blocks table
+ *
+ * @return uint64_t
+ */
+uint64_t lzlib4_reader::table_image_id() {
+    std::vector<LZLIB4_BLOCK_HEADER> headers(table.size());
+    for (size_t i = 0; i < table.size(); i++) {
+        headers[i].compressed_size = table[i].compressed_size | table[i].flags;
+        headers[i].uncompressed_size = table[i].uncompressed_size;
+        headers[i].crc = table[i].crc;
+    }
+
+    return lzlib4_shared_cache::image_id(headers.data(), headers.size(), stream_size);
+}
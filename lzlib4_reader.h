@@ -0,0 +1,248 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Random access reader.
+ *
+ * The lzlib4 class keeps the stream state in strm, so it can only be used by one thread at a time. This reader is
+ * immutable once is opened: the blocks table is built by open() and never modified, and every read takes the
+ * buffers it needs from a scratch pool, so any number of threads can read at the same time from the same reader.
+ *
+ * The blocks table is taken from the stream index if exists. Otherwise all the block headers are readed once.
+ * Linked blocks need the previous block as dictionary, so they are decompressed starting from the last independent
+ * block. Streams written with independent blocks don't have that cost.
+ *
+ * An optional cache keeps the last decompressed blocks (see lzlib4_reader::set_cache). The cached blocks are also
+ * used as dictionary of the next linked blocks, and they can be read without copying them using views.
+ *
+ * The cache can be filled in background by a prefetcher (see lzlib4_reader::set_prefetch). The prefetcher tracks
+ * several access streams, each one with its own stride (1 for sequential reads), so interleaved sequential and
+ * strided patterns are detected. The predicted blocks are decompressed by background threads, and the prediction
+ * depth is reduced when the prefetched blocks are not used.
+ *
+ * Behind the cache there can be a second tier shared with other processes (see lzlib4_shared_cache), so the blocks
+ * decompressed by a process can be used by the others.
+ **/
+
+#ifndef LZLIB4_READER_H
+#define LZLIB4_READER_H
+
+#include "lzlib4.h"
+#include "lzlib4_pool.h"
+#include "lzlib4_shared_cache.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+
+// Predictions between the prefetcher accuracy checks, and accesses before retrying a stopped prefetcher
+#define LZLIB4_PREFETCH_WINDOW 64
+#define LZLIB4_PREFETCH_RETRY 256
+
+// Scratch buffers kept by the reader. If all of them are in use, the read will create temporary buffers.
+#define LZLIB4_READER_SCRATCH_SLOTS 256
+
+// Block information of the reader table
+struct lzlib4_reader_block {
+    uint64_t offset = 0;                // Position of the block data (after the header) into the compressed stream
+    uint64_t uncompressed_offset = 0;
+    uint32_t compressed_size = 0;
+    uint32_t uncompressed_size = 0;
+    uint32_t flags = 0;
+    uint32_t crc = 0;
+    int64_t previous = -1;              // Previous block in the compressed stream (dictionary of linked blocks)
+};
+
+// Buffers used to decompress a block
+struct lzlib4_reader_scratch {
+    std::atomic<bool> busy;
+    uint8_t * block = NULL;
+    uint8_t * dict = NULL;
+    uint8_t * entropy = NULL;
+    size_t block_size = 0;
+    size_t entropy_size = 0;
+
+    lzlib4_reader_scratch() : busy(false) {}
+};
+
+// Range of a vectored read (see lzlib4_reader::readv)
+struct lzlib4_reader_range {
+    uint64_t offset = 0;                // Uncompressed position
+    size_t size = 0;
+    uint8_t * out = NULL;
+};
+
+// Decompressed block of the cache. The entries used by a view or a read have refs > 0 and are not replaced. A
+// detached entry is not part of the cache (it was full of used entries) and is freed by its last user.
+struct lzlib4_reader_cache_entry {
+    std::atomic<uint32_t> refs;
+    std::atomic<bool> checked;          // The CRC was already checked
+    int64_t block = -1;
+    uint8_t * data = NULL;
+    uint32_t size = 0;
+    uint64_t last_use = 0;
+    bool detached = false;
+
+    lzlib4_reader_cache_entry() : refs(0), checked(false) {}
+};
+
+// Prefetcher options
+struct lzlib4_prefetch_options {
+    size_t threads = 1;
+    size_t streams = 8;                 // Access streams tracked at the same time
+    size_t max_depth = 8;               // Maximum blocks predicted ahead of a stream
+    int64_t max_stride = 64;            // A bigger jump between blocks starts a new stream
+    size_t queue_size = 64;             // Pending blocks. The oldest predictions are dropped when it is full
+};
+
+// Access stream of the prefetcher. The stride is confirmed when two consecutive jumps are equal.
+struct lzlib4_prefetch_stream {
+    int64_t last = -1;
+    int64_t stride = 0;
+    uint32_t confidence = 0;
+    int64_t issued = -1;                // Furthest block already predicted
+    uint64_t last_use = 0;
+};
+
+// Reader statistics. The cache hits and misses only count the blocks requested by the callers.
+struct lzlib4_reader_stats {
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t shared_hits = 0;           // Cache misses found into the shared cache
+    uint64_t prefetch_issued = 0;
+    uint64_t prefetch_useful = 0;
+    size_t prefetch_depth = 0;
+};
+
+/**
+ * @brief Read only view of uncompressed data, returned by lzlib4_reader::view. The data points to a cached block
+ *        or directly to the stream (stored blocks), and it is valid until the view (and all its copies) are released
+ *        or destroyed. The reader must not be closed while there are views.
+ */
+class lzlib4_reader_view {
+    public:
+        lzlib4_reader_view();
+        lzlib4_reader_view(const lzlib4_reader_view &other);
+        lzlib4_reader_view & operator=(const lzlib4_reader_view &other);
+        ~lzlib4_reader_view();
+        const uint8_t * data() const;
+        size_t size() const;
+        void release();
+
+    private:
+        friend class lzlib4_reader;
+        lzlib4_reader_cache_entry * entry = NULL;
+        const uint8_t * view_data = NULL;
+        size_t view_size = 0;
+};
+
+class lzlib4_reader {
+    public:
+        lzlib4_reader();
+        ~lzlib4_reader();
+        int open(const uint8_t * data, size_t size);
+        int open(const char * path);
+        void close();
+        int read(uint64_t offset, uint8_t * out, size_t size, bool check_crc = false) const;
+        int view(uint64_t offset, size_t size, lzlib4_reader_view &view, bool check_crc = false) const;
+        int readv(const lzlib4_reader_range * ranges, size_t count, bool check_crc = false, size_t * blocks_read = NULL) const;
+        int set_cache(size_t blocks);
+        int set_threads(size_t threads, const lzlib4_pool_options &options = lzlib4_pool_options());
+        int set_shared_cache(lzlib4_shared_cache * shared, uint64_t image = 0);
+        int set_prefetch(bool enabled, const lzlib4_prefetch_options &options = lzlib4_prefetch_options());
+        lzlib4_reader_stats stats() const;
+        uint64_t size() const;
+        size_t blocks() const;
+        int block_info(size_t block, lzlib4_reader_block &info) const;
+
+    private:
+        int build_table_from_index();
+        int build_table_from_headers();
+        size_t find_block(uint64_t offset) const;
+        lzlib4_reader_scratch * take_scratch() const;
+        void release_scratch(lzlib4_reader_scratch * scratch) const;
+        int prepare_scratch(lzlib4_reader_scratch * scratch) const;
+        int decode_block(size_t block, lzlib4_reader_scratch * scratch, bool check_crc, const uint8_t ** data, uint8_t * out = NULL) const;
+        static void free_scratch(lzlib4_reader_scratch * scratch);
+        int pin_block(size_t block, lzlib4_reader_scratch * scratch, bool check_crc, const uint8_t ** data, lzlib4_reader_cache_entry ** entry, bool prefetch = false) const;
+        lzlib4_reader_cache_entry * cache_find(size_t block) const;
+        bool cache_contains(size_t block) const;
+        lzlib4_reader_cache_entry * cache_reserve() const;
+        void cache_publish(lzlib4_reader_cache_entry * entry, size_t block) const;
+        void free_cache();
+        void prefetch_access(size_t block) const;
+        void prefetch_loop();
+        void prefetch_drain();
+        void stop_prefetch();
+        uint64_t table_image_id();
+
+        // Compressed stream. The mapping is only used when the file was opened by the reader.
+        const uint8_t * stream = NULL;
+        size_t stream_size = 0;
+        void * mapping = NULL;
+        size_t mapping_size = 0;
+
+        std::vector<lzlib4_reader_block> table;
+        uint64_t uncompressed_size = 0;
+        uint32_t max_block_size = 0;
+        uint32_t max_compressed_size = 0;
+
+        mutable lzlib4_reader_scratch scratch_slots[LZLIB4_READER_SCRATCH_SLOTS];
+
+        // Decompressed blocks cache
+        lzlib4_reader_cache_entry * cache = NULL;
+        size_t cache_size = 0;
+        mutable std::mutex cache_mutex;
+        mutable std::unordered_map<size_t, lzlib4_reader_cache_entry *> cache_map;
+        mutable uint64_t cache_clock = 0;
+        mutable std::atomic<uint64_t> cache_hits;
+        mutable std::atomic<uint64_t> cache_misses;
+        mutable std::atomic<uint64_t> shared_hits;
+
+        // Shared cache tier. The image id is computed from the blocks table if it was not given.
+        lzlib4_shared_cache * shared_cache = NULL;
+        uint64_t shared_image = 0;
+        bool shared_image_auto = false;
+
+        // Workers used by readv to decompress the blocks
+        lzlib4_pool * pool = NULL;
+
+        // Prefetcher. The accuracy is measured every LZLIB4_PREFETCH_WINDOW predictions to change the depth.
+        bool prefetch_enabled = false;
+        lzlib4_prefetch_options prefetch_options;
+        std::vector<std::thread> prefetch_threads;
+        mutable std::mutex prefetch_mutex;
+        mutable std::condition_variable prefetch_ready;
+        mutable std::condition_variable prefetch_idle;
+        mutable std::deque<size_t> prefetch_queue;
+        mutable std::unordered_set<size_t> prefetch_pending;
+        mutable std::vector<lzlib4_prefetch_stream> prefetch_streams;
+        mutable uint64_t prefetch_clock = 0;
+        mutable size_t prefetch_depth = 0;
+        mutable uint64_t prefetch_issued = 0;
+        mutable uint64_t prefetch_useful = 0;
+        mutable uint32_t prefetch_window_issued = 0;
+        mutable uint32_t prefetch_window_useful = 0;
+        mutable uint32_t prefetch_paused = 0;
+        size_t prefetch_busy = 0;
+        bool prefetch_stopping = false;
+};
+
+#endif
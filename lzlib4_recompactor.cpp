@@ -0,0 +1,724 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_recompactor.h"
+#include "lzlib4_file_writer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+
+lzlib4_recompactor::lzlib4_recompactor() {
+}
+
+lzlib4_recompactor::~lzlib4_recompactor() {
+    close();
+}
+
+
+/**
+ * @brief Open a file written by lzlib4_file_writer
+ *
+ * @param path : File path
+ * @param options : Recompaction options
+ * @return int : LZLIB4_RC_OK if the file was opened, LZLIB4_RC_INDEX_ERROR if it is not a finished unordered
+ *               stream, or other negative number.
+ */
+int lzlib4_recompactor::open(const char * path, const lzlib4_recompact_options &options) {
+    close();
+
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    this->options = options;
+    counters = lzlib4_recompact_stats();
+    file = ::open(path, O_RDWR);
+    lz4 = LZ4_createStreamHC();
+    if (file < 0 || !lz4) {
+        close();
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    int return_code = load_index();
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = find_free_space();
+    }
+    if (return_code != LZLIB4_RC_OK) {
+        close();
+        return return_code;
+    }
+
+    opened = std::chrono::steady_clock::now();
+    last_access.assign(entries.size(), 0);
+    skipped.assign(entries.size(), false);
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+/**
+ * @brief Read the current index and the tier of every block
+ *
+ * @return int : LZLIB4_RC_OK if the index was loaded, negative number otherwise.
+ */
+int lzlib4_recompactor::load_index() {
+    uint8_t marker[sizeof(LZLIB4_BLOCK_HEADER) + LZLIB4_UNORDERED_SIZE];
+    int return_code = read_at(0, marker, sizeof(marker));
+    if (return_code != LZLIB4_RC_OK) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    LZLIB4_BLOCK_HEADER header;
+    memcpy(&header, marker, sizeof(header));
+    memcpy(&index_offset, marker + sizeof(header), sizeof(index_offset));
+    if (header.crc != LZLIB4_MARKER_UNORDERED || header.uncompressed_size || header.compressed_size != LZLIB4_UNORDERED_SIZE || !index_offset) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+
+    if (read_at(index_offset, (uint8_t *) &header, sizeof(header)) != LZLIB4_RC_OK || header.crc != LZLIB4_MARKER_INDEX) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+    index_size = sizeof(header) + (header.compressed_size & LZLIB4_BLOCK_SIZE_MASK);
+    end_offset = index_offset + index_size;
+
+    std::vector<uint8_t> index_data(index_size);
+    lzlib4_index_view index;
+    if (index_size < sizeof(header) + sizeof(index.trailer) || read_at(index_offset, index_data.data(), index_size) != LZLIB4_RC_OK) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+    memcpy(&index.trailer, index_data.data() + index_size - sizeof(index.trailer), sizeof(index.trailer));
+    if (
+        index.trailer.magic != LZLIB4_INDEX_MAGIC ||
+        index.trailer.index_offset != index_offset ||
+        index.trailer.records ||
+        sizeof(header) + (uint64_t) index.trailer.entries * sizeof(LZLIB4_INDEX_ENTRY) + sizeof(index.trailer) != index_size
+    ) {
+        return LZLIB4_RC_INDEX_ERROR;
+    }
+    index.entries = index_data.data() + sizeof(header);
+
+    entries.resize(index.trailer.entries);
+    tiers.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i] = lzlib4::index_entry(index, i);
+        if (
+            entries[i].offset + sizeof(header) + (entries[i].compressed_size & LZLIB4_BLOCK_SIZE_MASK) > index_offset ||
+            read_at(entries[i].offset, (uint8_t *) &header, sizeof(header)) != LZLIB4_RC_OK ||
+            header.compressed_size != entries[i].compressed_size
+        ) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+        tiers[i] = header.uncompressed_size >> LZLIB4_BLOCK_CHOICE_SHIFT;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Find the space of the file not used by the current generation: the replaced regions not released before
+ *        closing, and the holes of the released ones. It is released after the reclaim delay, because readers
+ *        opened before can still use it.
+ *
+ * @return int : LZLIB4_RC_OK if the file was checked, negative number otherwise.
+ */
+int lzlib4_recompactor::find_free_space() {
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    struct stat info;
+    if (fstat(file, &info) || (uint64_t) info.st_size < end_offset) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    end_offset = info.st_size;
+
+    // Used regions, sorted by offset: the marker, the blocks and the index
+    std::vector<lzlib4_recompact_region> used(entries.size() + 2);
+    used[0].size = sizeof(LZLIB4_BLOCK_HEADER) + LZLIB4_UNORDERED_SIZE;
+    for (size_t i = 0; i < entries.size(); i++) {
+        used[i + 1].offset = entries[i].offset;
+        used[i + 1].size = sizeof(LZLIB4_BLOCK_HEADER) + (entries[i].compressed_size & LZLIB4_BLOCK_SIZE_MASK);
+    }
+    used.back().offset = index_offset;
+    used.back().size = index_size;
+    std::sort(used.begin(), used.end(), [](const lzlib4_recompact_region &a, const lzlib4_recompact_region &b) {
+        return a.offset < b.offset;
+    });
+
+    lzlib4_recompact_region gap;
+    gap.released = std::chrono::steady_clock::now();
+    uint64_t position = 0;
+    for (size_t i = 0; i <= used.size(); i++) {
+        uint64_t next = i < used.size() ? used[i].offset : end_offset;
+        if (next < position) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+        if (next > position) {
+            gap.offset = position;
+            gap.size = next - position;
+            reclaim_regions.push_back(gap);
+        }
+        if (i < used.size()) {
+            position = used[i].offset + used[i].size;
+        }
+    }
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+int lzlib4_recompactor::read_at(uint64_t offset, uint8_t * data, size_t size) {
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    while (size) {
+        ssize_t readed = pread(file, data, size, offset);
+        if (readed <= 0) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        data += readed;
+        size -= readed;
+        offset += readed;
+    }
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+int lzlib4_recompactor::write_at(uint64_t offset, const uint8_t * data, size_t size) {
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    while (size) {
+        ssize_t written = pwrite(file, data, size, offset);
+        if (written <= 0) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+/**
+ * @brief Stop the background work, release the space whose reclaim delay is over and close the file. The rest of the
+ *        replaced regions are found again when the file is opened.
+ *
+ */
+void lzlib4_recompactor::close() {
+    stop();
+
+    if (file >= 0) {
+        reclaim(false);
+#ifndef _WIN32
+        ::close(file);
+#endif
+    }
+    file = -1;
+
+    if (lz4) {
+        LZ4_freeStreamHC(lz4);
+        lz4 = NULL;
+    }
+
+    entries.clear();
+    tiers.clear();
+    skipped.clear();
+    last_access.clear();
+    reclaim_regions.clear();
+    free_regions.clear();
+    block_buffer.clear();
+    data_buffer.clear();
+    compress_buffer.clear();
+    index_offset = 0;
+    index_size = 0;
+    end_offset = 0;
+}
+
+
+/**
+ * @brief Report an access to the uncompressed data. The accessed blocks are not recompacted until they are cold.
+ *        Can be called from any thread.
+ *
+ * @param offset : Uncompressed position
+ * @param size : Accessed size
+ */
+void lzlib4_recompactor::touch(uint64_t offset, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.empty()) {
+        return;
+    }
+
+    uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - opened).count();
+
+    // First block which starts after the offset, and then the previous one
+    size_t block = std::upper_bound(entries.begin(), entries.end(), offset, [](uint64_t value, const LZLIB4_INDEX_ENTRY &entry) {
+        return value < entry.uncompressed_offset;
+    }) - entries.begin();
+    block = block ? block - 1 : 0;
+
+    uint64_t end = offset + std::max(size, (size_t) 1);
+    for (; block < entries.size() && entries[block].uncompressed_offset < end; block++) {
+        last_access[block] = now;
+    }
+}
+
+
+/**
+ * @brief Recompress a fast block with LZ4HC and append it to the new blocks if it saves enough space
+ *
+ * @param block : Block number
+ * @param region : New blocks, which are placed into the file later
+ * @param entry : Index entry of the block. If the block is replaced, the offset is its position into the region.
+ * @return int : LZLIB4_RC_OK if the block was processed (replaced or not), negative number otherwise.
+ */
+int lzlib4_recompactor::recompress_block(size_t block, std::vector<uint8_t> &region, LZLIB4_INDEX_ENTRY &entry) {
+    size_t compressed_size = entry.compressed_size & LZLIB4_BLOCK_SIZE_MASK;
+    uint32_t flags = entry.compressed_size & ~LZLIB4_BLOCK_SIZE_MASK;
+    size_t size = entry.uncompressed_size;
+
+    block_buffer.resize(sizeof(LZLIB4_BLOCK_HEADER) + compressed_size);
+    int return_code = read_at(entry.offset, block_buffer.data(), block_buffer.size());
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    LZLIB4_BLOCK_HEADER header;
+    memcpy(&header, block_buffer.data(), sizeof(header));
+    const uint8_t * src = block_buffer.data() + sizeof(header);
+    if (header.compressed_size != entry.compressed_size || (header.uncompressed_size & LZLIB4_BLOCK_SIZE_MASK) != size) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    // The writer only creates independent blocks, stored or compressed with plain LZ4
+    if (!(flags & LZLIB4_BLOCK_FLAG_INDEPENDENT) || (flags & LZLIB4_BLOCK_FLAG_ENTROPY)) {
+        skipped[block] = true;
+        return LZLIB4_RC_OK;
+    }
+
+    data_buffer.resize(size);
+    if (flags & LZLIB4_BLOCK_FLAG_STORED) {
+        if (compressed_size != size) {
+            return LZLIB4_RC_BLOCK_DAMAGED;
+        }
+        memcpy(data_buffer.data(), src, size);
+    }
+    else if (LZ4_decompress_safe((const char *) src, (char *) data_buffer.data(), compressed_size, size) != (int) size) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+    if (lzlib4::crc32(data_buffer.data(), size) != header.crc) {
+        return LZLIB4_RC_BLOCK_DAMAGED;
+    }
+
+    compress_buffer.resize(LZ4_COMPRESSBOUND(size));
+    int compressed = LZ4_compress_HC_extStateHC(
+        lz4,
+        (const char *) data_buffer.data(),
+        (char *) compress_buffer.data(),
+        size,
+        compress_buffer.size(),
+        options.compression_level
+    );
+
+    // Keep the fast block if the new one is not small enough
+    if (compressed <= 0 || (uint64_t) compressed * 100 > (uint64_t) compressed_size * (100 - options.min_gain)) {
+        skipped[block] = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.blocks_kept++;
+        return LZLIB4_RC_OK;
+    }
+
+    LZLIB4_BLOCK_HEADER new_header = {
+        (uint32_t) compressed | LZLIB4_BLOCK_FLAG_INDEPENDENT, // compressed_size
+        (uint32_t) size | (LZLIB4_TIER_HC << LZLIB4_BLOCK_CHOICE_SHIFT), // uncompressed_size
+        header.crc // CRC
+    };
+
+    entry.offset = region.size();
+    entry.compressed_size = new_header.compressed_size;
+    region.insert(region.end(), (const uint8_t *) &new_header, (const uint8_t *) &new_header + sizeof(new_header));
+    region.insert(region.end(), compress_buffer.data(), compress_buffer.data() + compressed);
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Recompact the coldest fast blocks and switch to the new generation. Can be called directly or by the
+ *        background thread (see lzlib4_recompactor::start).
+ *
+ * @param max_blocks : Maximum blocks to recompress
+ * @param recompacted : Optional number of blocks replaced
+ * @return int : LZLIB4_RC_OK if the step was done, negative number otherwise.
+ */
+int lzlib4_recompactor::step(size_t max_blocks, size_t * recompacted) {
+    std::lock_guard<std::mutex> step_lock(step_mutex);
+    if (recompacted) {
+        *recompacted = 0;
+    }
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // The space released since the last step can be used by this one
+    reclaim(false);
+
+    // The coldest blocks first
+    std::vector<size_t> candidates;
+    std::vector<LZLIB4_INDEX_ENTRY> next_entries;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - opened).count();
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (tiers[i] == LZLIB4_TIER_FAST && !skipped[i] && now - last_access[i] >= options.cold_age_ms) {
+                candidates.push_back(i);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [this](size_t a, size_t b) {
+            return last_access[a] < last_access[b];
+        });
+        if (candidates.size() > max_blocks) {
+            candidates.resize(max_blocks);
+        }
+        next_entries = entries;
+    }
+
+    std::vector<uint8_t> region;
+    std::vector<size_t> replaced;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        size_t block = candidates[i];
+        size_t region_size = region.size();
+        int return_code = recompress_block(block, region, next_entries[block]);
+        if (return_code != LZLIB4_RC_OK) {
+            return return_code;
+        }
+        if (region.size() != region_size) {
+            replaced.push_back(block);
+        }
+    }
+
+    if (replaced.empty()) {
+        reclaim(false);
+        return LZLIB4_RC_OK;
+    }
+
+    // The new blocks go into the free space, and the new index after all the blocks, where the readers expect it.
+    // The allocated space is not returned on errors, because the marker could point to it. It is found again when
+    // the file is opened.
+    std::vector<uint64_t> region_offsets(replaced.size());
+    std::vector<uint8_t> index_data;
+    uint64_t new_index_offset = 0;
+    int return_code;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < replaced.size(); i++) {
+            LZLIB4_INDEX_ENTRY &entry = next_entries[replaced[i]];
+            region_offsets[i] = entry.offset;
+            entry.offset = allocate(sizeof(LZLIB4_BLOCK_HEADER) + (entry.compressed_size & LZLIB4_BLOCK_SIZE_MASK), 0);
+        }
+
+        uint64_t blocks_end = 0;
+        for (size_t i = 0; i < next_entries.size(); i++) {
+            blocks_end = std::max(blocks_end, next_entries[i].offset + sizeof(LZLIB4_BLOCK_HEADER) + (next_entries[i].compressed_size & LZLIB4_BLOCK_SIZE_MASK));
+        }
+
+        // The index size doesn't depend on its position
+        return_code = lzlib4_file_writer::index_block(next_entries, 0, index_data);
+        if (return_code == LZLIB4_RC_OK) {
+            new_index_offset = allocate(index_data.size(), blocks_end);
+            return_code = lzlib4_file_writer::index_block(next_entries, new_index_offset, index_data);
+        }
+    }
+
+    // The data must be on disk before the switch, and the switch before the old space is released, so a crash never
+    // leaves the marker pointing to garbage or to a released region.
+    for (size_t i = 0; i < replaced.size() && return_code == LZLIB4_RC_OK; i++) {
+        const LZLIB4_INDEX_ENTRY &entry = next_entries[replaced[i]];
+        return_code = write_at(
+            entry.offset,
+            region.data() + region_offsets[i],
+            sizeof(LZLIB4_BLOCK_HEADER) + (entry.compressed_size & LZLIB4_BLOCK_SIZE_MASK)
+        );
+    }
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = write_at(new_index_offset, index_data.data(), index_data.size());
+    }
+#ifndef _WIN32
+    if (return_code == LZLIB4_RC_OK && fdatasync(file)) {
+        return_code = LZLIB4_RC_BUFFER_ERROR;
+    }
+#endif
+    if (return_code == LZLIB4_RC_OK) {
+        return_code = write_at(sizeof(LZLIB4_BLOCK_HEADER), (const uint8_t *) &new_index_offset, sizeof(new_index_offset));
+    }
+#ifndef _WIN32
+    if (return_code == LZLIB4_RC_OK && fdatasync(file)) {
+        return_code = LZLIB4_RC_BUFFER_ERROR;
+    }
+#endif
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        // The replaced blocks and the previous index are released later
+        lzlib4_recompact_region old;
+        old.released = now;
+        for (size_t i = 0; i < replaced.size(); i++) {
+            size_t block = replaced[i];
+            old.offset = entries[block].offset;
+            old.size = sizeof(LZLIB4_BLOCK_HEADER) + (entries[block].compressed_size & LZLIB4_BLOCK_SIZE_MASK);
+            reclaim_regions.push_back(old);
+
+            counters.bytes_before += old.size;
+            counters.bytes_after += sizeof(LZLIB4_BLOCK_HEADER) + (next_entries[block].compressed_size & LZLIB4_BLOCK_SIZE_MASK);
+            tiers[block] = LZLIB4_TIER_HC;
+        }
+        old.offset = index_offset;
+        old.size = index_size;
+        reclaim_regions.push_back(old);
+
+        entries.swap(next_entries);
+        index_offset = new_index_offset;
+        index_size = index_data.size();
+        counters.generations++;
+        counters.blocks_recompacted += replaced.size();
+    }
+
+    if (recompacted) {
+        *recompacted = replaced.size();
+    }
+    reclaim(false);
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Take space for a new block or index: the first free region where it fits, or the end of the file.
+ *        Called with the mutex locked.
+ *
+ * @param size : Size required
+ * @param min_offset : The space must start at this position or after it
+ * @return uint64_t : Position of the space
+ */
+uint64_t lzlib4_recompactor::allocate(uint64_t size, uint64_t min_offset) {
+    for (size_t i = 0; i < free_regions.size(); i++) {
+        lzlib4_recompact_region &region = free_regions[i];
+        uint64_t start = std::max(region.offset, min_offset);
+        if (start >= region.offset + region.size || region.offset + region.size - start < size) {
+            continue;
+        }
+
+        // Split the region, keeping the free space before and after
+        lzlib4_recompact_region after = region;
+        after.offset = start + size;
+        after.size = region.offset + region.size - after.offset;
+        region.size = start - region.offset;
+
+        if (!region.size) {
+            free_regions.erase(free_regions.begin() + i);
+            i--;
+        }
+        if (after.size) {
+            free_regions.insert(free_regions.begin() + i + 1, after);
+        }
+
+        return start;
+    }
+
+    uint64_t start = std::max(end_offset, min_offset);
+    end_offset = start + size;
+
+    return start;
+}
+
+
+/**
+ * @brief Add a region to the free space, joining it with the adjacent ones. The free space at the end of the file is
+ *        removed from the file. Called with the mutex locked.
+ *
+ * @param offset : Region position
+ * @param size : Region size
+ */
+void lzlib4_recompactor::release(uint64_t offset, uint64_t size) {
+    lzlib4_recompact_region region;
+    region.offset = offset;
+    region.size = size;
+
+    auto position = std::upper_bound(free_regions.begin(), free_regions.end(), region, [](const lzlib4_recompact_region &a, const lzlib4_recompact_region &b) {
+        return a.offset < b.offset;
+    });
+    position = free_regions.insert(position, region);
+
+    // Join with the next and the previous regions
+    if (position + 1 != free_regions.end() && position->offset + position->size == (position + 1)->offset) {
+        position->size += (position + 1)->size;
+        free_regions.erase(position + 1);
+    }
+    if (position != free_regions.begin() && (position - 1)->offset + (position - 1)->size == position->offset) {
+        (position - 1)->size += position->size;
+        position = free_regions.erase(position) - 1;
+    }
+
+    if (!free_regions.empty() && free_regions.back().offset + free_regions.back().size == end_offset) {
+#ifndef _WIN32
+        if (!ftruncate(file, free_regions.back().offset)) {
+            end_offset = free_regions.back().offset;
+            free_regions.pop_back();
+        }
+#endif
+    }
+}
+
+
+/**
+ * @brief Release the space of the replaced regions whose reclaim delay is over. The holes keep the position of the
+ *        other blocks, and the filesystem frees the space. Then the regions can be used by the next generations.
+ *
+ * @param all : Release all the regions, without waiting the reclaim delay
+ */
+void lzlib4_recompactor::reclaim(bool all) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < reclaim_regions.size(); i++) {
+        lzlib4_recompact_region &region = reclaim_regions[i];
+        if (!all && now - region.released < std::chrono::milliseconds(options.reclaim_delay_ms)) {
+            reclaim_regions[kept++] = region;
+            continue;
+        }
+
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        if (!fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, region.offset, region.size)) {
+            counters.bytes_reclaimed += region.size;
+        }
+#endif
+        release(region.offset, region.size);
+    }
+    reclaim_regions.resize(kept);
+}
+
+
+/**
+ * @brief Check if the CPU is idle enough to run a background step
+ *
+ * @return bool
+ */
+bool lzlib4_recompactor::idle() {
+#ifdef _WIN32
+    return true;
+#else
+    double load;
+    if (getloadavg(&load, 1) != 1) {
+        return true;
+    }
+
+    return load < options.max_load * std::max(std::thread::hardware_concurrency(), 1u);
+#endif
+}
+
+
+/**
+ * @brief Start the background recompaction. A step is done every interval_ms while the CPU is idle.
+ *
+ * @return int : LZLIB4_RC_OK if the thread is running, negative number otherwise.
+ */
+int lzlib4_recompactor::start() {
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    if (worker.joinable()) {
+        return LZLIB4_RC_OK;
+    }
+
+    stopping = false;
+    worker = std::thread(&lzlib4_recompactor::background_loop, this);
+
+    return LZLIB4_RC_OK;
+}
+
+
+/**
+ * @brief Stop the background recompaction, waiting for the current step
+ *
+ */
+void lzlib4_recompactor::stop() {
+    if (!worker.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+
+void lzlib4_recompactor::background_loop() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait_for(lock, std::chrono::milliseconds(options.interval_ms), [this] { return stopping; });
+            if (stopping) {
+                return;
+            }
+        }
+
+        if (idle()) {
+            step(options.batch_blocks);
+        }
+        else {
+            reclaim(false);
+        }
+    }
+}
+
+
+/**
+ * @brief Recompaction statistics
+ *
+ * @return lzlib4_recompact_stats
+ */
+lzlib4_recompact_stats lzlib4_recompactor::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    lzlib4_recompact_stats stats = counters;
+    stats.file_size = end_offset;
+
+    return stats;
+}
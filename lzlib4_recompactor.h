@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Background recompaction of the files written by lzlib4_file_writer.
+ *
+ * The files can be written quickly with the fast LZ4 compressor (lzlib4_file_writer_options::acceleration), and the
+ * recompactor compresses again the cold blocks with LZ4HC when the CPU is idle. Every step is a new generation:
+ *  - The recompressed blocks are written into the free space of the file (or at the end), followed by a new index,
+ *    which is always placed after all the blocks. The current index and blocks are never overwritten.
+ *  - The data is synced, and then the position of the index in the LZLIB4_MARKER_UNORDERED block is replaced and
+ *    synced, which is the atomic switch to the new generation. Until then the readers use the previous index, which
+ *    is still valid.
+ *  - The space of the replaced blocks and of the previous index is released (punching holes, so the positions of the
+ *    other blocks don't change) after reclaim_delay_ms, to give time to the readers opened before the switch. Then
+ *    it is free space for the next generations, and the free space at the end of the file is truncated.
+ *
+ * The free space is not stored into the file. When a file is opened, the space not used by the current generation
+ * is found again, and it is released after reclaim_delay_ms like the replaced regions.
+ *
+ * The blocks accessed recently are not recompacted. The accesses are reported with touch(), usually from the code
+ * that reads the file. The file must not be written by other process while the recompactor is open.
+ **/
+
+#ifndef LZLIB4_RECOMPACTOR_H
+#define LZLIB4_RECOMPACTOR_H
+
+#include "lzlib4.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct lzlib4_recompact_options {
+    int8_t compression_level = LZ4HC_CLEVEL_MAX;
+    // Time without accesses to consider a block cold
+    uint32_t cold_age_ms = 60000;
+    // Blocks recompressed by every background step
+    size_t batch_blocks = 64;
+    // Time between the background steps
+    uint32_t interval_ms = 1000;
+    // The background steps only run when the load average is lower than this value per CPU
+    double max_load = 0.5;
+    // Minimum saving (in percent of the fast block) to replace a block
+    uint8_t min_gain = 1;
+    // Time before releasing the space of the replaced blocks
+    uint32_t reclaim_delay_ms = 10000;
+};
+
+struct lzlib4_recompact_stats {
+    uint64_t generations = 0;
+    uint64_t blocks_recompacted = 0;
+    uint64_t blocks_kept = 0;           // Fast blocks which didn't save enough
+    uint64_t bytes_before = 0;          // Compressed size of the replaced blocks
+    uint64_t bytes_after = 0;
+    uint64_t bytes_reclaimed = 0;
+    uint64_t file_size = 0;
+};
+
+// File region waiting to be released
+struct lzlib4_recompact_region {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    std::chrono::steady_clock::time_point released;
+};
+
+class lzlib4_recompactor {
+    public:
+        lzlib4_recompactor();
+        ~lzlib4_recompactor();
+        int open(const char * path, const lzlib4_recompact_options &options = lzlib4_recompact_options());
+        void close();
+        void touch(uint64_t offset, size_t size);
+        int step(size_t max_blocks, size_t * recompacted = NULL);
+        int start();
+        void stop();
+        lzlib4_recompact_stats stats();
+
+    private:
+        int load_index();
+        int find_free_space();
+        int recompress_block(size_t block, std::vector<uint8_t> &region, LZLIB4_INDEX_ENTRY &entry);
+        uint64_t allocate(uint64_t size, uint64_t min_offset);
+        void release(uint64_t offset, uint64_t size);
+        int read_at(uint64_t offset, uint8_t * data, size_t size);
+        int write_at(uint64_t offset, const uint8_t * data, size_t size);
+        void reclaim(bool all);
+        bool idle();
+        void background_loop();
+
+        int file = -1;
+        lzlib4_recompact_options options;
+
+        // Current generation. The index is at index_offset (after all the blocks), and the file ends at end_offset.
+        std::vector<LZLIB4_INDEX_ENTRY> entries;
+        std::vector<uint8_t> tiers;
+        std::vector<bool> skipped;
+        uint64_t index_offset = 0;
+        uint64_t index_size = 0;
+        uint64_t end_offset = 0;
+
+        // Block accesses, in milliseconds from open()
+        std::vector<uint64_t> last_access;
+        std::chrono::steady_clock::time_point opened;
+
+        std::vector<lzlib4_recompact_region> reclaim_regions;
+        // Space released, sorted by offset and without adjacent regions
+        std::vector<lzlib4_recompact_region> free_regions;
+        lzlib4_recompact_stats counters;
+        LZ4_streamHC_t * lz4 = NULL;
+        std::vector<uint8_t> block_buffer;
+        std::vector<uint8_t> data_buffer;
+        std::vector<uint8_t> compress_buffer;
+
+        // The mutex protects the access information, the space lists and the stats. Only one step runs at a time.
+        std::mutex mutex;
+        std::mutex step_mutex;
+        std::thread worker;
+        std::condition_variable wake;
+        bool stopping = false;
+};
+
+#endif
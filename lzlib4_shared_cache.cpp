@@ -0,0 +1,522 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_shared_cache.h"
+#include "lzlib4.h"
+#include <string.h>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+lzlib4_shared_cache::lzlib4_shared_cache() {
+}
+
+lzlib4_shared_cache::~lzlib4_shared_cache() {
+    close();
+}
+
+
+/**
+ * @brief Create a shared cache, or attach to an existing one with the same name. Without name, an anonymous memfd
+ *        is created, and the other processes can attach to it with open_fd (see lzlib4_shared_cache::fd).
+ *        The named segments are kept until they are removed with shm_unlink.
+ *
+ * @param name : POSIX shared memory name (like "/lzlib4_cache"), or NULL for an anonymous memfd
+ * @param slots : Number of blocks. Rounded up to a multiple of LZLIB4_SHARED_WAYS. Ignored if the cache exists.
+ * @param slot_size : Maximum block size. Ignored if the cache exists.
+ * @return int : LZLIB4_RC_OK if the cache is ready, negative number otherwise.
+ */
+int lzlib4_shared_cache::open(const char * name, size_t slots, size_t slot_size) {
+    close();
+
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    if (!slots || !slot_size) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+    slots = (slots + LZLIB4_SHARED_WAYS - 1) / LZLIB4_SHARED_WAYS * LZLIB4_SHARED_WAYS;
+
+    int file;
+    bool create = true;
+    if (name) {
+        file = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (file < 0 && errno == EEXIST) {
+            file = shm_open(name, O_RDWR, 0600);
+            create = false;
+        }
+    }
+    else {
+#ifdef __linux__
+        file = memfd_create("lzlib4_shared_cache", 0);
+#else
+        return LZLIB4_RC_BUFFER_ERROR;
+#endif
+    }
+    if (file < 0) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    // The slots table is followed by the data, aligned to the page size
+    size_t data_offset = sizeof(lzlib4_shared_header) + slots * sizeof(lzlib4_shared_slot);
+    data_offset = (data_offset + 4095) / 4096 * 4096;
+    size_t size = data_offset + slots * slot_size;
+
+    if (create && ftruncate(file, size)) {
+        ::close(file);
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    int return_code = map(file, create ? size : 0, create, slots, slot_size);
+    if (return_code != LZLIB4_RC_OK) {
+        ::close(file);
+        return return_code;
+    }
+
+    return LZLIB4_RC_OK;
+#endif
+}
+
+
+/**
+ * @brief Attach to a shared cache created by other process. The cache takes the descriptor and closes it.
+ *
+ * @param fd : Shared memory file descriptor
+ * @return int : LZLIB4_RC_OK if the cache is ready, negative number otherwise.
+ */
+int lzlib4_shared_cache::open_fd(int fd) {
+    close();
+
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    int return_code = map(fd, 0, false, 0, 0);
+    if (return_code != LZLIB4_RC_OK) {
+        ::close(fd);
+    }
+
+    return return_code;
+#endif
+}
+
+
+/**
+ * @brief Map the segment and register the process
+ *
+ * @param fd : Segment file descriptor
+ * @param size : Segment size. 0 to take it from the file.
+ * @param create : Initialize the segment header
+ * @param slots : Number of slots of a new segment
+ * @param slot_size : Slot size of a new segment
+ * @return int : LZLIB4_RC_OK if the segment was mapped, negative number otherwise.
+ */
+int lzlib4_shared_cache::map(int fd, size_t size, bool create, size_t slots, size_t slot_size) {
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    // The creator can be still resizing the segment
+    for (int i = 0; !size && i < 1000; i++) {
+        struct stat file_stat;
+        if (fstat(fd, &file_stat)) {
+            return LZLIB4_RC_BUFFER_ERROR;
+        }
+        size = file_stat.st_size;
+        if (!size) {
+            usleep(1000);
+        }
+    }
+    if (size < sizeof(lzlib4_shared_header)) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    segment_fd = fd;
+    segment = data;
+    segment_size = size;
+    header = (lzlib4_shared_header *) data;
+
+    if (create) {
+        header->magic = LZLIB4_SHARED_MAGIC;
+        header->version = LZLIB4_SHARED_VERSION;
+        header->ways = LZLIB4_SHARED_WAYS;
+        header->slots = slots;
+        header->slot_size = slot_size;
+        header->data_offset = (sizeof(lzlib4_shared_header) + slots * sizeof(lzlib4_shared_slot) + 4095) / 4096 * 4096;
+        header->initialized.store(1);
+    }
+    else {
+        for (int i = 0; !header->initialized.load() && i < 1000; i++) {
+            usleep(1000);
+        }
+    }
+
+    if (
+        !header->initialized.load() ||
+        header->magic != LZLIB4_SHARED_MAGIC ||
+        header->version != LZLIB4_SHARED_VERSION ||
+        header->ways != LZLIB4_SHARED_WAYS ||
+        !header->slots ||
+        header->data_offset + header->slots * header->slot_size > segment_size
+    ) {
+        munmap(segment, segment_size);
+        segment_fd = -1;
+        segment = NULL;
+        segment_size = 0;
+        header = NULL;
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    int return_code = register_process();
+    if (return_code != LZLIB4_RC_OK) {
+        munmap(segment, segment_size);
+        segment_fd = -1;
+        segment = NULL;
+        segment_size = 0;
+        header = NULL;
+    }
+
+    return return_code;
+#endif
+}
+
+
+/**
+ * @brief Take a process entry, after releasing the entries of the dead processes
+ *
+ * @return int : LZLIB4_RC_OK if the process was registered, negative number otherwise.
+ */
+int lzlib4_shared_cache::register_process() {
+#ifdef _WIN32
+    return LZLIB4_RC_BUFFER_ERROR;
+#else
+    int32_t pid = getpid();
+
+    release_dead_processes();
+
+    for (int i = 0; i < LZLIB4_SHARED_MAX_PROCESSES; i++) {
+        int32_t expected = 0;
+        if (header->processes[i].compare_exchange_strong(expected, pid)) {
+            process = i;
+            return LZLIB4_RC_OK;
+        }
+    }
+
+    return LZLIB4_RC_BUFFER_ERROR;
+#endif
+}
+
+
+/**
+ * @brief Release the process entries of the processes which don't exist anymore. Their pins are cleared and the
+ *        slots they were filling are freed, so a process which dies into get or put doesn't keep its slots forever.
+ *
+ * @return bool : true if any entry was released
+ */
+bool lzlib4_shared_cache::release_dead_processes() {
+#ifdef _WIN32
+    return false;
+#else
+    bool released = false;
+
+    for (int i = 0; i < LZLIB4_SHARED_MAX_PROCESSES; i++) {
+        int32_t old_pid = header->processes[i].load();
+        if (old_pid <= 0 || !kill(old_pid, 0) || errno != ESRCH) {
+            continue;
+        }
+
+        // The entry is kept reserved until the slots are released, so no other process can take it meanwhile
+        if (!header->processes[i].compare_exchange_strong(old_pid, LZLIB4_SHARED_RELEASING)) {
+            continue;
+        }
+
+        uint32_t filling = LZLIB4_SHARED_FILLING + ((uint32_t) i << LZLIB4_SHARED_OWNER_SHIFT);
+        for (uint64_t s = 0; s < header->slots; s++) {
+            lzlib4_shared_slot * current = slot(s);
+            current->pins[i].store(0);
+            uint32_t expected = filling;
+            current->state.compare_exchange_strong(expected, LZLIB4_SHARED_FREE);
+        }
+
+        header->processes[i].store(0);
+        released = true;
+    }
+
+    return released;
+#endif
+}
+
+
+/**
+ * @brief Detach from the shared cache. The blocks are kept for the other processes.
+ *
+ */
+void lzlib4_shared_cache::close() {
+#ifndef _WIN32
+    if (header && process >= 0) {
+        header->processes[process].store(0);
+    }
+    if (segment) {
+        munmap(segment, segment_size);
+    }
+    if (segment_fd >= 0) {
+        ::close(segment_fd);
+    }
+#endif
+
+    segment_fd = -1;
+    segment = NULL;
+    segment_size = 0;
+    header = NULL;
+    process = -1;
+}
+
+
+/**
+ * @brief Descriptor of the shared memory segment, which can be passed to other processes
+ *
+ * @return int : File descriptor, or -1 if the cache is not open
+ */
+int lzlib4_shared_cache::fd() const {
+    return segment_fd;
+}
+
+
+size_t lzlib4_shared_cache::slot_size() const {
+    return header ? header->slot_size : 0;
+}
+
+
+lzlib4_shared_slot * lzlib4_shared_cache::slot(uint64_t index) {
+    return (lzlib4_shared_slot *) ((uint8_t *) segment + sizeof(lzlib4_shared_header)) + index;
+}
+
+
+uint8_t * lzlib4_shared_cache::slot_data(uint64_t index) {
+    return (uint8_t *) segment + header->data_offset + index * header->slot_size;
+}
+
+
+/**
+ * @brief First slot of the set where a block can be stored
+ *
+ * @param image : Image id
+ * @param block : Block number
+ * @return uint64_t
+ */
+uint64_t lzlib4_shared_cache::first_slot(uint64_t image, uint64_t block) {
+    uint64_t hash = image * 0x9E3779B97F4A7C15ULL ^ (block + 1) * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    uint64_t sets = header->slots / LZLIB4_SHARED_WAYS;
+
+    return (hash % sets) * LZLIB4_SHARED_WAYS;
+}
+
+
+/**
+ * @brief Check if a claimed slot can be replaced, which means that no process has it pinned
+ *
+ * @param slot : Slot already changed to LZLIB4_SHARED_FILLING
+ * @return bool
+ */
+bool lzlib4_shared_cache::claimable(lzlib4_shared_slot * slot) {
+    for (int i = 0; i < LZLIB4_SHARED_MAX_PROCESSES; i++) {
+        if (slot->pins[i].load()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Copy a block from the shared cache
+ *
+ * @param image : Image id (see lzlib4_shared_cache::image_id)
+ * @param block : Block number
+ * @param out : Output buffer
+ * @param capacity : Output buffer size
+ * @param size : Block size
+ * @return bool : true if the block was found
+ */
+bool lzlib4_shared_cache::get(uint64_t image, uint64_t block, uint8_t * out, size_t capacity, size_t * size) {
+    if (!header) {
+        return false;
+    }
+
+    uint64_t first = first_slot(image, block);
+    for (uint64_t i = first; i < first + LZLIB4_SHARED_WAYS; i++) {
+        lzlib4_shared_slot * current = slot(i);
+        if (current->state.load() != LZLIB4_SHARED_READY || current->image.load() != image || current->block.load() != block) {
+            continue;
+        }
+
+        // The slot is checked again after pinning it, because it could be replaced meanwhile
+        current->pins[process]++;
+        bool found = current->state.load() == LZLIB4_SHARED_READY &&
+            current->image.load() == image &&
+            current->block.load() == block &&
+            current->size.load() <= capacity;
+        if (found) {
+            *size = current->size.load();
+            memcpy(out, slot_data(i), *size);
+            current->last_use.store(++header->clock);
+        }
+        current->pins[process]--;
+
+        if (found) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief Claim a slot of a set to store a block: a free slot, or else the least recently used ready slot which is not
+ *        in use. The slot is left into the filling state of this process.
+ *
+ * @param first : First slot of the set
+ * @param index : Claimed slot
+ * @return bool : true if a slot was claimed
+ */
+bool lzlib4_shared_cache::claim_slot(uint64_t first, uint64_t * index) {
+    uint32_t filling = LZLIB4_SHARED_FILLING + ((uint32_t) process << LZLIB4_SHARED_OWNER_SHIFT);
+
+    // Free slots first
+    for (uint64_t i = first; i < first + LZLIB4_SHARED_WAYS; i++) {
+        uint32_t expected = LZLIB4_SHARED_FREE;
+        if (slot(i)->state.compare_exchange_strong(expected, filling)) {
+            *index = i;
+            return true;
+        }
+    }
+
+    // Then the least recently used ready slot
+    uint64_t order[LZLIB4_SHARED_WAYS];
+    for (uint64_t i = 0; i < LZLIB4_SHARED_WAYS; i++) {
+        order[i] = first + i;
+    }
+    std::sort(order, order + LZLIB4_SHARED_WAYS, [this](uint64_t a, uint64_t b) {
+        return slot(a)->last_use.load() < slot(b)->last_use.load();
+    });
+
+    for (uint64_t i = 0; i < LZLIB4_SHARED_WAYS; i++) {
+        lzlib4_shared_slot * current = slot(order[i]);
+        uint32_t expected = LZLIB4_SHARED_READY;
+        if (!current->state.compare_exchange_strong(expected, filling)) {
+            continue;
+        }
+        if (claimable(current)) {
+            *index = order[i];
+            return true;
+        }
+        current->state.store(LZLIB4_SHARED_READY);
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief Store a block into the shared cache, replacing the least recently used slot of its set which is not in use
+ *
+ * @param image : Image id (see lzlib4_shared_cache::image_id)
+ * @param block : Block number
+ * @param data : Block data
+ * @param size : Block size
+ * @return bool : true if the block is into the cache
+ */
+bool lzlib4_shared_cache::put(uint64_t image, uint64_t block, const uint8_t * data, size_t size) {
+    if (!header || size > header->slot_size) {
+        return false;
+    }
+
+    uint64_t first = first_slot(image, block);
+
+    // Other process could have stored it already
+    for (uint64_t i = first; i < first + LZLIB4_SHARED_WAYS; i++) {
+        lzlib4_shared_slot * current = slot(i);
+        if (current->state.load() == LZLIB4_SHARED_READY && current->image.load() == image && current->block.load() == block) {
+            return true;
+        }
+    }
+
+    uint64_t taken_index;
+    if (!claim_slot(first, &taken_index)) {
+        // The whole set is in use, but a dead process could be keeping some slots
+        if (!release_dead_processes() || !claim_slot(first, &taken_index)) {
+            return false;
+        }
+    }
+    lzlib4_shared_slot * taken = slot(taken_index);
+
+    taken->image.store(image);
+    taken->block.store(block);
+    taken->size.store(size);
+    memcpy(slot_data(taken_index), data, size);
+    taken->last_use.store(++header->clock);
+    taken->state.store(LZLIB4_SHARED_READY);
+
+    return true;
+}
+
+
+/**
+ * @brief Identifier of a compressed image, from the header of every block (sizes, flags and CRC, in the order of
+ *        the uncompressed data) and the stream size. Any change of a block changes its CRC, so two images only share
+ *        the id if all their blocks are the same, with or without index.
+ *
+ * @param headers : Block headers, in the order of the uncompressed data
+ * @param count : Number of blocks
+ * @param stream_size : Compressed stream size
+ * @return uint64_t
+ */
+uint64_t lzlib4_shared_cache::image_id(const LZLIB4_BLOCK_HEADER * headers, size_t count, uint64_t stream_size) {
+    // FNV-1a over the header fields
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    auto mix = [&hash](uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            hash ^= (value >> (i * 8)) & 0xFF;
+            hash *= 0x100000001B3ULL;
+        }
+    };
+
+    mix(stream_size);
+    mix(count);
+    for (size_t i = 0; i < count; i++) {
+        mix(((uint64_t) headers[i].compressed_size << 32) | headers[i].uncompressed_size);
+        mix(headers[i].crc);
+    }
+
+    return hash;
+}
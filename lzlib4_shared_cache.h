@@ -0,0 +1,115 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Decompressed blocks cache shared between processes.
+ *
+ * The cache is a shared memory segment (POSIX shm with a name, or an anonymous memfd that is inherited or passed to
+ * the other processes) divided in slots of the same size. Every slot keeps a block, identified by an image id and
+ * the block number, and the slots are grouped in sets of LZLIB4_SHARED_WAYS: a block can only be stored into the
+ * set selected by its hash, replacing the least recently used slot of the set.
+ *
+ * There are no locks. A slot is claimed changing its state with a compare and swap, and every process has its own
+ * pin counter into every slot. A process pins the slot before reading it and checks the slot again after that, and a
+ * writer only takes a ready slot if all the pin counters are 0 after claiming it, so a slot is never replaced while
+ * it is being readed. The state of a slot being filled keeps the process entry of the writer, so the entries of the
+ * dead processes can be released together with their pins and their unfinished slots. That is done every time a
+ * process is registered, and when a block can't be stored because its whole set is in use.
+ *
+ * The slots store small atomics and plain data, so all the processes must be built for the same architecture.
+ **/
+
+#ifndef LZLIB4_SHARED_CACHE_H
+#define LZLIB4_SHARED_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "lzlib4.h"
+
+#define LZLIB4_SHARED_MAGIC 0x4853344C          // "L4SH"
+#define LZLIB4_SHARED_VERSION 2
+// Processes attached at the same time
+#define LZLIB4_SHARED_MAX_PROCESSES 64
+// Slots of every set
+#define LZLIB4_SHARED_WAYS 8
+
+// A slot being filled has the state LZLIB4_SHARED_FILLING + (process entry << LZLIB4_SHARED_OWNER_SHIFT)
+enum lzlib4_shared_slot_state : uint32_t {
+    LZLIB4_SHARED_FREE = 0,
+    LZLIB4_SHARED_FILLING,
+    LZLIB4_SHARED_READY,
+};
+#define LZLIB4_SHARED_OWNER_SHIFT 8
+// Process entry of a dead process while its slots are released
+#define LZLIB4_SHARED_RELEASING -1
+
+// Segment header. A new segment is filled with zeros, so "initialized" is set when the header is complete.
+struct lzlib4_shared_header {
+    std::atomic<uint32_t> initialized;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ways;
+    uint64_t slots;
+    uint64_t slot_size;
+    uint64_t data_offset;
+    std::atomic<uint64_t> clock;
+    std::atomic<int32_t> processes[LZLIB4_SHARED_MAX_PROCESSES];
+};
+
+struct lzlib4_shared_slot {
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> size;
+    std::atomic<uint64_t> image;
+    std::atomic<uint64_t> block;
+    std::atomic<uint64_t> last_use;
+    std::atomic<uint32_t> pins[LZLIB4_SHARED_MAX_PROCESSES];
+};
+
+class lzlib4_shared_cache {
+    public:
+        lzlib4_shared_cache();
+        ~lzlib4_shared_cache();
+        int open(const char * name, size_t slots, size_t slot_size);
+        int open_fd(int fd);
+        void close();
+        int fd() const;
+        size_t slot_size() const;
+        bool get(uint64_t image, uint64_t block, uint8_t * out, size_t capacity, size_t * size);
+        bool put(uint64_t image, uint64_t block, const uint8_t * data, size_t size);
+        static uint64_t image_id(const LZLIB4_BLOCK_HEADER * headers, size_t count, uint64_t stream_size);
+
+    private:
+        int map(int fd, size_t size, bool create, size_t slots, size_t slot_size);
+        int register_process();
+        bool release_dead_processes();
+        bool claim_slot(uint64_t first, uint64_t * index);
+        lzlib4_shared_slot * slot(uint64_t index);
+        uint8_t * slot_data(uint64_t index);
+        uint64_t first_slot(uint64_t image, uint64_t block);
+        bool claimable(lzlib4_shared_slot * slot);
+
+        int segment_fd = -1;
+        void * segment = NULL;
+        size_t segment_size = 0;
+        lzlib4_shared_header * header = NULL;
+        int process = -1;
+};
+
+#endif
@@ -0,0 +1,230 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lzlib4_streambuf.h"
+#include <algorithm>
+
+
+/**
+ * @brief Attach the stream buffer to a compressor
+ *
+ * @param compressor : lzlib4 object created for compression
+ * @param sink : Stream buffer where the compressed data will be written
+ */
+lzlib4_ostreambuf::lzlib4_ostreambuf(lzlib4 &compressor, std::streambuf * sink) : compressor(compressor), sink(sink) {
+    reset_put_area();
+}
+
+lzlib4_ostreambuf::~lzlib4_ostreambuf() {
+    finish();
+}
+
+
+/**
+ * @brief Compress the buffered data and finish the compressed stream (LZLIB4_FINISH). The stream buffer can be used
+ *        again after that to write a new compressed stream.
+ *
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4_ostreambuf::finish() {
+    if (error != LZLIB4_RC_OK) {
+        return error;
+    }
+
+    // Nothing was written since the last finish
+    lzlib4_internal_state &state = compressor.strm.state;
+    if (!pptr() || (pptr() == (char *) state.compress_in_buffer && !state.compress_total_out && !state.reorder_count)) {
+        return LZLIB4_RC_OK;
+    }
+
+    int return_code = compress_buffer(LZLIB4_FINISH);
+    if (return_code == LZLIB4_RC_OK && sink->pubsync() != 0) {
+        return_code = LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    error = return_code;
+    return return_code;
+}
+
+
+/**
+ * @brief Last error returned by the compressor or by the sink
+ *
+ * @return int : LZLIB4_RC_OK if there was no error, negative number otherwise.
+ */
+int lzlib4_ostreambuf::last_error() {
+    return error;
+}
+
+
+/**
+ * @brief Called when the put area (the compression buffer) is full. The block is compressed and the buffer is
+ *        used again.
+ *
+ * @param ch : Character that didn't fit into the buffer
+ * @return int_type : ch, or eof if there was an error
+ */
+lzlib4_ostreambuf::int_type lzlib4_ostreambuf::overflow(int_type ch) {
+    if (error != LZLIB4_RC_OK || !pptr()) {
+        return traits_type::eof();
+    }
+
+    error = compress_buffer(LZLIB4_NO_FLUSH);
+    if (error != LZLIB4_RC_OK) {
+        return traits_type::eof();
+    }
+
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(ch);
+}
+
+
+/**
+ * @brief The data is not compressed on every flush of the ostream, because that would create small blocks. Only the
+ *        sink is flushed. Use finish() to compress all the data.
+ *
+ * @return int : 0 if everything was right, -1 otherwise
+ */
+int lzlib4_ostreambuf::sync() {
+    if (error != LZLIB4_RC_OK) {
+        return -1;
+    }
+
+    return sink->pubsync();
+}
+
+
+/**
+ * @brief Pass the data of the put area to the compressor and write the compressed blocks into the sink
+ *
+ * @param flush_mode : Flush mode of the compress call
+ * @return int : LZLIB4_RC_OK if everything was right, negative number otherwise.
+ */
+int lzlib4_ostreambuf::compress_buffer(lzlib4_flush_mode flush_mode) {
+    lzlib4_stream &strm = compressor.strm;
+
+    // The data was written directly into the compression buffer, so only the index must be updated
+    strm.state.compress_in_index = pptr() - (char *) strm.state.compress_in_buffer;
+
+    out_buffer.resize(std::max(out_buffer.size(), compressor.compress_bound(0)));
+    strm.next_in = NULL;
+    strm.avail_in = 0;
+    strm.next_out = out_buffer.data();
+    strm.avail_out = out_buffer.size();
+
+    // A work budget only splits the work, the stream must write everything now
+    int return_code;
+    do {
+        return_code = compressor.compress(flush_mode);
+    } while (return_code == LZLIB4_RC_WORK_PENDING);
+    // The compressor can keep data, so the put area starts where the compression buffer index is
+    reset_put_area();
+    if (return_code != LZLIB4_RC_OK) {
+        return return_code;
+    }
+
+    std::streamsize written = strm.next_out - out_buffer.data();
+    if (written && sink->sputn((const char *) out_buffer.data(), written) != written) {
+        return LZLIB4_RC_BUFFER_ERROR;
+    }
+
+    return LZLIB4_RC_OK;
+}
+
+
+void lzlib4_ostreambuf::reset_put_area() {
+    lzlib4_internal_state &state = compressor.strm.state;
+    if (!state.compress_in_buffer) {
+        setp(NULL, NULL);
+        return;
+    }
+
+    char * buffer = (char *) state.compress_in_buffer;
+    setp(buffer + state.compress_in_index, buffer + state.compress_block_size);
+}
+
+
+/**
+ * @brief Attach the stream buffer to a decompressor
+ *
+ * @param decompressor : lzlib4 object used to decompress
+ * @param source : Stream buffer with the compressed data
+ * @param check_crc : Check the CRC of every block
+ */
+lzlib4_istreambuf::lzlib4_istreambuf(lzlib4 &decompressor, std::streambuf * source, bool check_crc) :
+    decompressor(decompressor), source(source), check_crc(check_crc) {
+    in_buffer.resize(LZLIB4_STREAMBUF_INPUT_SIZE);
+    decompressor.strm.next_in = NULL;
+    decompressor.strm.avail_in = 0;
+}
+
+
+/**
+ * @brief Last error returned by the decompressor. A truncated stream returns LZLIB4_RC_NEED_MORE_DATA.
+ *
+ * @return int : LZLIB4_RC_OK if there was no error, negative number otherwise.
+ */
+int lzlib4_istreambuf::last_error() {
+    return error;
+}
+
+
+/**
+ * @brief Called when all the data of the get area was readed. The next block is decompressed and used as get area.
+ *
+ * @return int_type : Next character, or eof at the end of the stream or if there was an error
+ */
+lzlib4_istreambuf::int_type lzlib4_istreambuf::underflow() {
+    lzlib4_stream &strm = decompressor.strm;
+
+    while (error == LZLIB4_RC_OK) {
+        const uint8_t * data = NULL;
+        size_t size = 0;
+
+        error = decompressor.decompress_block(check_crc, &data, &size);
+        if (error != LZLIB4_RC_OK) {
+            break;
+        }
+
+        if (size) {
+            char * block = (char *) data;
+            setg(block, block, block + size);
+            return traits_type::to_int_type(*block);
+        }
+
+        // All the input was consumed without completing a block, so read more compressed data
+        std::streamsize readed = source->sgetn((char *) in_buffer.data(), in_buffer.size());
+        if (readed <= 0) {
+            if (strm.partial_block) {
+                error = LZLIB4_RC_NEED_MORE_DATA;
+            }
+            break;
+        }
+
+        strm.next_in = in_buffer.data();
+        strm.avail_in = readed;
+    }
+
+    setg(NULL, NULL, NULL);
+    return traits_type::eof();
+}
@@ -0,0 +1,80 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Created by Daniel Carrasco at https://www.electrosoftcloud.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * std::streambuf adapters, to use the compressor and the decompressor from iostreams code.
+ *
+ * lzlib4_ostreambuf uses the compression buffer of the lzlib4 object as its put area, so the data written into the
+ * std::ostream is stored directly into the block buffer and compressed from there when the block is full. The
+ * compressed blocks are written to the sink streambuf.
+ *
+ * lzlib4_istreambuf reads the compressed data from the source streambuf and uses the decompressed blocks returned by
+ * lzlib4::decompress_block as its get area, so the std::istream reads directly from the decompression buffers.
+ *
+ * In both cases the lzlib4 object must not be used by other code while the streambuf is using it.
+ **/
+
+#ifndef LZLIB4_STREAMBUF_H
+#define LZLIB4_STREAMBUF_H
+
+#include "lzlib4.h"
+#include <streambuf>
+
+// Compressed data readed from the source streambuf on every read
+#define LZLIB4_STREAMBUF_INPUT_SIZE 65536
+
+class lzlib4_ostreambuf : public std::streambuf {
+    public:
+        lzlib4_ostreambuf(lzlib4 &compressor, std::streambuf * sink);
+        ~lzlib4_ostreambuf();
+        int finish();
+        int last_error();
+
+    protected:
+        int_type overflow(int_type ch) override;
+        int sync() override;
+
+    private:
+        int compress_buffer(lzlib4_flush_mode flush_mode);
+        void reset_put_area();
+
+        lzlib4 &compressor;
+        std::streambuf * sink = NULL;
+        // Output buffer of the compress calls. Is resized to the worst case before every call.
+        std::vector<uint8_t> out_buffer;
+        int error = LZLIB4_RC_OK;
+};
+
+class lzlib4_istreambuf : public std::streambuf {
+    public:
+        lzlib4_istreambuf(lzlib4 &decompressor, std::streambuf * source, bool check_crc = false);
+        int last_error();
+
+    protected:
+        int_type underflow() override;
+
+    private:
+        lzlib4 &decompressor;
+        std::streambuf * source = NULL;
+        bool check_crc = false;
+        std::vector<uint8_t> in_buffer;
+        int error = LZLIB4_RC_OK;
+};
+
+#endif